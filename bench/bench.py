@@ -0,0 +1,246 @@
+#!/usr/bin/env python
+# -*- Mode: Python; tab-width: 4 -*-
+#
+# Scan benchmark for the pyc extension
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by the
+# Free Software Foundation; either version 2, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTIBILITY
+# or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+# for more details.
+# ======================================================================
+
+# Usage:
+#   python gencorpus.py --output corpus
+#   python bench.py --corpus corpus --threads 1,2,4,8 --output new.json
+#   python bench.py --compare base.json new.json
+#
+# Runs offline against the signatures in db/, the result cache is disabled
+# so every pass really scans. Every result is checked against the corpus
+# manifest, a run with mismatches is not worth comparing. --compare exits
+# with 1 when throughput drops or p99 latency grows more than --tolerance.
+
+from __future__ import print_function
+from argparse import ArgumentParser
+from math import ceil
+from os import open as os_open, close as os_close, O_RDONLY
+from os.path import abspath, dirname, join as path_join
+from platform import platform, python_version
+from threading import Thread, Lock
+from time import time
+import json
+import sys
+import pyc
+
+try:
+    from time import perf_counter as clock
+except ImportError:
+    clock = time
+
+try:
+    from resource import getrusage, RUSAGE_SELF
+except ImportError:
+    getrusage = None
+
+HERE = dirname(abspath(__file__))
+
+def peak_rss():
+    if getrusage is None:
+        return None
+    rss = getrusage(RUSAGE_SELF).ru_maxrss
+    # kilobytes everywhere but on darwin
+    if sys.platform == 'darwin':
+        return rss
+    return rss * 1024
+
+# Nearest rank, values must be sorted
+def percentile(values, p):
+    if not values:
+        return 0.0
+    rank = int(ceil(p / 100.0 * len(values))) - 1
+    return values[min(max(rank, 0), len(values) - 1)]
+
+class Runner:
+    def __init__(self, engine, api, files):
+        self.engine = engine
+        self.api = api
+        self.files = files
+        self.lock = Lock()
+        self.next = 0
+        self.latencies = []
+        self.mismatches = []
+        self.errors = []
+
+    def scan(self, path):
+        if self.api == 'scanFile':
+            return self.engine.scanFile(path)
+        fd = os_open(path, O_RDONLY)
+        try:
+            return self.engine.scanDesc(fd)
+        finally:
+            os_close(fd)
+
+    def worker(self):
+        latencies, mismatches, errors = [], [], []
+        while True:
+            self.lock.acquire()
+            index = self.next
+            self.next += 1
+            self.lock.release()
+            if index >= len(self.files):
+                break
+            name, path, infected = self.files[index]
+            start = clock()
+            try:
+                found, virus = self.scan(path)
+            except Exception:
+                errors.append((name, str(sys.exc_info()[1])))
+                continue
+            latencies.append(clock() - start)
+            if bool(found) != infected:
+                mismatches.append((name, virus))
+        self.lock.acquire()
+        self.latencies.extend(latencies)
+        self.mismatches.extend(mismatches)
+        self.errors.extend(errors)
+        self.lock.release()
+
+    def run(self, threads):
+        workers = [ Thread(target=self.worker) for i in range(threads) ]
+        start = clock()
+        for t in workers:
+            t.start()
+        for t in workers:
+            t.join()
+        return clock() - start
+
+def bench(args):
+    manifest = json.load(open(path_join(args.corpus, 'MANIFEST.json')))
+    files = sorted((name, path_join(args.corpus, name), entry['infected'])
+                   for name, entry in manifest['files'].items())
+    total = sum(entry['size'] for entry in manifest['files'].values())
+
+    engine = pyc.Engine(args.db)
+    engine.setCacheSize(0)
+    # the defaults (25M and 100M) would stop scanning the larger sweep
+    # files early and miss the EICAR at their end, engine limits are 32 bits
+    limit = min(2 * max(entry['size'] for entry in manifest['files'].values()), 0xffffffff)
+    engine.setEngineOption('max-filesize', limit)
+    engine.setEngineOption('max-scansize', limit)
+    start = clock()
+    report = engine.loadDB()
+    dbload = clock() - start
+
+    results = { 'meta': { 'pyc': pyc.__version__,
+                          'libclamav': engine.getVersions()[0],
+                          'python': python_version(),
+                          'platform': platform(),
+                          'corpus_seed': manifest['seed'],
+                          'corpus_files': len(files),
+                          'corpus_bytes': total,
+                          'date': int(time()) },
+                'db': { 'path': abspath(args.db),
+                        'sigs': report['sigs'],
+                        'load_time': dbload,
+                        'libclamav_load_time': report['load_time'],
+                        'compile_time': report['compile_time'] },
+                'runs': [] }
+
+    # warm up the page cache, not measured
+    for i in range(args.warmup):
+        Runner(engine, 'scanFile', files).run(max(args.threads))
+
+    for api in args.api:
+        for threads in args.threads:
+            for r in range(args.repeat):
+                runner = Runner(engine, api, files)
+                elapsed = runner.run(threads)
+                latencies = sorted(runner.latencies)
+                run = { 'api': api,
+                        'threads': threads,
+                        'repeat': r,
+                        'seconds': elapsed,
+                        'files': len(latencies),
+                        'files_per_s': len(latencies) / elapsed,
+                        'mb_per_s': total / 1048576.0 / elapsed,
+                        'p50_ms': percentile(latencies, 50) * 1000,
+                        'p99_ms': percentile(latencies, 99) * 1000,
+                        'p999_ms': percentile(latencies, 99.9) * 1000,
+                        'mismatches': len(runner.mismatches),
+                        'errors': len(runner.errors) }
+                results['runs'].append(run)
+                print('%-10s %3d threads: %8.1f files/s %8.1f MB/s p50 %7.2f ms p99 %7.2f ms p99.9 %7.2f ms' %
+                      (api, threads, run['files_per_s'], run['mb_per_s'], run['p50_ms'], run['p99_ms'], run['p999_ms']))
+                for name, virus in runner.mismatches[:5]:
+                    print('  mismatch %s: %s' % (name, virus))
+                for name, error in runner.errors[:5]:
+                    print('  error %s: %s' % (name, error))
+
+    results['peak_rss'] = peak_rss()
+    print('db load %.2fs (%d sigs), peak RSS %s' % (dbload, report['sigs'], results['peak_rss']))
+
+    if args.output:
+        f = open(args.output, 'w')
+        json.dump(results, f, indent=1, sort_keys=True)
+        f.close()
+
+    if any(run['mismatches'] or run['errors'] for run in results['runs']):
+        return 2
+    return 0
+
+# Best run of each api/threads pair, repeats only smooth out noise
+def best_runs(results):
+    best = {}
+    for run in results['runs']:
+        key = (run['api'], run['threads'])
+        if key not in best or run['files_per_s'] > best[key]['files_per_s']:
+            best[key] = run
+    return best
+
+def compare(args):
+    base = best_runs(json.load(open(args.compare[0])))
+    new = best_runs(json.load(open(args.compare[1])))
+    failed = False
+
+    for key in sorted(set(base) & set(new)):
+        b, n = base[key], new[key]
+        throughput = n['files_per_s'] / b['files_per_s'] - 1
+        latency = n['p99_ms'] / b['p99_ms'] - 1 if b['p99_ms'] else 0.0
+        bad = throughput < -args.tolerance or latency > args.tolerance
+        failed = failed or bad
+        print('%-10s %3d threads: files/s %+6.1f%% p99 %+6.1f%%%s' %
+              (key[0], key[1], throughput * 100, latency * 100, '  REGRESSION' if bad else ''))
+
+    return 1 if failed else 0
+
+def int_list(value):
+    return [ int(v) for v in value.split(',') ]
+
+def str_list(value):
+    return value.split(',')
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description='Benchmark pyc scans')
+    parser.add_argument('--corpus', default='corpus', help='corpus directory (default: %(default)s)')
+    parser.add_argument('--db', default=path_join(HERE, 'db'), help='signature directory (default: bench/db)')
+    parser.add_argument('--threads', type=int_list, default='1,2,4,8', help='thread counts (default: %(default)s)')
+    parser.add_argument('--api', type=str_list, default='scanFile,scanDesc', help='apis to drive (default: %(default)s)')
+    parser.add_argument('--repeat', type=int, default=3, help='runs of each configuration (default: %(default)s)')
+    parser.add_argument('--warmup', type=int, default=1, help='unmeasured passes first (default: %(default)s)')
+    parser.add_argument('--output', help='write the results as json')
+    parser.add_argument('--compare', nargs=2, metavar=('BASE', 'NEW'), help='compare two result files')
+    parser.add_argument('--tolerance', type=float, default=0.10,
+                        help='allowed regression for --compare (default: %(default)s)')
+    args = parser.parse_args()
+
+    for api in args.api or []:
+        if api not in ('scanFile', 'scanDesc'):
+            parser.error('unknown api %s' % api)
+
+    if args.compare:
+        sys.exit(compare(args))
+    sys.exit(bench(args))
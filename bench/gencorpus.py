@@ -0,0 +1,244 @@
+#!/usr/bin/env python
+# -*- Mode: Python; tab-width: 4 -*-
+#
+# Deterministic scan corpus for bench.py
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by the
+# Free Software Foundation; either version 2, or (at your option) any later
+# version.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTIBILITY
+# or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+# for more details.
+# ======================================================================
+
+# The same seed always gives the same bytes, archives carry fixed
+# timestamps and owners. MANIFEST.json lists every file with its size
+# and whether the bundled db/ should detect it, bench.py checks results
+# against it.
+
+from __future__ import print_function
+from argparse import ArgumentParser
+from base64 import b64encode
+from hashlib import sha256
+from io import BytesIO
+from os import makedirs
+from os.path import exists, join as path_join
+from random import Random
+from struct import pack
+from zipfile import ZipFile, ZipInfo, ZIP_DEFLATED, ZIP_STORED
+import gzip
+import json
+
+EICAR = '*H+H$!ELIF-TSET-SURIVITNA-DRADNATS-RACIE$}7)CC7)^P(45XZP\\4[PA@%P!O5X'[::-1].encode('ascii')
+
+SIZES = [ ('1K', 1 << 10), ('10K', 10 << 10), ('100K', 100 << 10),
+          ('1M', 1 << 20), ('10M', 10 << 20), ('100M', 100 << 20) ]
+
+CHUNK = 1 << 16
+
+class Corpus:
+    def __init__(self, root, seed):
+        self.root = root
+        self.seed = seed
+        self.random = Random(seed)
+        self.block = bytes(bytearray(self.random.getrandbits(8) for i in range(CHUNK)))
+        self.files = {}
+
+    # randrange() changed between python versions, getrandbits() didn't
+    def below(self, n):
+        return self.random.getrandbits(32) % n
+
+    # Pseudo random bytes, chunks of the block are tagged with their
+    # position so large files don't repeat themselves
+    def noise(self, size, tag=0):
+        out = []
+        for i in range(0, size, CHUNK):
+            out.append(pack('<QQ', tag, i) + self.block[16:min(CHUNK, size - i)])
+        return b''.join(out)[:size]
+
+    def text(self, size):
+        words = [ 'lorem', 'ipsum', 'dolor', 'sit', 'amet', 'scan', 'engine', 'pyc', 'bench', 'data' ]
+        out, total = [], 0
+        while total < size:
+            word = words[self.below(len(words))]
+            out.append(word)
+            total += len(word) + 1
+        return ' '.join(out).encode('ascii')[:size]
+
+    def add(self, name, data, infected):
+        path = path_join(self.root, name)
+        folder = path.rsplit('/', 1)[0]
+        if not exists(folder):
+            makedirs(folder)
+        f = open(path, 'wb')
+        f.write(data)
+        f.close()
+        self.files[name] = { 'size': len(data), 'infected': infected,
+                             'sha256': sha256(data).hexdigest() }
+
+    # Minimal but well formed headers, libclamav types them as PE and ELF
+    def pe(self, size, infected, tag):
+        dos = b'MZ' + b'\0' * 58 + pack('<I', 64)
+        coff = b'PE\0\0' + pack('<HHIIIHH', 0x14c, 1, 0, 0, 0, 224, 0x102)
+        optional = pack('<HBBIIIIIII', 0x10b, 8, 0, 0x200, 0, 0, 0x1000, 0x1000, 0x2000, 0x400000)
+        optional += pack('<IIHHHHHHIIIIHHIIIIII', 0x1000, 0x200, 4, 0, 0, 0, 4, 0,
+                         0, 0x2000, 0x200, 0, 2, 0, 0x100000, 0x1000, 0x100000, 0x1000, 0, 16)
+        optional += b'\0' * (224 - len(optional))
+        section = b'.text\0\0\0' + pack('<IIIIIIHHI', 0x1000, 0x1000, 0x200, 0x200, 0, 0, 0, 0, 0x60000020)
+        header = dos + coff + optional + section
+        header += b'\0' * (0x200 - len(header))
+        return self.body(header, size, infected, tag)
+
+    def elf(self, size, infected, tag):
+        header = b'\x7fELF' + pack('<BBBB8x', 2, 1, 1, 0)
+        header += pack('<HHIQQQIHHHHHH', 2, 62, 1, 0x400078, 64, 0, 0, 64, 56, 1, 64, 0, 0)
+        header += pack('<IIQQQQQQ', 1, 5, 0, 0x400000, 0x400000, size, size, 0x1000)
+        return self.body(header, size, infected, tag)
+
+    def body(self, header, size, infected, tag):
+        data = header + self.noise(max(size - len(header), 0), tag)
+        if infected:
+            middle = len(data) // 2
+            data = data[:middle] + EICAR + data[middle + len(EICAR):]
+        return data
+
+    def zip(self, members, compression=ZIP_DEFLATED):
+        out = BytesIO()
+        z = ZipFile(out, 'w', compression)
+        for name, data in members:
+            info = ZipInfo(name, (2000, 1, 1, 0, 0, 0))
+            info.compress_type = compression
+            info.external_attr = 0o644 << 16
+            z.writestr(info, data)
+        z.close()
+        return out.getvalue()
+
+    # tarfile headers differ between python versions, this one doesn't
+    def tar(self, members, compress=False):
+        out = []
+        for name, data in members:
+            fields = [ name.encode('ascii').ljust(100, b'\0'), b'0000644\0', b'0000000\0', b'0000000\0',
+                       ('%011o\0' % len(data)).encode('ascii'), b'00000000000\0', b' ' * 8, b'0',
+                       b'\0' * 100, b'ustar\0', b'00', b'\0' * 32, b'\0' * 32,
+                       b'0000000\0', b'0000000\0', b'\0' * 167 ]
+            header = b''.join(fields)
+            checksum = sum(bytearray(header))
+            header = header[:148] + ('%06o\0 ' % checksum).encode('ascii') + header[156:]
+            out.append(header + data + b'\0' * (-len(data) % 512))
+        out.append(b'\0' * 1024)
+        data = b''.join(out)
+        if compress:
+            buf = BytesIO()
+            z = gzip.GzipFile(fileobj=buf, mode='wb', mtime=0)
+            z.write(data)
+            z.close()
+            data = buf.getvalue()
+        return data
+
+    def mail(self, index, attachment):
+        body = self.text(2048 + self.below(8192))
+        lines = [ 'From: bench%d@example.com' % index,
+                  'To: scanner@example.com',
+                  'Subject: pyc bench message %d' % index,
+                  'Date: Sat, 01 Jan 2000 00:00:00 +0000',
+                  'MIME-Version: 1.0',
+                  'Content-Type: multipart/mixed; boundary="pycbench"',
+                  '',
+                  '--pycbench',
+                  'Content-Type: text/plain; charset=us-ascii',
+                  '',
+                  body.decode('ascii'),
+                  '--pycbench',
+                  'Content-Type: application/octet-stream; name="attachment.bin"',
+                  'Content-Transfer-Encoding: base64',
+                  'Content-Disposition: attachment; filename="attachment.bin"',
+                  '' ]
+        encoded = b64encode(attachment).decode('ascii')
+        lines.extend(encoded[i:i + 76] for i in range(0, len(encoded), 76))
+        lines.extend([ '--pycbench--', '' ])
+        return '\r\n'.join(lines).encode('ascii')
+
+    def pdf(self, payload):
+        objects = [ b'<< /Type /Catalog /Pages 2 0 R >>',
+                    b'<< /Type /Pages /Kids [3 0 R] /Count 1 >>',
+                    b'<< /Type /Page /Parent 2 0 R /MediaBox [0 0 612 792] /Contents 4 0 R >>',
+                    b'<< /Length ' + str(len(payload)).encode('ascii') + b' >>\nstream\n' + payload + b'\nendstream' ]
+        out = b'%PDF-1.4\n'
+        offsets = []
+        for i, obj in enumerate(objects):
+            offsets.append(len(out))
+            out += str(i + 1).encode('ascii') + b' 0 obj\n' + obj + b'\nendobj\n'
+        xref = len(out)
+        out += b'xref\n0 ' + str(len(objects) + 1).encode('ascii') + b'\n0000000000 65535 f \n'
+        for offset in offsets:
+            out += ('%010d 00000 n \n' % offset).encode('ascii')
+        out += b'trailer\n<< /Size ' + str(len(objects) + 1).encode('ascii') + b' /Root 1 0 R >>\n'
+        out += b'startxref\n' + str(xref).encode('ascii') + b'\n%%EOF\n'
+        return out
+
+    def generate(self, count, maxsize):
+        for i in range(count):
+            infected = (i % 4) == 0
+            kind = 'eicar' if infected else 'clean'
+            size = 4096 << self.below(8)
+            self.add('pe/%s-%03d.exe' % (kind, i), self.pe(size, infected, i), infected)
+            self.add('elf/%s-%03d' % (kind, i), self.elf(size, infected, i), infected)
+
+        for i in range(count):
+            infected = (i % 4) == 0
+            kind = 'eicar' if infected else 'clean'
+            inner = self.elf(16384, infected, 1000 + i)
+            members = [ ('readme.txt', self.text(4096)), ('bin/tool', inner) ]
+            self.add('archive/%s-%03d.zip' % (kind, i), self.zip(members), infected)
+            self.add('archive/%s-%03d.tar' % (kind, i), self.tar(members), infected)
+            self.add('archive/%s-%03d.tar.gz' % (kind, i), self.tar(members, True), infected)
+            # zip in tar.gz in zip
+            nested = self.zip([ ('inner.tar.gz', self.tar([ ('inner.zip', self.zip(members)) ], True)) ], ZIP_STORED)
+            self.add('archive/%s-nested-%03d.zip' % (kind, i), nested, infected)
+
+        for i in range(count):
+            infected = (i % 4) == 0
+            kind = 'eicar' if infected else 'clean'
+            attachment = self.pe(8192, infected, 2000 + i)
+            self.add('mail/%s-%03d.eml' % (kind, i), self.mail(i, attachment), infected)
+            payload = self.text(4096 + self.below(16384))
+            if infected:
+                payload += b'\n' + EICAR
+            self.add('pdf/%s-%03d.pdf' % (kind, i), self.pdf(payload), infected)
+
+        for name, size in SIZES:
+            if size > maxsize:
+                break
+            self.add('sweep/clean-%s.bin' % name, self.noise(size, 3000 + size), False)
+            data = self.noise(size, 4000 + size)
+            data = data[:max(size - len(EICAR), 0)] + EICAR
+            self.add('sweep/eicar-%s.bin' % name, data, True)
+
+        manifest = { 'seed': self.seed, 'files': self.files }
+        f = open(path_join(self.root, 'MANIFEST.json'), 'w')
+        json.dump(manifest, f, indent=1, sort_keys=True, separators=(',', ': '))
+        f.close()
+
+def size_t(value):
+    value = value.strip().upper()
+    for suffix, shift in (('K', 10), ('M', 20), ('G', 30)):
+        if value.endswith(suffix):
+            return int(value[:-1]) << shift
+    return int(value)
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description='Generate the pyc benchmark corpus')
+    parser.add_argument('--output', default='corpus', help='corpus directory (default: %(default)s)')
+    parser.add_argument('--seed', type=int, default=20140101, help='random seed (default: %(default)s)')
+    parser.add_argument('--count', type=int, default=20, help='files per type (default: %(default)s)')
+    parser.add_argument('--max-size', type=size_t, default='100M',
+                        help='largest file of the size sweep (default: %(default)s)')
+    args = parser.parse_args()
+
+    corpus = Corpus(args.output, args.seed)
+    corpus.generate(args.count, args.max_size)
+    total = sum(f['size'] for f in corpus.files.values())
+    print('%d files, %.1f MB in %s' % (len(corpus.files), total / 1048576.0, args.output))
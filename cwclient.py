@@ -1,7 +1,7 @@
 #!/usr/bin/env python
 # -*- Mode: Python; tab-width: 4 -*-
 #
-# Client for clamd - old proto (newline)
+# Load generator for clamd and cwd.py
 #
 # Copyright (C) 2009 Gianluigi Tiesi <sherpya@netfarm.it>
 #
@@ -16,40 +16,363 @@
 # for more details.
 # ======================================================================
 
+# Usage:
+#   cwclient.py --port 3310 --connections 16 --rate 200 --duration 30 \
+#               --mix INSTREAM=6,SCAN=2,CONTSCAN=1,SESSION=1 --path /srv/samples
+#
+# Requests are sent open loop: a scheduler issues them at --rate per second
+# whether or not earlier ones completed, the connections pick them up in
+# order and latency is measured from the time a request was due, so a
+# stalled server shows up as latency instead of a lower request rate.
+# --rate 0 runs closed loop, each connection sends as soon as it's done.
+# Commands use clamd's newline protocol, SESSION is an IDSESSION with
+# --session-commands INSTREAMs, both clamd and cwd.py understand them.
+
+from __future__ import print_function
+from argparse import ArgumentParser
+from math import ceil
+from os.path import abspath
+from random import Random
 from socket import socket, AF_INET, SOCK_STREAM
-from os import getcwd
-from os.path import join as path_join
+from struct import pack
+from threading import Thread, Lock
+from time import time, sleep
+import json
+import sys
+
+try:
+    from socket import AF_UNIX
+except ImportError:
+    AF_UNIX = None
+
+try:
+    from Queue import Queue
+except ImportError:
+    from queue import Queue
+
+EICAR='*H+H$!ELIF-TSET-SURIVITNA-DRADNATS-RACIE$}7)CC7)^P(45XZP\\4[PA@%P!O5X'[::-1].encode('ascii')
+
+COMMANDS = [ 'SCAN', 'CONTSCAN', 'STREAM', 'INSTREAM', 'SESSION' ]
+
+# Latencies in log2 buckets of microseconds, percentiles come from the
+# sorted samples
+class Stats:
+    BUCKETS = 32
+
+    def __init__(self):
+        self.samples = []
+        self.ok = self.found = self.errors = 0
+
+    def add(self, latency, status):
+        self.samples.append(latency)
+        if status == 'FOUND':
+            self.found += 1
+        elif status == 'ERROR':
+            self.errors += 1
+        else:
+            self.ok += 1
+
+    def percentile(self, values, p):
+        if not values:
+            return 0.0
+        rank = int(ceil(p / 100.0 * len(values))) - 1
+        return values[min(max(rank, 0), len(values) - 1)]
+
+    def histogram(self):
+        buckets = [ 0 ] * self.BUCKETS
+        for latency in self.samples:
+            us, bucket = int(latency * 1000000), 0
+            while us > 1 and bucket < self.BUCKETS - 1:
+                us >>= 1
+                bucket += 1
+            buckets[bucket] += 1
+        while buckets and not buckets[-1]:
+            buckets.pop()
+        return buckets
+
+    def report(self, elapsed):
+        values = sorted(self.samples)
+        return { 'requests': len(values),
+                 'ok': self.ok,
+                 'found': self.found,
+                 'errors': self.errors,
+                 'rate': len(values) / elapsed if elapsed else 0.0,
+                 'p50_ms': self.percentile(values, 50) * 1000,
+                 'p90_ms': self.percentile(values, 90) * 1000,
+                 'p99_ms': self.percentile(values, 99) * 1000,
+                 'p999_ms': self.percentile(values, 99.9) * 1000,
+                 'max_ms': (values[-1] if values else 0.0) * 1000,
+                 'histogram_us_log2': self.histogram() }
+
+class Client:
+    def __init__(self, args):
+        self.args = args
+        self.data = EICAR
+        if args.data:
+            f = open(args.data, 'rb')
+            self.data = f.read()
+            f.close()
+
+    def connect(self):
+        if self.args.socket:
+            s = socket(AF_UNIX, SOCK_STREAM)
+            s.settimeout(self.args.timeout)
+            s.connect(self.args.socket)
+        else:
+            s = socket(AF_INET, SOCK_STREAM)
+            s.settimeout(self.args.timeout)
+            s.connect((self.args.host, self.args.port))
+        return s
+
+    # The server closes the connection once a command outside a session
+    # is answered, CONTSCAN of a directory may answer with many lines
+    def readall(self, s):
+        data = []
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            data.append(chunk)
+        return b''.join(data).decode('latin-1')
+
+    def readline(self, s, buf):
+        while b'\n' not in buf[0]:
+            chunk = s.recv(4096)
+            if not chunk:
+                raise IOError('connection closed')
+            buf[0] += chunk
+        line, buf[0] = buf[0].split(b'\n', 1)
+        return line.decode('latin-1')
+
+    def instream(self, s):
+        size = self.args.chunk
+        for i in range(0, len(self.data), size):
+            chunk = self.data[i:i + size]
+            s.sendall(pack('!L', len(chunk)) + chunk)
+        s.sendall(pack('!L', 0))
+
+    def status(self, reply):
+        if not reply.strip():
+            return 'ERROR'
+        if 'ERROR' in reply or 'UNKNOWN COMMAND' in reply:
+            return 'ERROR'
+        if 'FOUND' in reply:
+            return 'FOUND'
+        return 'OK'
+
+    def request(self, command):
+        s = self.connect()
+        try:
+            if command == 'SCAN' or command == 'CONTSCAN':
+                s.sendall(('n%s %s\n' % (command, self.args.path)).encode('latin-1'))
+                return self.status(self.readall(s))
+
+            if command == 'INSTREAM':
+                s.sendall(b'nINSTREAM\n')
+                self.instream(s)
+                return self.status(self.readall(s))
+
+            if command == 'STREAM':
+                buf = [ b'' ]
+                s.sendall(b'nSTREAM\n')
+                port = int(self.readline(s, buf).strip().split('PORT ', 1).pop())
+                host = self.args.host if not self.args.socket else '127.0.0.1'
+                d = socket(AF_INET, SOCK_STREAM)
+                d.settimeout(self.args.timeout)
+                d.connect((host, port))
+                d.sendall(self.data)
+                d.close()
+                return self.status(buf[0].decode('latin-1') + self.readall(s))
 
-EICAR='*H+H$!ELIF-TSET-SURIVITNA-DRADNATS-RACIE$}7)CC7)^P(45XZP\\4[PA@%P!O5X'[::-1]
+            # SESSION, replies may come back in any order
+            buf = [ b'' ]
+            count = self.args.session_commands
+            s.sendall(b'nIDSESSION\n')
+            for i in range(count):
+                s.sendall(b'nINSTREAM\n')
+                self.instream(s)
+            replies = [ self.readline(s, buf) for i in range(count) ]
+            s.sendall(b'nEND\n')
+            statuses = [ self.status(reply) for reply in replies ]
+            for status in ('ERROR', 'FOUND'):
+                if status in statuses:
+                    return status
+            return 'OK'
+        finally:
+            s.close()
 
-def connect():
-    s = socket(AF_INET, SOCK_STREAM)
-    s.connect(('localhost', 3310))
-    f = s.makefile('rw', 0)
-    return f
+class Load:
+    def __init__(self, args):
+        self.args = args
+        self.client = Client(args)
+        self.random = Random(args.seed)
+        self.mix = []
+        for item in args.mix.split(','):
+            command, weight = (item.split('=', 1) + [ '1' ])[:2]
+            command = command.strip().upper()
+            if command not in COMMANDS:
+                raise ValueError('unknown command %s' % command)
+            self.mix.extend([ command ] * int(weight))
+        self.queue = Queue()
+        self.lock = Lock()
+        self.stats = dict((command, Stats()) for command in set(self.mix))
+        self.failures = {}
+        self.issued = 0
+
+    def pick(self):
+        return self.mix[self.random.randrange(len(self.mix))]
+
+    def done(self, command, due, status, error=None):
+        latency = time() - due
+        self.lock.acquire()
+        self.stats[command].add(latency, status)
+        if error is not None:
+            self.failures[error] = self.failures.get(error, 0) + 1
+        self.lock.release()
+
+    def execute(self, command, due):
+        try:
+            status = self.client.request(command)
+            self.done(command, due, status)
+        except Exception:
+            self.done(command, due, 'ERROR', '%s: %s' % (command, sys.exc_info()[1]))
+
+    def worker(self):
+        while True:
+            item = self.queue.get()
+            if item is None:
+                return
+            self.execute(*item)
+
+    def closed_worker(self, end):
+        while time() < end and not self.full():
+            self.lock.acquire()
+            command = self.pick()
+            self.issued += 1
+            self.lock.release()
+            self.execute(command, time())
+
+    def full(self):
+        return self.args.requests and self.issued >= self.args.requests
+
+    # Requests are due at fixed intervals, or exponential ones with
+    # --poisson, the schedule never waits for the connections
+    def schedule(self, start, end):
+        due = start
+        while due < end and not self.full():
+            now = time()
+            if due > now:
+                sleep(due - now)
+            self.queue.put((self.pick(), due))
+            self.issued += 1
+            if self.args.poisson:
+                due += self.random.expovariate(self.args.rate)
+            else:
+                due += 1.0 / self.args.rate
+
+    def run(self):
+        args = self.args
+        start = time()
+        end = start + args.duration
+
+        if args.rate > 0:
+            threads = [ Thread(target=self.worker) for i in range(args.connections) ]
+        else:
+            threads = [ Thread(target=self.closed_worker, args=(end,)) for i in range(args.connections) ]
+        for t in threads:
+            t.daemon = True
+            t.start()
+
+        if args.rate > 0:
+            self.schedule(start, end)
+            # what's still queued is late, it's measured once served
+            for t in threads:
+                self.queue.put(None)
+
+        deadline = max(time(), end) + args.drain
+        for t in threads:
+            t.join(max(deadline - time(), 0))
+
+        elapsed = time() - start
+        self.lock.acquire()
+        total = Stats()
+        for stats in self.stats.values():
+            total.samples.extend(stats.samples)
+            total.ok += stats.ok
+            total.found += stats.found
+            total.errors += stats.errors
+        self.lock.release()
+
+        return { 'target': { 'host': args.socket or '%s:%d' % (args.host, args.port),
+                             'connections': args.connections,
+                             'rate': args.rate,
+                             'poisson': args.poisson,
+                             'duration': args.duration,
+                             'mix': args.mix },
+                 'elapsed': elapsed,
+                 'issued': self.issued,
+                 'unserved': self.issued - len(total.samples),
+                 'total': total.report(elapsed),
+                 'commands': dict((command, stats.report(elapsed)) for command, stats in self.stats.items()),
+                 'failures': self.failures }
+
+def show(results):
+    print('%-9s %8s %8s %6s %6s %9s %9s %9s %9s %9s' %
+          ('command', 'requests', 'req/s', 'found', 'errors', 'p50 ms', 'p90 ms', 'p99 ms', 'p99.9 ms', 'max ms'))
+    rows = sorted(results['commands'].items()) + [ ('total', results['total']) ]
+    for command, r in rows:
+        print('%-9s %8d %8.1f %6d %6d %9.2f %9.2f %9.2f %9.2f %9.2f' %
+              (command, r['requests'], r['rate'], r['found'], r['errors'],
+               r['p50_ms'], r['p90_ms'], r['p99_ms'], r['p999_ms'], r['max_ms']))
+
+    print('\nlatency histogram (all commands)')
+    histogram = results['total']['histogram_us_log2']
+    peak = max(histogram) if histogram else 0
+    for bucket, count in enumerate(histogram):
+        if count:
+            print('  < %10.3f ms %8d %s' % ((1 << (bucket + 1)) / 1000.0, count, '#' * int(40 * count / peak)))
+
+    if results['unserved']:
+        print('\n%d requests were never served' % results['unserved'])
+    for error, count in sorted(results['failures'].items()):
+        print('%6d x %s' % (count, error))
 
 if __name__ == '__main__':
-    f = connect()
-    f.write('SESSION\n')
-    filename = path_join(getcwd(), 'clam.exe')
-    f.write('SCAN ' + filename + '\n')
-    print f.readline().strip()
-
-    f.write('STREAM\n')
-    port = int(f.readline().strip().split('PORT ', 1).pop())
-    s = socket(AF_INET, SOCK_STREAM)
-    s.connect(('localhost', port))
-    s.send(EICAR)
-    s.close()
-    print f.readline().strip()
-
-    f.write('STREAM\n')
-    port = int(f.readline().strip().split('PORT ', 1).pop())
-    s = socket(AF_INET, SOCK_STREAM)
-    s.connect(('localhost', port))
-    s.send(open('clam.exe', 'rb').read())
-    s.close()
-    print f.readline().strip()
-
-    f.write('END\n')
-    f.close()
+    parser = ArgumentParser(description='Load generator for clamd and cwd.py')
+    parser.add_argument('--host', default='localhost', help='server address (default: %(default)s)')
+    parser.add_argument('--port', type=int, default=3310, help='server port (default: %(default)s)')
+    parser.add_argument('--socket', help='unix socket of the server, instead of host and port')
+    parser.add_argument('--connections', type=int, default=1, help='concurrent connections (default: %(default)s)')
+    parser.add_argument('--rate', type=float, default=0, help='requests per second, 0 for closed loop (default: %(default)s)')
+    parser.add_argument('--poisson', action='store_true', help='exponential intervals between requests')
+    parser.add_argument('--duration', type=float, default=10, help='seconds of load (default: %(default)s)')
+    parser.add_argument('--requests', type=int, default=0, help='stop after this many requests, 0 for no limit')
+    parser.add_argument('--drain', type=float, default=30, help='seconds to wait for late requests (default: %(default)s)')
+    parser.add_argument('--mix', default='INSTREAM', help='COMMAND=weight,... of %s (default: %%(default)s)' % ', '.join(COMMANDS))
+    parser.add_argument('--path', default='clam.exe', help='server side path for SCAN and CONTSCAN (default: %(default)s)')
+    parser.add_argument('--data', help='file sent by STREAM and INSTREAM (default: the EICAR test string)')
+    parser.add_argument('--chunk', type=int, default=65536, help='INSTREAM chunk size (default: %(default)s)')
+    parser.add_argument('--session-commands', type=int, default=4, help='INSTREAMs per SESSION (default: %(default)s)')
+    parser.add_argument('--timeout', type=float, default=60, help='socket timeout in seconds (default: %(default)s)')
+    parser.add_argument('--seed', type=int, default=0, help='seed of the command mix (default: %(default)s)')
+    parser.add_argument('--json', help='write the results to this file')
+    args = parser.parse_args()
+
+    if args.socket and AF_UNIX is None:
+        parser.error('unix sockets are not available here')
+    if args.connections < 1:
+        parser.error('at least one connection is needed')
+    args.path = abspath(args.path)
+
+    try:
+        load = Load(args)
+    except ValueError:
+        parser.error(str(sys.exc_info()[1]))
+
+    results = load.run()
+    show(results)
+
+    if args.json:
+        f = open(args.json, 'w')
+        json.dump(results, f, indent=1, sort_keys=True)
+        f.close()
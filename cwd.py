@@ -16,79 +16,644 @@
 # for more details.
 # ======================================================================
 
-from asynchat import async_chat
-from asyncore import dispatcher, loop
-from socket import socket, AF_INET, SOCK_STREAM
-from select import select
+from socket import socket, error as socket_error, AF_INET, SOCK_STREAM, MSG_PEEK
+from socket import SOL_SOCKET, SO_REUSEADDR
+from select import select, error as select_error
+from struct import unpack, calcsize
 from sys import stdout, exc_info, exit as sys_exit
-from tempfile import mkstemp
-from time import time
-from os import walk, unlink, write as os_write, close as os_close
-from os.path import isfile, isdir, join as path_join
+from time import time, sleep
+from signal import signal, SIGTERM, SIGHUP, SIG_DFL
+from traceback import print_exc
+from errno import EAGAIN, EWOULDBLOCK, EINTR
+from fcntl import fcntl, F_GETFL, F_SETFL
+from os import walk, unlink, pipe, fork, kill, getpid, getppid, waitpid, WNOHANG, _exit, O_NONBLOCK
+from os import stat as os_stat, fstat as os_fstat, read as os_read, write as os_write, close as os_close
+from os.path import isfile, isdir, exists, join as path_join
+from stat import S_ISSOCK
+from threading import Thread, Condition, current_thread
+from collections import deque
 import pyc
 
-class CwdHandler(async_chat):
+try:
+    from socket import AF_UNIX
+except ImportError:
+    AF_UNIX = None
+
+try:
+    from socket import SCM_RIGHTS, CMSG_SPACE
+    recvfd = None
+except ImportError:
+    # Python 2 has no socket.recvmsg
+    try:
+        from _multiprocessing import recvfd
+    except ImportError:
+        recvfd = None
+
+try:
+    from select import epoll, EPOLLIN, EPOLLOUT, EPOLLERR, EPOLLHUP
+except ImportError:
+    epoll = None
+
+# Replies a worker may queue for a slow client before it has to wait
+OUTPUT_HIGHWATER = 256 * 1024
+
+# Longest command line, the rest would never be a valid command
+MAX_LINE = 64 * 1024
+
+class CwdAbort(Exception):
+    pass
+
+# A class of requests with its own queue, requests are turned away
+# once maxqueue of them or maxbytes of stream data wait in it. A lane
+# never runs more than threads tasks at once
+class CwLane:
+    def __init__(self, name, weight, threads, maxqueue, maxbytes):
+        self.name = name
+        self.weight = max(weight, 1)
+        self.threads = max(threads, 1)
+        self.maxqueue = max(maxqueue, 1)
+        self.maxbytes = maxbytes
+        self.tasks = deque()
+        self.bytes = 0
+        self.running = 0
+        self.current = 0
+        self.rejected = 0
+
+# Fixed set of threads running scans, pyc releases the GIL while
+# scanning so they really run in parallel. Idle threads take the next
+# task by smooth weighted round robin among the lanes with work, so a
+# lane gets its share of the threads under load and all of them when
+# alone. Connections stop taking commands while queue tasks are waiting
+class CwWorkerPool:
+    def __init__(self, threads, queue, lanes):
+        self.lock = Condition()
+        self.size = max(threads, 1)
+        self.queue = max(queue, 1)
+        self.lanes = lanes
+        self.queued = 0
+        for i in range(self.size):
+            t = Thread(target=self.worker)
+            t.setDaemon(True)
+            t.start()
+
+    def worker(self):
+        while True:
+            self.lock.acquire()
+            try:
+                lane = self.pick()
+                while lane is None:
+                    self.lock.wait()
+                    lane = self.pick()
+                func, args, callback, size = lane.tasks.popleft()
+                lane.bytes = lane.bytes - size
+                lane.running = lane.running + 1
+                self.queued = self.queued - 1
+            finally:
+                self.lock.release()
+            try:
+                result = func(*args)
+            except:
+                t, val, tb = exc_info()
+                result = (None, 'ERROR', str(val))
+            self.lock.acquire()
+            lane.running = lane.running - 1
+            # the lane may have been held back by its thread limit
+            self.lock.notify()
+            self.lock.release()
+            callback(result)
+
+    def pick(self):
+        best, total = None, 0
+        for lane in self.lanes:
+            if lane.tasks and lane.running < lane.threads:
+                lane.current = lane.current + lane.weight
+                total = total + lane.weight
+                if best is None or lane.current > best.current:
+                    best = lane
+        if best is not None:
+            best.current = best.current - total
+        return best
+
+    # callback is invoked from the worker thread
+    def apply_async(self, lane, func, args, callback, size=0):
+        self.lock.acquire()
+        lane.tasks.append((func, args, callback, size))
+        lane.bytes = lane.bytes + size
+        self.queued = self.queued + 1
+        self.lock.notify()
+        self.lock.release()
+
+    # Whether lane takes one more request carrying size bytes, a single
+    # request is always let into an empty lane
+    def admit(self, lane, size=0):
+        self.lock.acquire()
+        try:
+            if len(lane.tasks) >= lane.maxqueue or \
+               (lane.maxbytes and lane.bytes and (lane.bytes + size) > lane.maxbytes):
+                lane.rejected = lane.rejected + 1
+                return False
+            return True
+        finally:
+            self.lock.release()
+
+    def full(self):
+        return self.queued >= self.queue
+
+# Level triggered readiness on epoll, plain select() where there is none.
+# Python 2 has no selectors module, this is the part of it cwd needs
+class CwPoller:
+    READ, WRITE = 1, 2
+
+    def __init__(self):
+        self.masks = {}
+        self.epoll = None
+        if epoll is not None:
+            self.epoll = epoll()
+
+    def register(self, fd):
+        self.masks[fd] = 0
+        if self.epoll is not None:
+            self.epoll.register(fd, 0)
+
+    def modify(self, fd, mask):
+        if self.masks[fd] == mask:
+            return
+        self.masks[fd] = mask
+        if self.epoll is not None:
+            events = 0
+            if mask & self.READ:
+                events = events | EPOLLIN
+            if mask & self.WRITE:
+                events = events | EPOLLOUT
+            self.epoll.modify(fd, events)
+
+    # must come before the descriptor is closed
+    def unregister(self, fd):
+        del self.masks[fd]
+        if self.epoll is not None:
+            self.epoll.unregister(fd)
+
+    # Returns (fd, readable, writable, hangup), errors count as hangups
+    def poll(self, timeout):
+        try:
+            if self.epoll is not None:
+                return [ (fd, bool(ev & EPOLLIN), bool(ev & EPOLLOUT), bool(ev & (EPOLLERR | EPOLLHUP)))
+                         for fd, ev in self.epoll.poll(timeout) ]
+            r = [ fd for fd, mask in self.masks.items() if mask & self.READ ]
+            w = [ fd for fd, mask in self.masks.items() if mask & self.WRITE ]
+            r, w, e = select(r, w, [], timeout)
+        except (IOError, OSError, select_error), error:
+            if error.args[0] == EINTR:
+                return []
+            raise
+        r, w = set(r), set(w)
+        return [ (fd, fd in r, fd in w, False) for fd in r | w ]
+
+# The event loop only does non blocking socket I/O, scans and anything
+# else that may block runs in the worker pool. Like asyncore handlers
+# are asked what they wait for on every pass, the poller is only told
+# about changes
+class CwLoop:
+    def __init__(self):
+        self.poller = CwPoller()
+        self.handlers = {}
+        self.thread = current_thread()
+
+    def add(self, handler):
+        handler.fd = handler.fileno()
+        handler.loop = self
+        self.handlers[handler.fd] = handler
+        self.poller.register(handler.fd)
+
+    def remove(self, handler):
+        if self.handlers.get(handler.fd) is handler:
+            del self.handlers[handler.fd]
+            self.poller.unregister(handler.fd)
+
+    def run(self, timeout):
+        now = time()
+        for handler in self.handlers.values():
+            if handler.deadline is not None and now > handler.deadline:
+                handler.deadline = None
+                self.call(handler, handler.handle_timeout)
+
+        for fd, handler in self.handlers.items():
+            mask = 0
+            if handler.readable():
+                mask = mask | CwPoller.READ
+            if handler.writable():
+                mask = mask | CwPoller.WRITE
+            self.poller.modify(fd, mask)
+
+        # a handler may close others, its descriptor may even be reused
+        for fd, readable, writable, hangup in self.poller.poll(timeout):
+            handler = self.handlers.get(fd)
+            if handler is not None and readable:
+                self.call(handler, handler.handle_read)
+            if handler is not None and writable and self.handlers.get(fd) is handler:
+                self.call(handler, handler.handle_write)
+            if handler is not None and hangup and self.handlers.get(fd) is handler:
+                self.call(handler, handler.handle_close)
+
+    def call(self, handler, func):
+        try:
+            func()
+        except:
+            print_exc()
+            handler.handle_close()
+
+# Base of everything watched by the loop
+class CwDispatcher:
+    loop = None
+    deadline = None
+
+    def fileno(self):
+        return self.socket.fileno()
+
+    def readable(self):
+        return True
+
+    def writable(self):
+        return False
+
+    def handle_read(self):
+        pass
+
+    def handle_write(self):
+        pass
+
+    def handle_timeout(self):
+        self.close()
+
+    def handle_close(self):
+        self.close()
+
+    def close(self):
+        if self.loop is not None:
+            self.loop.remove(self)
+            self.loop = None
+        self.socket.close()
+
+# Runs callbacks posted by worker threads on the loop
+class CwWaker(CwDispatcher):
+    def __init__(self, loop):
+        self.r, self.w = pipe()
+        for fd in (self.r, self.w):
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)
+        self.calls = deque()
+        loop.add(self)
+
+    def fileno(self):
+        return self.r
+
+    # a full pipe already wakes the loop
+    def wake(self):
+        try:
+            os_write(self.w, 'x')
+        except OSError:
+            pass
+
+    def call(self, func, *args):
+        self.calls.append((func, args))
+        self.wake()
+
+    def handle_read(self):
+        try:
+            os_read(self.r, 512)
+        except OSError:
+            pass
+        while self.calls:
+            func, args = self.calls.popleft()
+            try:
+                func(*args)
+            except:
+                print_exc()
+
+    def close(self):
+        if self.loop is not None:
+            self.loop.remove(self)
+            self.loop = None
+        os_close(self.r)
+        os_close(self.w)
+
+class CwdHandler(CwDispatcher):
     def __init__(self, conn, addr, server):
-        async_chat.__init__(self, conn)
-        self.client_address = addr
+        conn.setblocking(0)
+        self.socket = conn
         self.connection = conn
+        self.client_address = addr
         self.server = server
-        self.set_terminator ('\n')
-        self.found_terminator = self.handle_request_line
+        self.local = conn.family == AF_UNIX
+        # peers of a unix socket are unnamed
+        if self.local:
+            self.client = ('local', conn.fileno())
+        else:
+            self.client = addr
+        self.connected = True
+        self.closing = False
+        self.session = False
+        self.idsession = False
+        self.nextid = 0
+        self.pending = 0
+        # line, instream or fildes, the two last read raw data
+        self.mode = 'line'
+        self.modeid = None
+        self.stream = None
+        self.chunk = 0
+        self.inbuf = ''
+        self.output = []
+        self.outsize = 0
+        self.outlock = Condition()
+        server.eventloop.add(self)
 
-    def handle_data(self):
-        pass
+    # Stops reading while the pipeline is full, a plain command or a
+    # SESSION command runs, or the worker pool is backed up
+    def readable(self):
+        if self.closing:
+            return False
+        if self.mode != 'line':
+            return True
+        return self.accepting()
 
-    def handle_request_line(self):
-        pass
+    def accepting(self):
+        if self.server.pool.full():
+            return False
+        if self.idsession:
+            return self.pending < self.server.config['MaxQueue']
+        return not self.pending
+
+    def writable(self):
+        return self.outsize > 0
+
+    # The byte carrying a FILDES descriptor follows the command line,
+    # it must be left in the socket for recvfd
+    def recv(self, buffer_size):
+        if self.local:
+            try:
+                data = self.socket.recv(buffer_size, MSG_PEEK)
+                index = data.find('FILDES\n')
+                if index != -1:
+                    buffer_size = index + len('FILDES\n')
+                elif data.rfind('\n') != -1:
+                    buffer_size = data.rfind('\n') + 1
+            except socket_error:
+                pass
+        return self.socket.recv(buffer_size)
+
+    def handle_read(self):
+        if self.mode == 'fildes':
+            return self.read_fildes()
+        try:
+            data = self.recv(65536)
+        except socket_error, error:
+            if error.args[0] in (EAGAIN, EWOULDBLOCK):
+                return
+            print 'Error Recv', error
+            return self.close()
+        if not data:
+            return self.handle_eof()
+        self.inbuf = self.inbuf + data
+        self.process()
+
+    # Clients may shut down their side after the last command, the
+    # replies still go out
+    def handle_eof(self):
+        if self.mode != 'line':
+            print 'Connection closed inside', self.mode
+            self.endmode()
+        self.close_when_done()
+
+    def handle_write(self):
+        self.outlock.acquire()
+        try:
+            data = ''.join(self.output)
+            try:
+                data = data[self.socket.send(data):]
+            except socket_error, error:
+                if error.args[0] not in (EAGAIN, EWOULDBLOCK):
+                    print 'Error sending reply', error
+                    return self.close()
+            self.output = []
+            if data:
+                self.output.append(data)
+            self.outsize = len(data)
+            self.outlock.notifyAll()
+        finally:
+            self.outlock.release()
+        if self.closing:
+            self.idle()
+
+    def handle_timeout(self):
+        print 'Connection Timeout'
+        if self.mode == 'instream':
+            self.sendline('stream: ERROR timeout\n', self.modeid)
+        elif self.mode == 'fildes':
+            self.sendline('FILDES: ERROR timeout\n', self.modeid)
+        self.endmode()
+        self.close_when_done()
+
+    def close(self):
+        self.outlock.acquire()
+        try:
+            self.connected = False
+            self.outlock.notifyAll()
+        finally:
+            self.outlock.release()
+        self.endmode()
+        self.server.stalled.discard(self)
+        CwDispatcher.close(self)
+
+    def close_when_done(self):
+        self.closing = True
+        self.idle()
+
+    # Plain commands close the connection once their reply is sent
+    def idle(self):
+        if self.closing:
+            if not self.pending and not self.outsize:
+                self.close()
+        elif not self.session and not self.pending and self.mode == 'line':
+            self.close_when_done()
+
+    # Handles the buffered commands, scans are handed to the pool and
+    # the next command waits until the connection accepts one again
+    def process(self):
+        while not self.closing:
+            if self.mode == 'instream':
+                if not self.read_instream():
+                    return
+                continue
+            if self.mode != 'line':
+                return
+            if not self.accepting():
+                if self.server.pool.full():
+                    self.server.stalled.add(self)
+                return
+            index = self.inbuf.find('\n')
+            if index == -1:
+                if len(self.inbuf) > MAX_LINE:
+                    print 'Command line too long'
+                    self.close()
+                return
+            line = self.inbuf[:index]
+            self.inbuf = self.inbuf[index + 1:]
+            self.handle_request_line(line)
+
+    # MaxScanTime is in milliseconds, timed out scans reply ERROR TIMEOUT
+    def scantimeout(self):
+        maxtime = self.server.config['MaxScanTime']
+        if maxtime > 0:
+            return maxtime / 1000.0
+        return None
 
     def scanfile(self, filename):
         try:
-            infected, virus = pyc.scanFile(filename)
+            infected, virus = pyc.scanFile(filename, timeout=self.scantimeout())
+        except:
+            t, val, tb = exc_info()
+            return None, 'ERROR', val.message
+        if infected is None:
+            return None, 'ERROR', virus
+        return True, infected, virus
+
+    def scandesc(self, fd):
+        try:
+            infected, virus = pyc.scanDesc(fd, timeout=self.scantimeout())
+        except:
+            t, val, tb = exc_info()
+            return None, 'ERROR', val.message
+        if infected is None:
+            return None, 'ERROR', virus
+        return True, infected, virus
+
+    # Stream data is kept by pyc in memory up to StreamMemoryLimit and
+    # in an anonymous file past it
+    def newstream(self):
+        config = self.server.config
+        return pyc.Stream(spill=config['StreamMemoryLimit'], maxsize=config['StreamMaxLength'])
+
+    def finishstream(self, stream):
+        try:
+            infected, virus = stream.finish(timeout=self.scantimeout())
         except:
             t, val, tb = exc_info()
             return None, 'ERROR', val.message
+        if infected is None:
+            return None, 'ERROR', virus
         return True, infected, virus
 
-    def sendreply(self, res, name, infected, virusname):
+    # Replies are queued for the loop to send, worker threads wait while
+    # the client is behind by more than OUTPUT_HIGHWATER
+    def sendline(self, line, id=None):
+        if id is not None:
+            line = '%d: %s' % (id, line)
+        worker = current_thread() is not self.server.eventloop.thread
+        self.outlock.acquire()
+        try:
+            if worker:
+                deadline = time() + self.server.config['ReadTimeout']
+                while self.connected and self.outsize > OUTPUT_HIGHWATER:
+                    if time() > deadline:
+                        raise CwdAbort, 'timeout'
+                    self.outlock.wait(1)
+            if not self.connected:
+                raise CwdAbort, 'connection closed'
+            self.output.append(line)
+            self.outsize = self.outsize + len(line)
+        finally:
+            self.outlock.release()
+        if worker:
+            self.server.waker.wake()
+
+    def sendreply(self, res, name, infected, virusname, id=None):
         try:
             if res is None:
                 print '%s: ERROR %s' % (name, virusname)
-                self.connection.send('%s: ERROR %s\n' % (name, virusname))
+                self.sendline('%s: ERROR %s\n' % (name, virusname), id)
                 return False
             if infected:
                 print '%s: %s FOUND' % (name, virusname)
-                self.connection.send('%s: %s FOUND\n' % (name, virusname))
+                self.sendline('%s: %s FOUND\n' % (name, virusname), id)
             else:
-                self.connection.send('%s: OK\n' % name)
+                self.sendline('%s: OK\n' % name, id)
             return True
         except Exception, error:
             t, val, tb = exc_info()
             print 'Error sending reply', error
             return False
 
-    def scan(self, path, name=None, cont=False):
+    def scan(self, path, name=None, cont=False, id=None):
         if (name is not None):
             res, infected, virusname = self.scanfile(path)
-            return self.sendreply(res, name, infected, virusname)
+            return self.sendreply(res, name, infected, virusname, id)
         elif isfile(path):
             res, infected, virusname = self.scanfile(path)
-            return self.sendreply(res, path, infected, virusname)
+            return self.sendreply(res, path, infected, virusname, id)
         elif isdir(path):
+            if cont and hasattr(pyc, 'scanDir'):
+                return self.scandir(path, id=id)
             for f in walk(path):
                 for child in f[2]:
                     filename = path_join(f[0], child)
                     res, infected, virusname = self.scanfile(filename)
-                    if not self.sendreply(res, filename, infected, virusname): return
+                    if not self.sendreply(res, filename, infected, virusname, id): return
                     if not cont: return
         else:
-            self.connection.send('%s: ERROR not a regular file or directory\n' % path)
+            self.sendline('%s: ERROR not a regular file or directory\n' % path, id)
+
+    def scandir(self, path, threads=0, id=None):
+        def reply(filename, result):
+            infected, virusname = result
+            if infected is None:
+                res = None
+            else:
+                res = True
+            if not self.sendreply(res, filename, infected, virusname, id):
+                raise CwdAbort
+        try:
+            pyc.scanDir(path, threads=threads, callback=reply)
+        except CwdAbort:
+            return False
+        except pyc.PycError, error:
+            self.sendline('%s: ERROR %s\n' % (path, error), id)
+            return False
+        return True
+
+    # Queues func(*args) on a lane of the worker pool, the completion
+    # comes back on the loop through the waker. A lane over its limits
+    # answers BUSY right away
+    def submit(self, lane, func, args, id=None, size=0):
+        if not self.server.pool.admit(lane, size):
+            print 'Lane %s busy, request rejected' % lane.name
+            self.sendline('BUSY ERROR\n', id)
+            return False
+        self.pending = self.pending + 1
+        self.server.pool.apply_async(lane, func, args,
+            lambda result: self.server.waker.call(self.task_done), size)
+        return True
+
+    # Streams and descriptors larger than BulkStreamSize are bulk work
+    def lane(self, size=0):
+        if size > self.server.config['BulkStreamSize']:
+            return self.server.lanes['bulk']
+        return self.server.lanes['interactive']
+
+    def task_done(self):
+        self.pending = self.pending - 1
+        if self.connected:
+            self.idle()
+            self.process()
+        self.server.resume()
 
-    def collect_incoming_data(self, cmd):
-        client = self.connection.getpeername()
-        print 'Connection from:', client[0]
+    def handle_request_line(self, cmd):
+        print 'Connection from:', self.client[0]
         cmd = cmd.strip()
-        if cmd.startswith('SCAN '):
+        # newline delimited commands may carry clamd's 'n' prefix
+        if cmd.startswith('n'):
+            cmd = cmd[1:]
+        if self.idsession:
+            self.handle_id_command(cmd)
+        elif cmd.startswith('SCAN '):
             self.do_SCAN(cmd.split('SCAN ', 1).pop())
         elif cmd == 'QUIT' or cmd == 'SHUTDOWN':
             self.do_QUIT()
@@ -101,115 +666,323 @@ class CwdHandler(async_chat):
         elif cmd == 'VERSION':
             self.do_VERSION()
         elif cmd == 'SESSION':
-            self.do_SESSION(client)
+            self.do_SESSION()
+        elif cmd == 'IDSESSION':
+            self.do_IDSESSION()
         elif cmd == 'END':
-            self.do_END(client)
+            self.do_END()
         elif cmd == 'STREAM':
             self.do_STREAM()
+        elif cmd == 'INSTREAM':
+            self.do_INSTREAM()
+        elif cmd == 'FILDES':
+            self.do_FILDES()
         elif cmd.startswith('MULTISCAN '):
             self.do_MULTISCAN(cmd.split('MULTISCAN ', 1).pop())
         else:
             print 'Unknown command', cmd
-            self.connection.send('UNKNOWN COMMAND\n')
-        if not client in self.server.sessions: self.close()
+            self.sendline('UNKNOWN COMMAND\n')
+        self.idle()
+
+    # Inside an IDSESSION every command gets a request id, replies are
+    # sent as the scans complete
+    def handle_id_command(self, cmd):
+        if cmd == 'END':
+            return self.do_END()
+
+        self.nextid = self.nextid + 1
+        id = self.nextid
+        if cmd.startswith('SCAN '):
+            self.do_SCAN(cmd.split('SCAN ', 1).pop(), id)
+        elif cmd.startswith('CONTSCAN '):
+            self.do_CONTSCAN(cmd.split('CONTSCAN ', 1).pop(), id)
+        elif cmd.startswith('MULTISCAN '):
+            self.do_MULTISCAN(cmd.split('MULTISCAN ', 1).pop(), id)
+        elif cmd == 'INSTREAM':
+            self.do_INSTREAM(id)
+        elif cmd == 'FILDES':
+            self.do_FILDES(id)
+        elif cmd == 'PING':
+            self.do_PING(id)
+        elif cmd == 'VERSION':
+            self.do_VERSION(id)
+        else:
+            print 'Unknown command', cmd
+            self.sendline('UNKNOWN COMMAND\n', id)
 
-    def do_SCAN(self, path):
-        self.scan(path)
+    def do_SCAN(self, path, id=None):
+        self.submit(self.lane(), self.scan, (path, None, False, id), id)
 
+    # The listeners are closed by the serving loop
     def do_QUIT(self):
         print 'Shutdown Requested'
-        self.server.close()
+        if self.server.parent is not None:
+            kill(self.server.parent, SIGTERM)
+        self.server.stopping = True
 
+    # pre-fork workers leave the reload to the parent
     def do_RELOAD(self):
-        self.connection.send('RELOADING\n')
-        pyc.checkAndLoadDB()
+        self.sendline('RELOADING\n')
+        if self.server.parent is not None:
+            kill(self.server.parent, SIGHUP)
+        else:
+            pyc.checkAndLoadDB(wait=False)
 
-    def do_PING(self):
-        self.connection.send('PONG\n')
+    def do_PING(self, id=None):
+        self.sendline('PONG\n', id)
 
-    def do_CONTSCAN(self, path):
-        self.scan(path, cont=True)
+    def do_CONTSCAN(self, path, id=None):
+        self.submit(self.server.lanes['bulk'], self.scan, (path, None, True, id), id)
 
-    def do_VERSION(self):
+    def do_VERSION(self, id=None):
         version = pyc.getVersions()[0]
-        self.connection.send(version + '\n')
+        self.sendline(version + '\n', id)
 
+    # The data comes on a second connection, it is received by the loop
+    # as well and counts as a pending command
     def do_STREAM(self):
-        stream = socket(AF_INET, SOCK_STREAM)
-        stream.settimeout(self.server.config['ReadTimeout'])
-        stream.bind((self.server.ip, 0))
-        stream.listen(1)
-        self.connection.send('PORT %d\n' % stream.getsockname()[1])
+        if not self.server.pool.admit(self.lane()):
+            self.sendline('BUSY ERROR\n')
+            return
+        try:
+            listener = CwStreamListener(self)
+        except socket_error, error:
+            print 'Error creating stream socket', error
+            self.sendline('stream: ERROR %s\n' % error)
+            return
+        self.pending = self.pending + 1
+        self.sendline('PORT %d\n' % listener.port)
+
+    def stream_received(self, stream, error=None):
+        if error is not None:
+            if stream is not None:
+                stream.close()
+            if self.connected:
+                self.sendline('stream: ERROR %s\n' % error)
+        elif not self.connected or \
+             not self.submit(self.lane(stream.size), self.scanstream, (stream,), None, stream.size):
+            stream.close()
+        self.task_done()
+
+    # Chunks are written to a pyc.Stream as they arrive
+    def do_INSTREAM(self, id=None):
+        # the stream follows, nothing after it could be told apart
+        if not self.server.pool.admit(self.lane()):
+            self.sendline('BUSY ERROR\n', id)
+            return self.close_when_done()
+        self.stream = self.newstream()
+        self.chunk = 0
+        self.mode = 'instream'
+        self.modeid = id
+        self.deadline = time() + self.server.config['ReadTimeout']
+
+    # Consumes the buffered part of the stream, true once it ended
+    def read_instream(self):
+        maxlength = self.server.config['StreamMaxLength']
+        self.deadline = time() + self.server.config['ReadTimeout']
+        while self.inbuf:
+            if not self.chunk:
+                if len(self.inbuf) < 4:
+                    return False
+                size = unpack('!L', self.inbuf[:4])[0]
+                self.inbuf = self.inbuf[4:]
+                if not size:
+                    stream, id = self.stream, self.modeid
+                    self.stream = None
+                    self.endmode()
+                    if not self.submit(self.lane(stream.size), self.scanstream, (stream, id), id, stream.size):
+                        stream.close()
+                    return True
+                length = self.stream.size + size
+                if length > maxlength:
+                    print 'ScanStream: StreamMaxLength reached (max: %s)' % maxlength
+                    self.sendline('INSTREAM size limit exceeded. ERROR\n', self.modeid)
+                    # the rest of the stream can't be told apart from commands
+                    self.endmode()
+                    self.close_when_done()
+                    return True
+                # turned away as soon as it is known not to fit its lane
+                if not self.server.pool.admit(self.lane(length), length):
+                    self.sendline('BUSY ERROR\n', self.modeid)
+                    self.endmode()
+                    self.close_when_done()
+                    return True
+                self.chunk = size
+            data = self.inbuf[:self.chunk]
+            self.inbuf = self.inbuf[len(data):]
+            self.stream.write(data)
+            self.chunk = self.chunk - len(data)
+        return False
+
+    def endmode(self):
+        if self.stream is not None:
+            self.stream.close()
+            self.stream = None
+        self.mode = 'line'
+        self.modeid = None
+        self.deadline = None
 
+    def scanstream(self, stream, id=None):
         try:
-            conn, addr = stream.accept()
-        except Exception, error:
-            print 'Connection aborted', error
-            self.connection.send('stream: ERROR %s\n' % error)
+            res, infected, virusname = self.finishstream(stream)
+            return self.sendreply(res, 'stream', infected, virusname, id)
+        finally:
             stream.close()
-            return
 
-        f, filename = mkstemp()
-        start = time()
-        ok = True
-        bytes = 0
-        while True:
-            r, w, e = select([conn], [], [], 1)
-            now = time()
-            if (now - start) > self.server.config['ReadTimeout']:
-                print 'Connection Timeout'
-                self.connection.send('stream: ERROR timeout\n')
-                ok = False
-                break
-            if r:
-                try:
-                    d = conn.recv(4096)
-                    if not d: break
-                    bytes = bytes + len(d)
-                    if bytes > self.server.config['StreamMaxLength']:
-                        print 'ScanStream: StreamMaxLength reached (max: %s)' % self.server.config['StreamMaxLength']
-                        self.connection.send('stream: ERROR StreamMaxLength reached\n')
-                        ok = False
-                        break
-                    os_write(f, d)
-                    start = now
-                except Exception, error:
-                    print 'Error Recv', error
-                    self.connection.send('stream: ERROR %s\n' % error)
-                    ok = False
-                    break
-            if e:
-                print 'Error select()'
-                self.connection.send('stream: Socket ERROR\n')
-                ok = False
-                break
+    # Receives one descriptor passed with SCM_RIGHTS
+    def recvfd(self):
+        if recvfd is not None:
+            return recvfd(self.connection.fileno())
+        size = calcsize('i')
+        data, ancdata, flags, addr = self.connection.recvmsg(1, CMSG_SPACE(size))
+        for level, kind, fds in ancdata:
+            if level == SOL_SOCKET and kind == SCM_RIGHTS and len(fds) >= size:
+                return unpack('i', fds[:size])[0]
+        raise CwdAbort, 'no file descriptor received'
 
-        conn.close()
-        os_close(f)
-        stream.close()
+    # The descriptor is received once the socket is readable again
+    def do_FILDES(self, id=None):
+        if not self.local:
+            self.sendline('FILDES: ERROR only available on LocalSocket\n', id)
+            return
+        self.mode = 'fildes'
+        self.modeid = id
+        self.deadline = time() + self.server.config['ReadTimeout']
 
-        if ok: self.scan(filename, 'stream')
+    def read_fildes(self):
+        id = self.modeid
+        self.endmode()
+        try:
+            fd = self.recvfd()
+        except Exception, error:
+            print 'Error receiving descriptor', error
+            self.sendline('FILDES: ERROR %s\n' % error, id)
+            # the descriptor byte is out of sync with the commands
+            return self.close_when_done()
+        try:
+            size = os_fstat(fd).st_size
+        except OSError:
+            size = 0
+        if not self.submit(self.lane(size), self.scanfd, (fd, id), id):
+            os_close(fd)
+        self.process()
 
-        if not self.server.config['LeaveTemporaryFiles']:
-            try:
-                unlink(filename)
-            except:
-                print 'Error unlinking tempfile'
+    def scanfd(self, fd, id=None):
+        try:
+            res, infected, virusname = self.scandesc(fd)
+            return self.sendreply(res, 'fd[%d]' % fd, infected, virusname, id)
+        finally:
+            os_close(fd)
+
+    def do_SESSION(self):
+        if self.session:
+            self.sendline('ERROR Session already started\n')
+        else:
+            self.session = True
 
-    def do_SESSION(self, client):
-        if client in self.server.sessions:
-            self.connection.send('ERROR Session already started\n')
+    def do_IDSESSION(self):
+        if self.session:
+            self.sendline('ERROR Session already started\n')
         else:
-            self.server.sessions.append(client)
+            self.session = True
+            self.idsession = True
+            self.nextid = 0
 
-    def do_END(self, client):
-        if not client in self.server.sessions:
-            self.connection.send('ERROR Session not started\n')
+    def do_END(self):
+        if not self.session:
+            self.sendline('ERROR Session not started\n')
         else:
-            self.server.sessions.remove(client)
+            self.session = False
+            self.idsession = False
 
-    def do_MULTISCAN(self, filename):
-        self.connection.send('ERROR Not implemented\n')
+    def do_MULTISCAN(self, path, id=None):
+        self.submit(self.server.lanes['bulk'], self.multiscan, (path, id), id)
+
+    def multiscan(self, path, id=None):
+        if not isdir(path):
+            return self.scan(path, id=id)
+        if hasattr(pyc, 'scanDir'):
+            return self.scandir(path, self.server.config['MaxThreads'], id)
+        # already running in the pool, waiting on it could deadlock
+        return self.scan(path, cont=True, id=id)
+
+# One shot listener for the data connection of a STREAM command
+class CwStreamListener(CwDispatcher):
+    def __init__(self, handler):
+        self.handler = handler
+        self.socket = socket(AF_INET, SOCK_STREAM)
+        try:
+            self.socket.setblocking(0)
+            self.socket.bind((handler.server.ip, 0))
+            self.socket.listen(1)
+        except socket_error:
+            self.socket.close()
+            raise
+        self.port = self.socket.getsockname()[1]
+        self.deadline = time() + handler.server.config['ReadTimeout']
+        handler.server.eventloop.add(self)
+
+    def handle_read(self):
+        try:
+            conn, addr = self.socket.accept()
+        except socket_error:
+            return
+        self.close()
+        CwStreamReceiver(conn, self.handler)
+
+    def handle_timeout(self):
+        print 'Connection aborted, timeout'
+        self.handle_close()
+
+    def handle_close(self):
+        if self.loop is not None:
+            self.close()
+            self.handler.stream_received(None, 'timeout')
+
+# Reads the data connection of a STREAM until the client closes it
+class CwStreamReceiver(CwDispatcher):
+    def __init__(self, conn, handler):
+        config = handler.server.config
+        conn.setblocking(0)
+        self.socket = conn
+        self.handler = handler
+        self.maxlength = config['StreamMaxLength']
+        self.timeout = config['ReadTimeout']
+        self.stream = handler.newstream()
+        self.deadline = time() + self.timeout
+        handler.server.eventloop.add(self)
+
+    def handle_read(self):
+        try:
+            data = self.socket.recv(65536)
+        except socket_error, error:
+            if error.args[0] in (EAGAIN, EWOULDBLOCK):
+                return
+            print 'Error Recv', error
+            return self.finish(error)
+        if not data:
+            return self.finish()
+        length = self.stream.size + len(data)
+        if length > self.maxlength:
+            print 'ScanStream: StreamMaxLength reached (max: %s)' % self.maxlength
+            return self.finish('StreamMaxLength reached')
+        if not self.handler.server.pool.admit(self.handler.lane(length), length):
+            return self.finish('BUSY')
+        self.stream.write(data)
+        self.deadline = time() + self.timeout
+
+    def handle_timeout(self):
+        print 'Connection Timeout'
+        self.finish('timeout')
+
+    def handle_close(self):
+        self.finish('connection closed')
+
+    def finish(self, error=None):
+        if self.loop is None:
+            return
+        self.close()
+        self.handler.stream_received(self.stream, error)
 
 class CwConfig:
     def __init__(self):
@@ -272,19 +1045,42 @@ class CwConfig:
         'ScanHTML'                  : [ 'scan', 'html', boolean, True ],
         'ScanArchive'               : [ 'scan', 'archive', boolean, True ],
 
+        'Bytecode'                  : [ 'db', 'bytecode', boolean, True ],
+        'PhishingSignatures'        : [ 'db', 'phishing', boolean, True ],
+        'PhishingScanURLs'          : [ 'db', 'phishing_urls', boolean, True ],
+        'DetectPUA'                 : [ 'db', 'pua', boolean, False ],
+        'OfficialDatabaseOnly'      : [ 'db', 'official_only', boolean, False ],
+
         'SelfCheck'                 : [ 'cwd', None, int, 3600 ], # seconds
         'Debug'                     : [ 'cwd', None, boolean, False ],
         'DatabaseDirectory'         : [ 'cwd', None, qstr, None ],
+        'DatabaseCacheDirectory'    : [ 'cwd', None, qstr, None ],
         'TCPSocket'                 : [ 'cwd', None, int, 3310 ],
         'TCPAddr'                   : [ 'cwd', None, nqstr, 'localhost' ],
+        'LocalSocket'               : [ 'cwd', None, qstr, None ],
         'MaxConnectionQueueLength'  : [ 'cwd', None, int, 5 ],
+        'MaxThreads'                : [ 'cwd', None, int, 10 ],
+        'MaxQueue'                  : [ 'cwd', None, int, 100 ],
+        'PreforkWorkers'            : [ 'cwd', None, int, 0 ],
+        'BulkStreamSize'            : [ 'cwd', None, size_t, 1024 * 1024 ], # MB, larger streams are bulk work
+        'InteractiveWeight'         : [ 'cwd', None, int, 4 ],
+        'InteractiveMaxQueue'       : [ 'cwd', None, int, 100 ],
+        'InteractiveMaxQueuedBytes' : [ 'cwd', None, size_t, 64 * 1024 * 1024 ], # MB
+        'BulkWeight'                : [ 'cwd', None, int, 1 ],
+        'BulkMaxThreads'            : [ 'cwd', None, int, 0 ], # 0: half of MaxThreads
+        'BulkMaxQueue'              : [ 'cwd', None, int, 10 ],
+        'BulkMaxQueuedBytes'        : [ 'cwd', None, size_t, 256 * 1024 * 1024 ], # MB
         'StreamMaxLength'           : [ 'cwd', None, size_t, 100 * 1024 * 1024 ], # MB
-        'ReadTimeout'               : [ 'cwd', None, int, 300 ] # seconds
+        'StreamMemoryLimit'         : [ 'cwd', None, size_t, 16 * 1024 * 1024 ], # MB
+        'ReadTimeout'               : [ 'cwd', None, int, 300 ], # seconds
+        'MaxScanTime'               : [ 'cwd', None, int, 0 ] # milliseconds, 0 disables
     }
 
     def engage(self):
         if self['DatabaseDirectory'] is not None:
             pyc.setDBPath(self['DatabaseDirectory'])
+        if self['DatabaseCacheDirectory'] is not None:
+            pyc.setDBCacheDir(self['DatabaseCacheDirectory'])
         if self['Debug']:
             pyc.setDebug()
         pyc.setDBTimer(self['SelfCheck'])
@@ -297,6 +1093,9 @@ class CwConfig:
             elif owner == 'scan':
                 print 'Setting scan', name, value
                 pyc.setScanOption(name, value)
+            elif owner == 'db':
+                print 'Setting db', name, value
+                pyc.setDBOption(name, value)
 
     def load(self, filename):
         f = open(filename)
@@ -319,37 +1118,216 @@ class CwConfig:
                     raise Exception, 'Invalid configuration'
         f.close()
 
-class CwServer(dispatcher):
+class CwServer(CwDispatcher):
     def __init__(self, configfile=None):
         self.handler = CwdHandler
-        self.sessions = []
+        self.stalled = set()
+        self.local = None
+        self.parent = None
         self.ip = 'localhost'
         self.port = 0
-        dispatcher.__init__(self)
 
         self.config = CwConfig()
         if configfile:
             self.config.load(configfile)
         self.config.engage()
 
-        pyc.loadDB()
+        report = pyc.loadDB()
+        print 'Loaded %d signatures in %.2fs (compile %.2fs), RSS %dM -> %dM' % \
+            (report['sigs'], report['load_time'], report['compile_time'],
+             report['rss_before'] >> 20, report['rss_after'] >> 20)
         self.startup()
 
     def startup(self):
-        self.create_socket(AF_INET, SOCK_STREAM)
-        self.set_reuse_addr()
+        self.socket = socket(AF_INET, SOCK_STREAM)
+        self.socket.setsockopt(SOL_SOCKET, SO_REUSEADDR, 1)
+        self.socket.setblocking(0)
         self.ip, self.port = self.config['TCPAddr'], self.config['TCPSocket']
-        self.bind((self.ip, self.port))
-        self.listen(self.config['MaxConnectionQueueLength'])
+        self.socket.bind((self.ip, self.port))
+        self.socket.listen(self.config['MaxConnectionQueueLength'])
 
-    def handle_accept(self):
-        conn, addr = self.accept()
+        if self.config['LocalSocket'] is not None:
+            self.local = CwListener(self, self.config['LocalSocket'])
+
+    # other pre-fork workers may win the race for a connection
+    def handle_read(self):
+        try:
+            conn, addr = self.socket.accept()
+        except socket_error:
+            return
         self.handler(conn, addr, self)
 
+    def stop(self):
+        if self.local is not None:
+            self.local.close()
+        self.close()
+
+    # Connections holding commands while the pool was full
+    def resume(self):
+        stalled, self.stalled = self.stalled, set()
+        for handler in stalled:
+            handler.process()
+
+    # Threads and the poller don't survive fork(), they are started by
+    # the process actually serving. Once stopping the listeners are
+    # closed and the open connections get up to ReadTimeout to complete
+    def serve(self):
+        self.eventloop = CwLoop()
+        threads = max(self.config['MaxThreads'], 1)
+        bulkthreads = self.config['BulkMaxThreads'] or max(threads // 2, 1)
+        self.lanes = { 'interactive': CwLane('interactive', self.config['InteractiveWeight'], threads,
+                                             self.config['InteractiveMaxQueue'],
+                                             self.config['InteractiveMaxQueuedBytes']),
+                       'bulk': CwLane('bulk', self.config['BulkWeight'], min(bulkthreads, threads),
+                                      self.config['BulkMaxQueue'], self.config['BulkMaxQueuedBytes']) }
+        self.pool = CwWorkerPool(threads, self.config['MaxQueue'],
+                                 [ self.lanes['interactive'], self.lanes['bulk'] ])
+        self.waker = CwWaker(self.eventloop)
+        self.eventloop.add(self)
+        if self.local is not None:
+            self.eventloop.add(self.local)
+        self.stopping = False
+        stopped = None
+        while self.eventloop.handlers:
+            self.eventloop.run(1)
+            if self.stopping and stopped is None:
+                stopped = time()
+                self.stop()
+            # the waker is the last one left
+            if stopped is not None and (len(self.eventloop.handlers) == 1 or \
+               (time() - stopped) > self.config['ReadTimeout']):
+                break
+
+    def handle_stop(self, signum, frame):
+        self.stopping = True
+
+    # The parent loads the database once and forks the workers, they
+    # inherit the compiled engine copy-on-write and accept on the shared
+    # listening sockets. The parent alone checks the database, after a
+    # new one is loaded a fresh set of workers is started and the old
+    # ones are stopped gracefully
+    def prefork(self):
+        self.workers = {}
+        self.generation = 0
+        self.running = True
+        self.reload = False
+        signal(SIGTERM, self.handle_signal)
+        signal(SIGHUP, self.handle_signal)
+
+        timer = self.config['SelfCheck']
+        pyc.setDBTimer(pyc.SELFCHECK_NEVER)
+        lastcheck = time()
+
+        self.spawn()
+        while self.running:
+            sleep(1)
+            self.reap()
+            if self.reload or (timer > 0 and (time() - lastcheck) >= timer):
+                self.reload = False
+                lastcheck = time()
+                self.rollover()
+
+        for pid in self.workers.keys():
+            kill(pid, SIGTERM)
+        while self.workers:
+            pid, status = waitpid(-1, 0)
+            self.workers.pop(pid, None)
+        self.stop()
+
+    def handle_signal(self, signum, frame):
+        if signum == SIGHUP:
+            self.reload = True
+        else:
+            self.running = False
+
+    def spawn(self):
+        current = [ g for g in self.workers.values() if g == self.generation ]
+        for i in range(self.config['PreforkWorkers'] - len(current)):
+            pid = fork()
+            if not pid:
+                self.worker()
+            print 'Started worker', pid
+            self.workers[pid] = self.generation
+
+    def worker(self):
+        status = 0
+        try:
+            signal(SIGTERM, self.handle_stop)
+            signal(SIGHUP, SIG_DFL)
+            self.parent = getppid()
+            self.serve()
+        except:
+            print_exc()
+            status = 1
+        stdout.flush()
+        _exit(status)
+
+    # Workers of the current generation that died are replaced
+    def reap(self):
+        while self.workers:
+            pid, status = waitpid(-1, WNOHANG)
+            if not pid:
+                break
+            if self.workers.pop(pid, None) == self.generation:
+                print 'Worker %d exited with status %d' % (pid, status)
+        if self.running:
+            self.spawn()
+
+    def rollover(self):
+        reloads = pyc.getStats()['reloads']
+        try:
+            pyc.checkAndLoadDB()
+        except pyc.PycError, error:
+            print 'Error reloading database', error
+            return
+        if pyc.getStats()['reloads'] == reloads:
+            return
+
+        print 'Database reloaded, restarting workers'
+        old = self.workers.keys()
+        self.generation = self.generation + 1
+        self.spawn()
+        for pid in old:
+            kill(pid, SIGTERM)
+
+# Additional listener on a unix socket, connections share the server state
+class CwListener(CwDispatcher):
+    def __init__(self, server, path):
+        self.server = server
+        self.path = path
+        self.owner = getpid()
+        # a stale socket from a previous run
+        if exists(path) and S_ISSOCK(os_stat(path).st_mode):
+            unlink(path)
+        self.socket = socket(AF_UNIX, SOCK_STREAM)
+        self.socket.setblocking(0)
+        self.socket.bind(path)
+        self.socket.listen(server.config['MaxConnectionQueueLength'])
+
+    def handle_read(self):
+        try:
+            conn, addr = self.socket.accept()
+        except socket_error:
+            return
+        self.server.handler(conn, addr, self.server)
+
+    # pre-fork workers share the socket with the parent
+    def close(self):
+        CwDispatcher.close(self)
+        if getpid() != self.owner:
+            return
+        try:
+            unlink(self.path)
+        except:
+            pass
+
 if __name__ == '__main__':
     s = CwServer('clamd.conf')
     print "Cwd Server running on port %s" % s.port
     try:
-        loop(timeout=1)
+        if s.config['PreforkWorkers'] > 0:
+            s.prefork()
+        else:
+            s.serve()
     except KeyboardInterrupt:
         print "Crtl+C pressed. Shutting down."
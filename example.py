@@ -4,6 +4,6 @@ import pyc
 pyc.setEngineOption('tempdir', '/tmp/z')
 pyc.setEngineOption('leave-temps', True)
 pyc.loadDB()
-print pyc.getVersions()
-print pyc.getScanOptions()
-print pyc.scanFile('/tmp/clam.exe')
+print(pyc.getVersions())
+print(pyc.getScanOptions())
+print(pyc.scanFile('/tmp/clam.exe'))
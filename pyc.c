@@ -41,6 +41,7 @@
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #ifdef PYC_DEBUG
 #undef NDEBUG
@@ -62,6 +63,16 @@ extern BOOL cw_revertfsredir(void);
 #define stat(p, b) cw_stat(p, b)
 #else
 #include <unistd.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <zlib.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
 #endif
 
 #ifdef _MSC_VER
@@ -109,11 +120,31 @@ typedef signed   __int8  int8_t;
 #define Py_RETURN_NONE return Py_INCREF(Py_None), Py_None
 #endif
 
-#define PyErr_PycFromErrno(func) \
-    PyErr_SetObject(PycError, PyString_FromFormat(#func ": %s", strerror(errno)))
+#if (PY_MAJOR_VERSION >= 3) && (PY_VERSION_HEX < 0x03090000)
+#error "Python 3.9 or later is needed"
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+#define PyString_Check      PyUnicode_Check
+#define PyString_AsString   PyUnicode_AsUTF8
+#define PyString_FromString PyUnicode_FromString
+#define PyString_FromFormat PyUnicode_FromFormat
+#define PyInt_Check         PyLong_Check
+#define PyInt_AsLong        PyLong_AsLong
+#define PyInt_FromLong      PyLong_FromLong
+#define PYC_BUFFER          "y*"
+#else
+#define PYC_BUFFER          "s*"
+#endif
+
+/* self is the engine object, the exception class is per interpreter */
+#define PycError(self) ((self)->state->error)
 
-#define PyErr_PycFromClamav(func, ret) \
-    PyErr_SetObject(PycError, PyString_FromFormat(#func ": %s", cl_strerror(ret)))
+#define PyErr_PycFromErrno(self, func) \
+    PyErr_SetObject(PycError(self), PyString_FromFormat(#func ": %s", strerror(errno)))
+
+#define PyErr_PycFromClamav(self, func, ret) \
+    PyErr_SetObject(PycError(self), PyString_FromFormat(#func ": %s", cl_strerror(ret)))
 
 
 /* msvc6 does not support variadic macros */
@@ -190,629 +221,6212 @@ static const scan_options_t scan_options[] =
     { NULL,                  0                           }
 };
 
-static unsigned int sigs = 0;
-static unsigned int vmain = 0, vdaily = 0, vbytecode = 0;
-static char pyci_dbpath[MAX_PATH + 1] = "";
-static time_t pyci_lastcheck = 0;
-static time_t pyci_checktimer = PYC_SELFCHECK_NEVER;
+/* Databases loaded by the next loadDB(), pua_include and pua_exclude
+   apply to the categories set with the pua-categories engine option */
+static const scan_options_t db_options[] =
+{
+    { "phishing",            CL_DB_PHISHING              },
+    { "phishing_urls",       CL_DB_PHISHING_URLS         },
+    { "pua",                 CL_DB_PUA                   },
+    { "pua_include",         CL_DB_PUA_INCLUDE           },
+    { "pua_exclude",         CL_DB_PUA_EXCLUDE           },
+    { "official_only",       CL_DB_OFFICIAL_ONLY         },
+    { "bytecode",            CL_DB_BYTECODE              },
+    { "bytecode_unsigned",   CL_DB_BYTECODE_UNSIGNED     },
 
-static struct cl_engine *pyci_engine = NULL;
-static struct cl_stat  *pyci_dbstat = NULL;
-static uint32_t pyci_options = CL_SCAN_STDOPT;
+    { NULL,                  0                           }
+};
 
-static PyObject *PycError;
-static PyGILState_STATE gstate;
+/* Monotonic time in microseconds */
+static uint64_t pyci_now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t) (count.QuadPart / (freq.QuadPart / 1000000.0));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
 
-static int pyci_dbstatNew(void);
-static void pyci_dbstatFree(void);
-static void pyci_freeDB(void);
+/* Per call limits of a scan, libclamav can't be interrupted so they are
+   checked whenever an object is typed, once one is hit the scan stops
+   looking at anything else and reports why instead of its result */
+#define PYC_SCAN_TIMEOUT    -1
+#define PYC_SCAN_LIMIT      -2
+#define PYC_SCAN_CANCELLED  -3
 
-#define pyci_isCompiled (cl_engine_get_num(pyci_engine, CL_ENGINE_DB_OPTIONS, NULL) & CL_DB_COMPILED)
-#define pyci_engineCheck(func) \
-    if (!(pyci_engine && pyci_isCompiled)) \
-    { \
-        PyErr_SetString(PycError, #func": No database loaded"); \
-        return NULL; \
-    }
+typedef struct _pyci_limits_t
+{
+    uint64_t deadline;                      /* pyci_now() time, 0 for none */
+    uint64_t maxbytes;                      /* of all the objects typed, 0 for none */
+    volatile int *cancel;                   /* in a pyc.CancelToken, NULL for none */
+} pyci_limits_t;
+
+/* Scan result cache, descriptors of regular files are keyed on the file
+   identity (dev, inode, size, mtime and ctime), immutable buffers on the
+   SHA-256 of their content, ranges of a file on the SHA-256 of its
+   identity and the range, all together with the scan options. Content
+   that can change between hashing and scanning is never keyed on it.
+   Entries are tagged with the generation of the engine that produced
+   them, loading a new database or changing the engine settings makes
+   them stale. The cache is split in stripes with their own lock and LRU
+   list, a scan for a key already being scanned waits for that result,
+   as long as its own limits allow */
+#define PYC_CACHE_STRIPES   16
+#define PYC_CACHE_KEYLEN    45
+#define PYC_CACHE_PENDING   -1
+#define PYC_CACHE_POLL      10000           /* microseconds between cancel checks */
+
+enum { PYC_CACHE_DISABLED = 0, PYC_CACHE_HIT, PYC_CACHE_OWNER, PYC_CACHE_STOPPED };
+enum { PYC_CACHE_KEYSTAT = 1, PYC_CACHE_KEYDATA, PYC_CACHE_KEYRANGE };
+
+typedef struct _pyci_centry_t
+{
+    unsigned char key[PYC_CACHE_KEYLEN];
+    unsigned long generation;
+    int ret;                                /* PYC_CACHE_PENDING while scanned */
+    char *virname;
+    struct _pyci_centry_t *hnext;           /* hash chain */
+    struct _pyci_centry_t *prev, *next;     /* LRU list, most recent first */
+} pyci_centry_t;
+
+typedef struct _pyci_cstripe_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;                    /* a pending entry completed */
+    pyci_centry_t **buckets;
+    size_t nbuckets;
+    size_t count;                           /* completed entries */
+    size_t capacity;
+    pyci_centry_t *head, *tail;
+} pyci_cstripe_t;
+
+typedef struct _pyci_cache_t
+{
+    pyci_cstripe_t stripes[PYC_CACHE_STRIPES];
+} pyci_cache_t;
 
-#define pyci_engineCheckReturn(ret) \
-    if (!(pyci_engine && pyci_isCompiled)) \
-        return ret;
+typedef struct _pyci_sha256_t
+{
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} pyci_sha256_t;
 
-/* Private */
-static int pyci_getVersion(const char *name)
+static const uint32_t pyci_sha256K[64] =
 {
-    char path[MAX_PATH + 1];
-    struct cl_cvd *cvd;
-    unsigned int dbver = 0;
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
 
-    snprintf(path, MAX_PATH, "%s/%s.cvd", pyci_dbpath, name);
-    path[MAX_PATH] = 0;
+#define PYC_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
 
-    if (access(path, R_OK) < 0)
-    {
-        snprintf(path, MAX_PATH, "%s/%s.cld", pyci_dbpath, name);
-        path[MAX_PATH] = 0;
-    }
+static void pyci_sha256Block(pyci_sha256_t *ctx, const unsigned char *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
 
-    if (access(path, R_OK) < 0) return dbver;
+    for (i = 0; i < 16; i++, p += 4)
+        w[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+    for (; i < 64; i++)
+        w[i] = w[i - 16] + (PYC_ROR(w[i - 15], 7) ^ PYC_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3))
+            + w[i - 7] + (PYC_ROR(w[i - 2], 17) ^ PYC_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
 
-    if ((cvd = cl_cvdhead(path)))
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+    for (i = 0; i < 64; i++)
     {
-        dbver = cvd->version;
-        cl_cvdfree(cvd);
+        t1 = h + (PYC_ROR(e, 6) ^ PYC_ROR(e, 11) ^ PYC_ROR(e, 25)) + ((e & f) ^ (~e & g)) + pyci_sha256K[i] + w[i];
+        t2 = (PYC_ROR(a, 2) ^ PYC_ROR(a, 13) ^ PYC_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
     }
 
-    return dbver;
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
 }
 
-static void pyci_getVersions(unsigned int *main, unsigned int *daily, unsigned int *bytecode)
+static void pyci_sha256Init(pyci_sha256_t *ctx)
 {
-    gstate = PyGILState_Ensure();
-    *main = pyci_getVersion("main");
-    *daily = pyci_getVersion("daily");
-    *bytecode = pyci_getVersion("bytecode");
-    PyGILState_Release(gstate);
+    static const uint32_t iv[8] =
+    {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
+    ctx->used = 0;
 }
 
-static void pyci_freeDB(void)
+static void pyci_sha256Update(pyci_sha256_t *ctx, const void *data, size_t len)
 {
-    if (pyci_engine)
-        cl_engine_free(pyci_engine);
-    pyci_engine = NULL;
+    const unsigned char *p = (const unsigned char *) data;
+    size_t n;
+
+    ctx->length += len;
+
+    if (ctx->used)
+    {
+        n = 64 - ctx->used;
+        if (n > len) n = len;
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+        if (ctx->used < 64) return;
+        pyci_sha256Block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+
+    for (; len >= 64; p += 64, len -= 64)
+        pyci_sha256Block(ctx, p);
+
+    memcpy(ctx->block, p, len);
+    ctx->used = len;
 }
 
-static void pyci_setDBPath(const char *path)
+static void pyci_sha256Final(pyci_sha256_t *ctx, unsigned char *digest)
 {
-    gstate = PyGILState_Ensure();
+    uint64_t bits = ctx->length * 8;
+    int i;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56)
+    {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        pyci_sha256Block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (i = 0; i < 8; i++)
+        ctx->block[56 + i] = (unsigned char) (bits >> (56 - i * 8));
+    pyci_sha256Block(ctx, ctx->block);
 
-    strncpy(pyci_dbpath, path, MAX_PATH);
-    pyci_dbpath[MAX_PATH] = 0;
+    for (i = 0; i < 32; i++)
+        digest[i] = (unsigned char) (ctx->state[i / 4] >> (24 - (i % 4) * 8));
+}
 
-    pyci_freeDB();
+#if defined(__APPLE__)
+#define PYC_ST_NSEC(info, t) ((info)->st_##t##timespec.tv_nsec)
+#else
+#define PYC_ST_NSEC(info, t) ((info)->st_##t##tim.tv_nsec)
+#endif
 
-    if (pyci_dbstat)
-        pyci_dbstatFree();
+#ifndef _WIN32
+/* ctime can't be set from userspace, it catches rewrites restoring mtime */
+static void pyci_cacheKeyStat(unsigned char *key, uint32_t options, const struct stat *info)
+{
+    uint64_t v[5];
 
-    if (!(pyci_engine = cl_engine_new()))
-        fprintf(stderr, "Can't initialize antivirus engine");
+    v[0] = info->st_dev;
+    v[1] = info->st_ino;
+    v[2] = info->st_size;
+    v[3] = (uint64_t) info->st_mtime * 1000000000 + PYC_ST_NSEC(info, m);
+    v[4] = (uint64_t) info->st_ctime * 1000000000 + PYC_ST_NSEC(info, c);
 
-    PyGILState_Release(gstate);
+    key[0] = PYC_CACHE_KEYSTAT;
+    memcpy(key + 1, &options, sizeof(options));
+    memcpy(key + 5, v, sizeof(v));
 }
+#endif
 
-static int pyci_loadDB(void)
+static void pyci_cacheKeyData(unsigned char *key, uint32_t options, const void *data, size_t len)
 {
-    int ret = 0;
-    struct cl_settings *settings = NULL;
+    pyci_sha256_t ctx;
 
-    gstate = PyGILState_Ensure();
+    pyci_sha256Init(&ctx);
+    pyci_sha256Update(&ctx, data, len);
 
-    if (pyci_engine)
-    {
-        vmain = vdaily = vbytecode = sigs = 0;
-        settings = cl_engine_settings_copy(pyci_engine);
+    memset(key, 0, PYC_CACHE_KEYLEN);
+    key[0] = PYC_CACHE_KEYDATA;
+    memcpy(key + 1, &options, sizeof(options));
+    pyci_sha256Final(&ctx, key + 5);
+}
 
-        if(!settings)
-            fprintf(stderr, "Can't make a copy of the current engine settings\n");
+#ifndef _WIN32
+static void pyci_cacheKeyRange(unsigned char *key, uint32_t options, const struct stat *info,
+                               uint64_t offset, uint64_t length)
+{
+    unsigned char identity[PYC_CACHE_KEYLEN];
+    pyci_sha256_t ctx;
+    uint64_t v[2];
+
+    pyci_cacheKeyStat(identity, options, info);
+    v[0] = offset;
+    v[1] = length;
+
+    pyci_sha256Init(&ctx);
+    pyci_sha256Update(&ctx, identity, sizeof(identity));
+    pyci_sha256Update(&ctx, v, sizeof(v));
+
+    memset(key, 0, PYC_CACHE_KEYLEN);
+    key[0] = PYC_CACHE_KEYRANGE;
+    memcpy(key + 1, &options, sizeof(options));
+    pyci_sha256Final(&ctx, key + 5);
+}
+#endif
+
+static size_t pyci_cacheHash(const unsigned char *key)
+{
+    size_t h = 2166136261U;
+    int i;
 
-        pyci_freeDB();
+    for (i = 0; i < PYC_CACHE_KEYLEN; i++)
+        h = (h ^ key[i]) * 16777619U;
+    return h;
+}
 
-        pyc_DEBUG(loadDB(internal), "Loading db from %s\n", pyci_dbpath);
-    }
+static pyci_cstripe_t *pyci_cacheFind(pyci_cache_t *c, const unsigned char *key, pyci_centry_t ***slot)
+{
+    size_t h = pyci_cacheHash(key);
+    pyci_cstripe_t *s = &c->stripes[h % PYC_CACHE_STRIPES];
+    pyci_centry_t **p = NULL;
 
-    if (!(pyci_engine = cl_engine_new()))
+    pthread_mutex_lock(&s->lock);
+    if (s->buckets)
     {
-        PyErr_SetString(PycError, "loadDB(internal): Can't initialize antivirus engine");
-        goto cleanup;
+        p = &s->buckets[(h / PYC_CACHE_STRIPES) & (s->nbuckets - 1)];
+        while (*p && memcmp((*p)->key, key, PYC_CACHE_KEYLEN))
+            p = &(*p)->hnext;
     }
+    *slot = p;
+    return s;
+}
 
-    if (settings)
+static void pyci_cacheLink(pyci_cstripe_t *s, pyci_centry_t *entry)
+{
+    entry->prev = NULL;
+    if ((entry->next = s->head))
+        s->head->prev = entry;
+    else
+        s->tail = entry;
+    s->head = entry;
+}
+
+static void pyci_cacheUnlink(pyci_cstripe_t *s, pyci_centry_t *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        s->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        s->tail = entry->prev;
+}
+
+/* Drops least recently used entries until count fits, pending ones
+   are not in the LRU list and are never evicted */
+static void pyci_cacheEvict(pyci_cstripe_t *s, size_t count)
+{
+    pyci_centry_t *entry, **p;
+
+    while (s->count > count)
     {
-        if ((ret = cl_engine_settings_apply(pyci_engine, settings)) != CL_SUCCESS)
-        {
-            fprintf(stderr, "Can't apply previous engine settings: %s\n", cl_strerror(ret));
-            fprintf(stderr, "Using default engine settings\n");
-        }
+        entry = s->tail;
+        pyci_cacheUnlink(s, entry);
+        s->count--;
+
+        p = &s->buckets[(pyci_cacheHash(entry->key) / PYC_CACHE_STRIPES) & (s->nbuckets - 1)];
+        while (*p != entry)
+            p = &(*p)->hnext;
+        *p = entry->hnext;
+
+        free(entry->virname);
+        free(entry);
     }
+}
+
+static void pyci_cacheInit(pyci_cache_t *c)
+{
+    int i;
 
-    if ((ret = cl_load(pyci_dbpath, pyci_engine, &sigs, CL_DB_STDOPT)))
+    for (i = 0; i < PYC_CACHE_STRIPES; i++)
     {
-        PyErr_PycFromClamav(loadDB(internal)::cl_load, ret);
-        pyci_freeDB();
-        goto cleanup;
+        pthread_mutex_init(&c->stripes[i].lock, NULL);
+        pthread_cond_init(&c->stripes[i].done, NULL);
     }
+}
+
+/* No scans can be running at this point */
+static void pyci_cacheDestroy(pyci_cache_t *c)
+{
+    pyci_cstripe_t *s;
+    int i;
 
-    if ((ret = cl_engine_compile(pyci_engine)))
+    for (i = 0; i < PYC_CACHE_STRIPES; i++)
     {
-        PyErr_PycFromClamav(loadDB(internal)::cl_engine_compile, ret);
-        pyci_freeDB();
-        goto cleanup;
+        s = &c->stripes[i];
+        pyci_cacheEvict(s, 0);
+        free(s->buckets);
+        pthread_cond_destroy(&s->done);
+        pthread_mutex_destroy(&s->lock);
     }
+}
 
+/* Sets the total number of entries, 0 disables the cache */
+static int pyci_cacheResize(pyci_cache_t *c, size_t entries)
+{
+    pyci_centry_t **buckets, *entry, *next;
+    pyci_cstripe_t *s;
+    size_t capacity, nbuckets, j, h;
+    int i, ret = CL_SUCCESS;
 
-    ret = pyci_dbstatNew();
-    pyci_lastcheck = time(NULL);
+    capacity = (entries + PYC_CACHE_STRIPES - 1) / PYC_CACHE_STRIPES;
+    for (nbuckets = 16; nbuckets < capacity; nbuckets *= 2);
 
- cleanup:
-    if (settings)
-        cl_engine_settings_free(settings);
+    for (i = 0; i < PYC_CACHE_STRIPES; i++)
+    {
+        s = &c->stripes[i];
+        pthread_mutex_lock(&s->lock);
 
-    PyGILState_Release(gstate);
-    if (!ret) pyci_getVersions(&vmain, &vdaily, &vbytecode);
-    return ret;
-}
+        if (capacity && (nbuckets > s->nbuckets))
+        {
+            if (!(buckets = calloc(nbuckets, sizeof(pyci_centry_t *))))
+            {
+                pthread_mutex_unlock(&s->lock);
+                ret = CL_EMEM;
+                break;
+            }
+            for (j = 0; j < s->nbuckets; j++)
+            {
+                for (entry = s->buckets[j]; entry; entry = next)
+                {
+                    next = entry->hnext;
+                    h = (pyci_cacheHash(entry->key) / PYC_CACHE_STRIPES) & (nbuckets - 1);
+                    entry->hnext = buckets[h];
+                    buckets[h] = entry;
+                }
+            }
+            free(s->buckets);
+            s->buckets = buckets;
+            s->nbuckets = nbuckets;
+        }
 
-static void pyci_dbstatFree(void)
-{
-    assert(pyci_dbstat);
-    cl_statfree(pyci_dbstat);
-    PyMem_Free(pyci_dbstat);
-    pyci_dbstat = NULL;
+        s->capacity = capacity;
+        pyci_cacheEvict(s, capacity);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return ret;
 }
 
-static int pyci_dbstatNew(void)
+/* Drops all the completed entries, used when the database changes */
+static void pyci_cacheFlush(pyci_cache_t *c)
 {
-    int ret;
-    if (pyci_dbstat) pyci_dbstatFree();
+    int i;
 
-    if (!(pyci_dbstat = PyMem_Malloc(sizeof(struct cl_stat))))
+    for (i = 0; i < PYC_CACHE_STRIPES; i++)
     {
-        pyc_DEBUG(pyci_dbstatNew, "Out of memory\n");
-        return CL_EMEM;
+        pthread_mutex_lock(&c->stripes[i].lock);
+        pyci_cacheEvict(&c->stripes[i], 0);
+        pthread_mutex_unlock(&c->stripes[i].lock);
     }
+}
 
-    pyc_DEBUG(pyci_dbstatNew, "Calling cl_statinidir() on %s\n", pyci_dbpath);
-    if ((ret = cl_statinidir(pyci_dbpath, pyci_dbstat)))
-    {
-        PyErr_PycFromClamav(dbstatNew::cl_statinidir, ret);
-        PyMem_Free(pyci_dbstat);
-        return ret;
-    }
-    return CL_SUCCESS;
+/* Waits on cond for up to timeout microseconds, pthread_cond_timedwait()
+   takes a realtime deadline */
+static void pyci_condWait(pthread_cond_t *cond, pthread_mutex_t *lock, uint64_t timeout)
+{
+    struct timespec ts;
+    uint64_t t;
+#ifdef _WIN32
+    FILETIME ft;
+
+    GetSystemTimeAsFileTime(&ft);
+    t = ((((uint64_t) ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10) - 11644473600000000ULL;
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+    t = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    t += timeout;
+    ts.tv_sec = t / 1000000;
+    ts.tv_nsec = (t % 1000000) * 1000;
+    pthread_cond_timedwait(cond, lock, &ts);
 }
 
-static int pyci_checkAndLoadDB(int force)
+/* Looks up a key for a scan with an engine of the given generation.
+   On a hit ret and a copy of the virus name are returned, the caller
+   frees it. PYC_CACHE_OWNER means the caller has to scan and report
+   with pyci_cacheEnd(), meanwhile other scans of the same key wait.
+   A wait is bound by the limits of the caller, PYC_CACHE_STOPPED means
+   one was hit and ret has its PYC_SCAN_* code */
+static int pyci_cacheBegin(pyci_cache_t *c, const unsigned char *key, unsigned long generation,
+                           const pyci_limits_t *limits, int *ret, char **virname)
 {
-    int ret;
+    pyci_centry_t **slot, *entry;
+    pyci_cstripe_t *s;
+    uint64_t now, timeout;
 
-    pyci_engineCheckReturn(pyci_loadDB());
+    s = pyci_cacheFind(c, key, &slot);
 
-    if (!force)
+    for (;;)
     {
-        if (pyci_checktimer == PYC_SELFCHECK_NEVER) return CL_SUCCESS;
+        if (!s->capacity)
+            break;
 
-        if ((pyci_checktimer > 0) || !pyci_lastcheck)
+        if (!(entry = *slot))
         {
-            time_t now = time(NULL);
-            if ((now - pyci_lastcheck) < pyci_checktimer)
-                return CL_SUCCESS;
+            if (!(entry = calloc(1, sizeof(pyci_centry_t))))
+                break;
+            memcpy(entry->key, key, PYC_CACHE_KEYLEN);
+            entry->generation = generation;
+            entry->ret = PYC_CACHE_PENDING;
+            *slot = entry;
+            pthread_mutex_unlock(&s->lock);
+            return PYC_CACHE_OWNER;
         }
-    }
 
-    pyc_DEBUG(checkAndLoadDB, "SelfCheck\n");
+        if (entry->ret == PYC_CACHE_PENDING)
+        {
+            if (!limits || (!limits->deadline && !limits->cancel))
+                pthread_cond_wait(&s->done, &s->lock);
+            else
+            {
+                now = pyci_now();
+                if ((limits->cancel && *limits->cancel) || (limits->deadline && (now >= limits->deadline)))
+                {
+                    pthread_mutex_unlock(&s->lock);
+                    *ret = (limits->cancel && *limits->cancel) ? PYC_SCAN_CANCELLED : PYC_SCAN_TIMEOUT;
+                    *virname = NULL;
+                    return PYC_CACHE_STOPPED;
+                }
 
-    if (!pyci_dbstat && (ret = pyci_dbstatNew()))
-        return ret;
+                /* a cancel doesn't signal, it's polled */
+                timeout = limits->deadline ? (limits->deadline - now) : PYC_CACHE_POLL;
+                if (limits->cancel && (timeout > PYC_CACHE_POLL))
+                    timeout = PYC_CACHE_POLL;
+                pyci_condWait(&s->done, &s->lock, timeout);
+            }
+            /* the entry may be gone or the table rehashed */
+            pthread_mutex_unlock(&s->lock);
+            s = pyci_cacheFind(c, key, &slot);
+            continue;
+        }
 
-    pyci_lastcheck = time(NULL);
+        pyci_cacheUnlink(s, entry);
 
-    switch ((ret = cl_statchkdir(pyci_dbstat)))
-    {
-        case 1: /* needs to be reloaded */
-            pyc_DEBUG(pyci_checkAndLoadDB, "virus db needs to be reloaded\n");
+        if (entry->generation >= generation)
+        {
+            *virname = NULL;
+            if (!entry->virname || (*virname = strdup(entry->virname)))
+            {
+                *ret = entry->ret;
+                pyci_cacheLink(s, entry);
+                pthread_mutex_unlock(&s->lock);
+                return PYC_CACHE_HIT;
+            }
+            pyci_cacheLink(s, entry);
             break;
-        case CL_SUCCESS:
-            pyc_DEBUG(pyci_checkAndLoadDB, "virus db is up to date\n");
-            return CL_SUCCESS;
-        default:
-            PyErr_PycFromClamav(checkAndLoadDB::cl_statchkdir, ret);
-            return ret;
+        }
+
+        /* stale, rescan it */
+        s->count--;
+        free(entry->virname);
+        entry->virname = NULL;
+        entry->generation = generation;
+        entry->ret = PYC_CACHE_PENDING;
+        pthread_mutex_unlock(&s->lock);
+        return PYC_CACHE_OWNER;
     }
 
-    return pyci_loadDB();
+    pthread_mutex_unlock(&s->lock);
+    return PYC_CACHE_DISABLED;
 }
 
-static void pyci_cleanup(void)
+/* Completes a pending entry, errors are not cached */
+static void pyci_cacheEnd(pyci_cache_t *c, const unsigned char *key, int ret, const char *virname)
 {
-    if (pyci_dbstat) pyci_dbstatFree();
-    if (pyci_engine) cl_engine_free(pyci_engine);
-}
+    pyci_centry_t **slot, *entry;
+    pyci_cstripe_t *s;
 
-/* Public */
-static PyObject *pyc_checkAndLoadDB(PyObject *self, PyObject *args)
-{
-    int ret;
-    if ((ret = pyci_checkAndLoadDB(1)))
+    s = pyci_cacheFind(c, key, &slot);
+
+    if ((entry = *slot))
     {
-        PyErr_PycFromClamav(pyc_loadDB, ret);
-        return NULL;
+        assert(entry->ret == PYC_CACHE_PENDING);
+
+        if (s->capacity && ((ret == CL_CLEAN) || ((ret == CL_VIRUS) && (entry->virname = strdup(virname)))))
+        {
+            entry->ret = ret;
+            pyci_cacheLink(s, entry);
+            s->count++;
+            pyci_cacheEvict(s, s->capacity);
+        }
+        else
+        {
+            *slot = entry->hnext;
+            free(entry);
+        }
     }
-    Py_RETURN_NONE;
+
+    pthread_cond_broadcast(&s->done);
+    pthread_mutex_unlock(&s->lock);
 }
 
-static PyObject *pyc_getVersions(PyObject *self, PyObject *args)
+/* Pre-scan policy by libclamav file type, built by setScanPolicy() and
+   never changed afterwards, scans hold a reference on it like they do on
+   the engine. A maxsize of PYC_POLICY_SCAN always scans, otherwise larger
+   objects are skipped, 0 skips them all, objects of unknown size are
+   scanned. The hook is only asked about
+   what the table lets through. The last reference is always dropped
+   with the GIL held */
+#define PYC_POLICY_SCAN     -1
+#define PYC_POLICY_TYPELEN  32
+
+typedef struct _pyci_prule_t
 {
-    const char *version;
-    pyci_engineCheck(getVersions);
-    version = cl_retver();
-    return Py_BuildValue("(s,i,i,i,i)", version, vmain, vdaily, vbytecode, sigs);
-}
+    char type[PYC_POLICY_TYPELEN];
+    int64_t maxsize;
+} pyci_prule_t;
 
-static PyObject *pyc_setDBPath(PyObject *self, PyObject *args)
+typedef struct _pyci_policy_t
 {
-    char *path = NULL;
-    struct stat dp;
+    pthread_mutex_t lock;
+    unsigned int refs;
+    int64_t fallback;                       /* maxsize of the types not in rules */
+    PyObject *hook;                         /* NULL when not set */
+    size_t count;
+    pyci_prule_t rules[1];                  /* count of them */
+} pyci_policy_t;
+
+/* Context of the libclamav callbacks, one per scan */
+typedef struct _pyci_cbctx_t
+{
+    pyci_policy_t *policy;
+    const pyci_limits_t *limits;            /* NULL when there are none */
+    int fd;                                 /* of the scanned object, -1 for none */
+    size_t size;                            /* of the scanned object without one */
+    unsigned int objects;                   /* typed so far, the first one is the scanned object */
+    uint64_t skipped, skippedbytes;
+    uint64_t bytes;                         /* typed so far, for maxbytes */
+    int stopped;                            /* PYC_SCAN_* once a limit is hit */
+} pyci_cbctx_t;
+
+/* Scan statistics, counters are split in shards with their own lock and
+   each thread always updates the same shard, so concurrent scans don't
+   fight over a cache line. getStats() merges them. Latencies go in log2
+   buckets of microseconds */
+#define PYC_STATS_SHARDS    16
+#define PYC_STATS_BUCKETS   32
 
-    if (!PyArg_ParseTuple(args, "s", &path))
-    {
-        PyErr_SetString(PycError, "setDBPath: Database path must be a String");
-        return NULL;
-    }
+#ifdef _MSC_VER
+#define PYC_TLS __declspec(thread)
+#else
+#define PYC_TLS __thread
+#endif
 
-    if (lstat(path, &dp) < 0)
-    {
-        PyErr_PycFromErrno(pyc_setDBPath);
-        return NULL;
-    }
+typedef struct _pyci_shard_t
+{
+    pthread_mutex_t lock;
+    uint64_t scans;
+    uint64_t bytes;
+    uint64_t clean;
+    uint64_t virus;
+    uint64_t errors;
+    uint64_t cached;
+    uint64_t stopped;                       /* by a per call limit */
+    uint64_t skipped, skippedbytes;         /* by the pre-scan policy */
+    uint64_t latency[PYC_STATS_BUCKETS];
+    char pad[64];
+} pyci_shard_t;
+
+typedef struct _pyci_stats_t
+{
+    pyci_shard_t shards[PYC_STATS_SHARDS];
+} pyci_stats_t;
 
-    pyci_setDBPath(path);
-    Py_RETURN_NONE;
+static pthread_mutex_t pyci_shardLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int pyci_shardNext = 0;
+static PYC_TLS unsigned int pyci_shard = 0;    /* index + 1, 0 until assigned */
+
+static void pyci_statsInit(pyci_stats_t *stats)
+{
+    int i;
+    for (i = 0; i < PYC_STATS_SHARDS; i++)
+        pthread_mutex_init(&stats->shards[i].lock, NULL);
 }
 
-static PyObject *pyc_getDBPath(PyObject *self, PyObject *args)
+static void pyci_statsDestroy(pyci_stats_t *stats)
 {
-    return PyString_FromString(pyci_dbpath);
+    int i;
+    for (i = 0; i < PYC_STATS_SHARDS; i++)
+        pthread_mutex_destroy(&stats->shards[i].lock);
 }
 
-static PyObject *pyc_loadDB(PyObject *self, PyObject *args)
+/* Accounts a scan that started at start, scanned is in CL_COUNT_PRECISION units,
+   cb has what the policy skipped, if anything */
+static void pyci_statsScan(pyci_stats_t *stats, int ret, unsigned long scanned, uint64_t start, int cached,
+                           const pyci_cbctx_t *cb)
 {
-    PyObject *result = NULL;
-    unsigned int ret = 0;
+    pyci_shard_t *shard;
+    uint64_t elapsed = pyci_now() - start;
+    int bucket = 0;
 
-    if (!PyArg_UnpackTuple(args, "loadDB", 0, 1, &result))
+    if (!pyci_shard)
     {
-        PyErr_SetString(PycError, "loadDB: Invalid arguments");
-        return NULL;
+        pthread_mutex_lock(&pyci_shardLock);
+        pyci_shard = (pyci_shardNext++ % PYC_STATS_SHARDS) + 1;
+        pthread_mutex_unlock(&pyci_shardLock);
     }
 
-    if (result)
+    while ((elapsed >>= 1) && (bucket < (PYC_STATS_BUCKETS - 1)))
+        bucket++;
+
+    shard = &stats->shards[pyci_shard - 1];
+    pthread_mutex_lock(&shard->lock);
+    shard->scans++;
+    shard->bytes += (uint64_t) scanned * CL_COUNT_PRECISION;
+    switch (ret)
     {
-        if (PyString_Check(result))
-            pyci_setDBPath(PyString_AsString(result));
-        else
-        {
-            PyErr_SetString(PyExc_TypeError, "loadDB: Database path must be a String");
-            return NULL;
-        }
+        case CL_CLEAN: shard->clean++; break;
+        case CL_VIRUS: shard->virus++; break;
+        case PYC_SCAN_TIMEOUT:
+        case PYC_SCAN_LIMIT:
+        case PYC_SCAN_CANCELLED: shard->stopped++; break;
+        default: shard->errors++;
     }
-
-    if ((ret = pyci_checkAndLoadDB(1)))
+    if (cached) shard->cached++;
+    if (cb)
     {
-        PyErr_PycFromClamav(loadDB, ret);
-        return NULL;
+        shard->skipped += cb->skipped;
+        shard->skippedbytes += cb->skippedbytes;
     }
-
-    Py_RETURN_NONE;
+    shard->latency[bucket]++;
+    pthread_mutex_unlock(&shard->lock);
 }
 
-static PyObject *pyc_setDBTimer(PyObject *self, PyObject *args)
+/* What the last successful database load did */
+typedef struct _pyci_dbfile_t
 {
-    int value = 0;
-    if (!PyArg_ParseTuple(args, "i", &value))
+    char name[256];
+    unsigned int sigs;
+} pyci_dbfile_t;
+
+typedef struct _pyci_report_t
+{
+    uint32_t dboptions;
+    unsigned int sigs;
+    uint64_t loadtime, compiletime;         /* microseconds */
+    uint64_t rssbefore, rssafter;           /* bytes, 0 when unknown */
+    size_t nfiles;
+    pyci_dbfile_t files[1];                 /* nfiles of them */
+} pyci_report_t;
+
+/* Engine state, shared by a pyc.Engine object and the background threads
+   working on it, it's reference counted and freed when the last user goes.
+   engine is swapped under engineLock, scans hold their own reference on
+   it, so the old one is only freed by libclamav when the last scan using
+   it drops its reference. reloadLock serializes the builds of a new
+   engine and guards dbstat, dbpath is written holding both locks.
+   generation is bumped under engineLock whenever the same scan could
+   give a different result. None of them is ever held while waiting
+   for the GIL */
+typedef struct _pyci_engine_t
+{
+    struct cl_engine *engine;
+    struct cl_stat *dbstat;
+    uint32_t options;
+    uint32_t dboptions;
+    pyci_report_t *report;                  /* swapped under engineLock */
+    pyci_policy_t *policy;                  /* same, dropped by the engine object */
+    unsigned int sigs;
+    unsigned int vmain, vdaily, vbytecode;
+    char dbpath[MAX_PATH + 1];
+    char cachedir[MAX_PATH + 1];            /* empty when disabled, written like dbpath */
+    time_t lastcheck;                       /* under engineLock */
+    time_t checktimer;                      /* same */
+    int reloading;
+    int watching, watchstop;                /* watcher thread, written under engineLock */
+    int wakefd[2], notifyfd;                /* owned by the watcher */
+    unsigned int refs;
+    unsigned long generation;
+    size_t cachesize;
+    pyci_cache_t cache;
+    pyci_stats_t stats;
+    uint64_t loads, loaderrors;             /* under engineLock like the ones below */
+    uint64_t loadtime, loadlast, loadmax;   /* microseconds */
+    uint64_t selfchecks;
+    pthread_mutex_t engineLock;
+    pthread_mutex_t reloadLock;
+    int forklocked;                         /* reloadLock taken by pyci_forkPrepare */
+    struct _pyci_engine_t *prev, *next;     /* live engines, under pyci_enginesLock */
+} pyci_engine_t;
+
+/* What a scan needs from the engine state, taken at once under engineLock */
+typedef struct _pyci_scanctx_t
+{
+    struct cl_engine *engine;
+    uint32_t options;
+    unsigned long generation;
+    pyci_cache_t *cache;                    /* NULL when disabled */
+    pyci_stats_t *stats;
+    pyci_policy_t *policy;                  /* NULL when not set */
+    const pyci_limits_t *limits;            /* set by the caller, NULL for none */
+} pyci_scanctx_t;
+
+/* Python objects of the module, there's one set per interpreter on
+   python 3, everything else is plain C guarded by its own locks */
+typedef struct _pyc_State
+{
+    PyObject *error;                        /* pyc.PycError */
+    PyTypeObject *engineType;
+    PyTypeObject *cancelType;
+    PyTypeObject *streamType;
+    struct _pyc_Engine *engine;             /* used by the module functions */
+    PyObject *aqueues;                      /* see pyci_aqueueGet() */
+} pyc_State;
+
+/* state lives as long as the module, kept alive through the type */
+typedef struct _pyc_Engine
+{
+    PyObject_HEAD
+    pyci_engine_t *e;
+    pyc_State *state;
+} pyc_Engine;
+
+/* cancelled is read by scans without the GIL */
+typedef struct _pyc_CancelToken
+{
+    PyObject_HEAD
+    volatile int cancelled;
+} pyc_CancelToken;
+
+#define PYC_STREAM_OPEN     0
+#define PYC_STREAM_BUSY     1
+#define PYC_STREAM_CLOSED   2
+#define PYC_STREAM_SPILL    (16 * 1024 * 1024)
+
+/* Data written so far stays in buf up to spill bytes, then moves to fd.
+   lock guards state, finish() scans without it marked busy */
+typedef struct _pyc_Stream
+{
+    PyObject_HEAD
+    pyc_Engine *engine;
+    pthread_mutex_t lock;
+    int state;
+    char *buf;
+    size_t len, alloc;
+    int fd;                                 /* -1 until spilled, set under the lock */
+    uint64_t size;                          /* same */
+    uint64_t spill;
+    uint64_t maxsize;                       /* 0 for none */
+} pyc_Stream;
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef pycModule;
+#define pyci_moduleState(m) ((pyc_State *) PyModule_GetState(m))
+#else
+static PyTypeObject pyc_EngineType;
+static PyTypeObject pyc_CancelTokenType;
+static PyTypeObject pyc_StreamType;
+static pyc_State pyci_state;
+#define pyci_moduleState(m) (&pyci_state)
+#endif
+
+static pthread_mutex_t pyci_enginesLock = PTHREAD_MUTEX_INITIALIZER;
+static pyci_engine_t *pyci_engines = NULL;
+
+static int pyci_dbstatNew(pyci_engine_t *e);
+static void pyci_dbstatFree(pyci_engine_t *e);
+static int pyci_preCache(int fd, const char *type, void *context);
+static int pyci_preScan(int fd, const char *type, void *context);
+#ifndef _WIN32
+static void pyci_watchWake(pyci_engine_t *e);
+#endif
+
+#define pyci_engineCheck(self, func) \
+    if (!pyci_isLoaded((self)->e)) \
+    { \
+        PyErr_SetString(PycError(self), #func": No database loaded"); \
+        return NULL; \
+    }
+
+/* Private */
+static pyci_engine_t *pyci_engineNew(const char *dbpath)
+{
+    pyci_engine_t *e;
+
+    if (!(e = calloc(1, sizeof(pyci_engine_t))))
+        return NULL;
+
+    if (!(e->engine = cl_engine_new()))
     {
-        PyErr_SetString(PycError, "setDBTimer: Invalid arguments");
+        free(e);
         return NULL;
     }
 
-    pyci_checktimer = value;
-    Py_RETURN_NONE;
+    strncpy(e->dbpath, dbpath, MAX_PATH);
+    e->dbpath[MAX_PATH] = 0;
+    e->options = CL_SCAN_STDOPT;
+    e->dboptions = CL_DB_STDOPT;
+    e->checktimer = PYC_SELFCHECK_NEVER;
+    e->wakefd[0] = e->wakefd[1] = e->notifyfd = -1;
+    e->refs = 1;
+    pthread_mutex_init(&e->engineLock, NULL);
+    pthread_mutex_init(&e->reloadLock, NULL);
+    pyci_cacheInit(&e->cache);
+    pyci_statsInit(&e->stats);
+
+    pthread_mutex_lock(&pyci_enginesLock);
+    if ((e->next = pyci_engines))
+        pyci_engines->prev = e;
+    pyci_engines = e;
+    pthread_mutex_unlock(&pyci_enginesLock);
+
+    return e;
 }
 
-static PyObject *pyc_isLoaded(PyObject *self, PyObject *args)
+static void pyci_engineRelease(pyci_engine_t *e)
 {
-    assert(pyci_engine);
-    if (pyci_isCompiled)
-        Py_RETURN_TRUE;
+    unsigned int refs;
+
+    pthread_mutex_lock(&e->engineLock);
+    refs = --e->refs;
+    pthread_mutex_unlock(&e->engineLock);
+
+    if (refs) return;
+
+    pthread_mutex_lock(&pyci_enginesLock);
+    if (e->prev)
+        e->prev->next = e->next;
     else
-        Py_RETURN_FALSE;
+        pyci_engines = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    pthread_mutex_unlock(&pyci_enginesLock);
+
+    if (e->dbstat) pyci_dbstatFree(e);
+    if (e->engine) cl_engine_free(e->engine);
+    free(e->report);
+    pyci_cacheDestroy(&e->cache);
+    pyci_statsDestroy(&e->stats);
+    pthread_mutex_destroy(&e->reloadLock);
+    pthread_mutex_destroy(&e->engineLock);
+    free(e);
 }
 
-/* Warning passing fd on windows works only if the crt used by python is
-   the same used to compile libclamav */
-static PyObject *pyc_scanDesc(PyObject *self, PyObject *args)
+static int pyci_isLoaded(pyci_engine_t *e)
 {
-    unsigned int ret;
-    unsigned long scanned = 0;
-    const char *virname = NULL;
-    int fd = -1;
-
-    pyci_engineCheck(scanDesc);
+    int loaded;
+    pthread_mutex_lock(&e->engineLock);
+    loaded = e->engine && (cl_engine_get_num(e->engine, CL_ENGINE_DB_OPTIONS, NULL) & CL_DB_COMPILED);
+    pthread_mutex_unlock(&e->engineLock);
+    return loaded;
+}
 
-    if (!PyArg_ParseTuple(args, "i", &fd) || (fd < 0))
+/* Take a reference on the current engine for the duration of a scan */
+static void pyci_engineGet(pyci_engine_t *e, pyci_scanctx_t *ctx)
+{
+    pthread_mutex_lock(&e->engineLock);
+    if ((ctx->engine = e->engine))
+        cl_engine_addref(ctx->engine);
+    ctx->options = e->options;
+    ctx->generation = e->generation;
+    ctx->cache = e->cachesize ? &e->cache : NULL;
+    ctx->stats = &e->stats;
+    ctx->limits = NULL;
+    if ((ctx->policy = e->policy))
     {
-        PyErr_SetString(PycError, "scanDesc: Invalid arguments");
-        return NULL;
+        pthread_mutex_lock(&ctx->policy->lock);
+        ctx->policy->refs++;
+        pthread_mutex_unlock(&ctx->policy->lock);
     }
+    pthread_mutex_unlock(&e->engineLock);
+}
 
-    if ((ret = pyci_checkAndLoadDB(0)))
+#define pyci_enginePut(engine) cl_engine_free(engine)
+
+/* Called with the GIL */
+static void pyci_policyPut(pyci_policy_t *policy)
+{
+    unsigned int refs;
+
+    pthread_mutex_lock(&policy->lock);
+    refs = --policy->refs;
+    pthread_mutex_unlock(&policy->lock);
+
+    if (refs) return;
+
+    Py_XDECREF(policy->hook);
+    pthread_mutex_destroy(&policy->lock);
+    free(policy);
+}
+
+/* Publishes a new policy or none, the engine state holds one reference
+   on it, called with the GIL */
+static void pyci_policySet(pyci_engine_t *e, pyci_policy_t *policy)
+{
+    pyci_policy_t *old;
+
+    pthread_mutex_lock(&e->engineLock);
+    old = e->policy;
+    e->policy = policy;
+    e->generation++;
+    pthread_mutex_unlock(&e->engineLock);
+
+    if (old) pyci_policyPut(old);
+}
+
+/* Drops what pyci_engineGet() took, called with the GIL */
+static void pyci_contextPut(pyci_scanctx_t *ctx)
+{
+    if (ctx->engine) pyci_enginePut(ctx->engine);
+    if (ctx->policy) pyci_policyPut(ctx->policy);
+}
+
+static int pyci_getVersion(pyci_engine_t *e, const char *name)
+{
+    char path[MAX_PATH + 1];
+    struct cl_cvd *cvd;
+    unsigned int dbver = 0;
+
+    snprintf(path, MAX_PATH, "%s/%s.cvd", e->dbpath, name);
+    path[MAX_PATH] = 0;
+
+    if (access(path, R_OK) < 0)
     {
-        PyErr_PycFromClamav(scanDesc, ret);
-        return NULL;
+        snprintf(path, MAX_PATH, "%s/%s.cld", e->dbpath, name);
+        path[MAX_PATH] = 0;
+    }
+
+    if (access(path, R_OK) < 0) return dbver;
+
+    if ((cvd = cl_cvdhead(path)))
+    {
+        dbver = cvd->version;
+        cl_cvdfree(cvd);
     }
 
+    return dbver;
+}
+
+static void pyci_setDBPath(pyci_engine_t *e, const char *path)
+{
+    struct cl_engine *engine, *old;
+
+    if (!(engine = cl_engine_new()))
+        fprintf(stderr, "Can't initialize antivirus engine");
+
     Py_BEGIN_ALLOW_THREADS;
-    ret = cl_scandesc(fd, &virname, &scanned, pyci_engine, pyci_options);
+    pthread_mutex_lock(&e->reloadLock);
+
+    if (e->dbstat)
+        pyci_dbstatFree(e);
+
+    pthread_mutex_lock(&e->engineLock);
+    strncpy(e->dbpath, path, MAX_PATH);
+    e->dbpath[MAX_PATH] = 0;
+    old = e->engine;
+    e->engine = engine;
+    e->vmain = e->vdaily = e->vbytecode = e->sigs = 0;
+    e->generation++;
+#ifndef _WIN32
+    pyci_watchWake(e);
+#endif
+    pthread_mutex_unlock(&e->engineLock);
+
+    pthread_mutex_unlock(&e->reloadLock);
+    pyci_cacheFlush(&e->cache);
     Py_END_ALLOW_THREADS;
 
-    switch (ret)
+    if (old) pyci_enginePut(old);
+}
+
+/* Resident set size in bytes, elsewhere than on linux only the peak is
+   available */
+static uint64_t pyci_rss(void)
+{
+#if defined(__linux__)
+    unsigned long size, resident = 0;
+    FILE *f;
+
+    if (!(f = fopen("/proc/self/statm", "r")))
+        return 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return (uint64_t) resident * sysconf(_SC_PAGESIZE);
+#elif !defined(_WIN32)
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#ifdef __APPLE__
+    return (uint64_t) usage.ru_maxrss;
+#else
+    return (uint64_t) usage.ru_maxrss * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+/* Allocates a report with the signature count of each database file,
+   files libclamav doesn't know are skipped */
+static pyci_report_t *pyci_reportNew(const char *dbpath)
+{
+    pyci_report_t *report, *grown;
+    size_t size = 16;
+#ifndef _WIN32
+    char path[MAX_PATH + 1];
+    struct dirent *entry;
+    struct stat info;
+    unsigned int sigs;
+    size_t len;
+    DIR *dir;
+#endif
+
+    if (!(report = calloc(1, sizeof(pyci_report_t) + size * sizeof(pyci_dbfile_t))))
+        return NULL;
+
+#ifndef _WIN32
+    if (!(dir = opendir(dbpath)))
+        return report;
+
+    while ((entry = readdir(dir)))
     {
-        case CL_CLEAN: return Py_BuildValue("(O,s)", Py_False, "CLEAN");
-        case CL_VIRUS: return Py_BuildValue("(O,s)", Py_True,  virname);
+        if (entry->d_name[0] == '.')
+            continue;
+
+        snprintf(path, MAX_PATH, "%s/%s", dbpath, entry->d_name);
+        path[MAX_PATH] = 0;
+
+        sigs = 0;
+        if (stat(path, &info) || !S_ISREG(info.st_mode) || cl_countsigs(path, CL_COUNTSIGS_ALL, &sigs))
+            continue;
+
+        if (report->nfiles == size)
+        {
+            if (!(grown = realloc(report, sizeof(pyci_report_t) + size * 2 * sizeof(pyci_dbfile_t))))
+                break;
+            report = grown;
+            size *= 2;
+        }
+
+        if ((len = strlen(entry->d_name)) >= sizeof(report->files[0].name))
+            len = sizeof(report->files[0].name) - 1;
+        memcpy(report->files[report->nfiles].name, entry->d_name, len);
+        report->files[report->nfiles].name[len] = 0;
+        report->files[report->nfiles].sigs = sigs;
+        report->nfiles++;
     }
+    closedir(dir);
+#endif
 
-    PyErr_PycFromClamav(ScanDesc, ret);
-    return NULL;
+    return report;
 }
 
-static PyObject *pyc_scanFile(PyObject *self, PyObject *args)
+#ifndef _WIN32
+/* Local cache of unpacked official databases. A CVD or CLD is verified
+   and unpacked once in <cachedir>/<name>-<version>, later loads read
+   the signature files from there while its version is the same. The
+   unpacked files are loaded as signed official signatures, like
+   libclamav does when loading the archive itself, the other files of
+   the database directory are loaded as usual. The cache must be private
+   to the user, each unpacked directory has a manifest with the size,
+   mtime and inode of its files checked before every load. Databases
+   the cache can't hold are loaded as they are */
+#define PYC_TAR_BLOCK       512
+#define PYC_DBCACHE_MAX     32
+#define PYC_DBCACHE_MANIFEST "pyc.manifest"
+#define PYC_DBCACHE_PLAIN   -1
+
+typedef struct _pyci_cvd_t
+{
+    char name[64];
+    char file[MAX_PATH + 1];
+    unsigned int version;
+} pyci_cvd_t;
+
+/* The other extensions libclamav loads from a directory, its CLI_DBEXT */
+static const char *pyci_dbext[] =
+{
+    ".db", ".db2", ".db3", ".hdb", ".hdu", ".fp", ".mdb", ".mdu", ".hsb", ".hsu", ".sfp",
+    ".msb", ".msu", ".ndb", ".ndu", ".ldb", ".ldu", ".sdb", ".zmd", ".rmd", ".pdb", ".gdb",
+    ".wdb", ".cbc", ".ftm", ".cfg", ".cdb", ".cat", ".crb", ".idb", ".ioc", ".info", NULL
+};
+
+static int pyci_isDBFile(const char *ext)
+{
+    int i;
+
+    for (i = 0; ext && pyci_dbext[i]; i++)
+        if (!strcasecmp(ext, pyci_dbext[i]))
+            return 1;
+    return 0;
+}
+
+/* Removes a directory and the files in it */
+static void pyci_rmdir(const char *path)
+{
+    char file[MAX_PATH + 1];
+    struct dirent *entry;
+    DIR *dir;
+
+    if ((dir = opendir(path)))
+    {
+        while ((entry = readdir(dir)))
+        {
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+                continue;
+            if (snprintf(file, MAX_PATH, "%s/%s", path, entry->d_name) >= MAX_PATH)
+                continue;
+            unlink(file);
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+/* Signatures loaded from there are trusted as official ones */
+static int pyci_dbcachePrivate(const char *cachedir)
 {
-    char *filename = NULL;
     struct stat info;
-    PyObject *result = NULL;
-    int fd = -1;
 
-    pyci_engineCheck(scanFile);
+    if (stat(cachedir, &info) || !S_ISDIR(info.st_mode) || (info.st_uid != geteuid()) || (info.st_mode & 077))
+        return -1;
+    return 0;
+}
+
+/* A regular file owned by the user and only writable by them, links are
+   not followed */
+static int pyci_dbcacheStat(const char *path, struct stat *info)
+{
+    if (lstat(path, info) || !S_ISREG(info->st_mode) || (info->st_uid != geteuid()) || (info->st_mode & 022))
+        return -1;
+    return 0;
+}
+
+/* Extracts the tar following the CVD header, it's flat and only holds
+   regular files. CLD files are not compressed, gzread() reads them as
+   they are. The size, mtime in nanoseconds and inode of every file go
+   to the manifest, followed by its name */
+static int pyci_cvdUnpack(const char *file, const char *dir)
+{
+    char path[MAX_PATH + 1], name[101], octal[13];
+    unsigned char *buf;
+    size_t size, padded, chunk, n;
+    int fd, out = -1, ret = CL_EUNPACK;
+    FILE *manifest = NULL;
+    struct stat info;
+    gzFile gz;
+
+    if ((snprintf(path, MAX_PATH, "%s/%s", dir, PYC_DBCACHE_MANIFEST) >= MAX_PATH) ||
+        ((out = open(path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644)) < 0))
+        return CL_ECREAT;
 
-    if (!PyArg_ParseTuple(args, "s", &filename))
+    if (!(manifest = fdopen(out, "w")))
     {
-        PyErr_SetString(PyExc_TypeError, "scanFile: A string is needed for the filename");
-        return NULL;
+        close(out);
+        return CL_ECREAT;
     }
+    out = -1;
 
-#ifdef _WIN32
-    if (!(filename = cw_normalizepath(filename)))
+    if ((fd = open(file, O_RDONLY | O_BINARY)) < 0)
     {
-        PyErr_SetString(PycError, "scanFile: Path Normalization failed");
-        return NULL;
+        fclose(manifest);
+        return CL_EOPEN;
     }
-#endif
 
-    if (lstat(filename, &info) < 0)
+    if ((lseek(fd, PYC_TAR_BLOCK, SEEK_SET) != PYC_TAR_BLOCK) || !(gz = gzdopen(fd, "rb")))
     {
-        PyErr_PycFromErrno(scanFile);
-        goto sf_cleanup;
+        close(fd);
+        fclose(manifest);
+        return CL_ESEEK;
     }
 
-    if (!(S_ISREG(info.st_mode) || S_ISLNK(info.st_mode)))
+    if (!(buf = malloc(128 * PYC_TAR_BLOCK)))
     {
-        PyErr_SetString(PycError, "scanFile: Not a regular file");
-        goto sf_cleanup;
+        gzclose(gz);
+        fclose(manifest);
+        return CL_EMEM;
     }
 
-    if ((fd = open(filename, O_RDONLY | O_BINARY)) < 0)
+    for (;;)
     {
-        PyErr_PycFromErrno(scanFile);
-        goto sf_cleanup;
+        if (gzread(gz, buf, PYC_TAR_BLOCK) != PYC_TAR_BLOCK)
+            break;
+
+        /* end of archive */
+        if (!buf[0])
+        {
+            ret = CL_SUCCESS;
+            break;
+        }
+
+        memcpy(name, buf, 100);
+        name[100] = 0;
+        memcpy(octal, buf + 124, 12);
+        octal[12] = 0;
+        size = strtoul(octal, NULL, 8);
+
+        if ((buf[156] == '0') || !buf[156])
+        {
+            /* the manifest has a name per line */
+            if (strpbrk(name, "/ \n") || (name[0] == '.'))
+                break;
+
+            if (snprintf(path, MAX_PATH, "%s/%s", dir, name) >= MAX_PATH)
+            {
+                ret = CL_ECREAT;
+                break;
+            }
+            if ((out = open(path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644)) < 0)
+            {
+                ret = CL_ECREAT;
+                break;
+            }
+        }
+
+        padded = (size + PYC_TAR_BLOCK - 1) & ~((size_t) PYC_TAR_BLOCK - 1);
+        while (padded)
+        {
+            chunk = (padded < 128 * PYC_TAR_BLOCK) ? padded : 128 * PYC_TAR_BLOCK;
+            if (gzread(gz, buf, chunk) != (int) chunk)
+                goto cleanup;
+
+            n = (chunk < size) ? chunk : size;
+            if ((out >= 0) && n)
+            {
+                if (write(out, buf, n) != (ssize_t) n)
+                {
+                    ret = CL_EWRITE;
+                    goto cleanup;
+                }
+            }
+            size -= n;
+            padded -= chunk;
+        }
+
+        if (out >= 0)
+        {
+            if (fstat(out, &info))
+            {
+                ret = CL_ESTAT;
+                goto cleanup;
+            }
+            close(out);
+            out = -1;
+            fprintf(manifest, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n", (uint64_t) info.st_size,
+                    (uint64_t) info.st_mtime * 1000000000 + PYC_ST_NSEC(&info, m), (uint64_t) info.st_ino, name);
+        }
     }
 
-    result = pyc_scanDesc(self, Py_BuildValue("(i)", fd));
+ cleanup:
+    if (out >= 0) close(out);
+    if (fclose(manifest) && !ret)
+        ret = CL_EWRITE;
+    free(buf);
+    gzclose(gz);
+    return ret;
+}
 
- sf_cleanup:
-    if (fd != -1) close(fd);
-#ifdef _WIN32
-    if (filename) free(filename);
-#endif
-    return result;
+/* Checks an unpacked directory against its manifest, it must hold the
+   files listed there and nothing else, as they were written. Only the
+   user can write to the cache, a file replaced or rewritten since then
+   has another inode, size or mtime */
+static int pyci_dbcacheVerify(const char *dir)
+{
+    char path[MAX_PATH + 1], *data = NULL, *line, *next;
+    unsigned int count = 0, seen = 0;
+    uint64_t size, mtime, ino;
+    struct dirent *entry;
+    struct stat info;
+    DIR *d = NULL;
+    FILE *f = NULL;
+    int ret = CL_EVERIFY, name;
+
+    if (lstat(dir, &info) || !S_ISDIR(info.st_mode) || (info.st_uid != geteuid()) || (info.st_mode & 077))
+        return CL_EVERIFY;
+
+    /* the manifest itself is held to the same rules as the files */
+    if ((snprintf(path, MAX_PATH, "%s/%s", dir, PYC_DBCACHE_MANIFEST) >= MAX_PATH) ||
+        pyci_dbcacheStat(path, &info) || (info.st_size > 1024 * 1024) || !(f = fopen(path, "rb")) ||
+        !(data = malloc(info.st_size + 1)) || (fread(data, 1, info.st_size, f) != (size_t) info.st_size))
+        goto cleanup;
+    data[info.st_size] = 0;
+
+    for (line = data; *line; line = next + 1)
+    {
+        if (!(next = strchr(line, '\n')))
+            goto cleanup;
+        count++;
+    }
+
+    if (!(d = opendir(dir)))
+        goto cleanup;
+
+    while ((entry = readdir(d)))
+    {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") ||
+            !strcmp(entry->d_name, PYC_DBCACHE_MANIFEST))
+            continue;
+
+        /* a file not in the manifest was not unpacked by us */
+        for (line = data; *line; line = next + 1)
+        {
+            next = strchr(line, '\n');
+            if ((sscanf(line, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %n", &size, &mtime, &ino, &name) == 3) &&
+                (line + name < next) && ((size_t) (next - line - name) == strlen(entry->d_name)) &&
+                !strncmp(line + name, entry->d_name, next - line - name))
+                break;
+        }
+        if (!*line)
+            goto cleanup;
+
+        if ((snprintf(path, MAX_PATH, "%s/%s", dir, entry->d_name) >= MAX_PATH) || pyci_dbcacheStat(path, &info) ||
+            ((uint64_t) info.st_size != size) || ((uint64_t) info.st_ino != ino) ||
+            ((uint64_t) info.st_mtime * 1000000000 + PYC_ST_NSEC(&info, m) != mtime))
+            goto cleanup;
+        seen++;
+    }
+
+    if (seen == count)
+        ret = CL_SUCCESS;
+
+ cleanup:
+    if (d) closedir(d);
+    if (f) fclose(f);
+    free(data);
+    return ret;
 }
 
-static PyObject *pyc_setDebug(PyObject *self, PyObject *args)
+/* Drops the other versions of a database */
+static void pyci_dbcachePrune(const char *cachedir, const char *name, const char *keep)
 {
-    cl_debug();
-    Py_RETURN_NONE;
+    char path[MAX_PATH + 1];
+    struct dirent *entry;
+    size_t len = strlen(name);
+    DIR *dir;
+
+    if (!(dir = opendir(cachedir)))
+        return;
+
+    while ((entry = readdir(dir)))
+    {
+        if (strncmp(entry->d_name, name, len) || (entry->d_name[len] != '-') ||
+            (strspn(entry->d_name + len + 1, "0123456789") != strlen(entry->d_name + len + 1)) ||
+            !strcmp(entry->d_name, keep))
+            continue;
+
+        if (snprintf(path, MAX_PATH, "%s/%s", cachedir, entry->d_name) < MAX_PATH)
+            pyci_rmdir(path);
+    }
+    closedir(dir);
 }
 
-static PyObject *pyc_setEngineOption(PyObject *self, PyObject *args)
+/* Copies src to a new file dst */
+static int pyci_copyFile(const char *src, const char *dst)
 {
-    char *option;
-    PyObject *value;
-    int ret, i;
+    char buffer[32768];
+    int in, out, ret = CL_SUCCESS;
+    ssize_t n;
 
-    assert(pyci_engine);
+    if ((in = open(src, O_RDONLY | O_BINARY)) < 0)
+        return CL_EOPEN;
 
-    if (!PyArg_ParseTuple(args, "sO", &option, &value))
+    if ((out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0600)) < 0)
     {
-        PyErr_SetString(PyExc_TypeError, "setEngineOption: Invalid arguments");
-        return NULL;
+        close(in);
+        return CL_ECREAT;
     }
 
-    for (i = 0; engine_options[i].name; i++)
+    while ((n = read(in, buffer, sizeof(buffer))))
     {
-        if (strcmp(option, engine_options[i].name)) continue;
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            ret = CL_EREAD;
+            break;
+        }
+        if (write(out, buffer, n) != n)
+        {
+            ret = CL_EWRITE;
+            break;
+        }
+    }
 
-        if (engine_options[i].readonly)
+    close(in);
+    if (close(out) && !ret)
+        ret = CL_EWRITE;
+    return ret;
+}
+
+/* Sets path to the unpacked copy of cvd, it's made when missing or when
+   it doesn't match its manifest. It's unpacked in a private directory
+   and renamed, so processes sharing the cache never see it half done.
+   The archive is copied there first, what's verified is what's unpacked */
+static int pyci_dbcacheGet(const char *cachedir, const pyci_cvd_t *cvd, char *path)
+{
+    char tmp[MAX_PATH + 1], copy[MAX_PATH + 1];
+    struct stat info;
+    int ret;
+
+    /* a truncated name could be another version */
+    if (snprintf(path, MAX_PATH, "%s/%s-%u", cachedir, cvd->name, cvd->version) >= MAX_PATH)
+        return CL_ETMPDIR;
+
+    if (!lstat(path, &info))
+    {
+        if (!pyci_dbcacheVerify(path))
+            return CL_SUCCESS;
+
+        /* altered or left by an older version, made again below */
+        pyc_DEBUG(loadDB(internal), "Unpacked %s doesn't match its manifest\n", path);
+        pyci_rmdir(path);
+    }
+
+    /* engines of this process may share the cache too */
+    if ((snprintf(tmp, MAX_PATH, "%s.XXXXXX", path) >= MAX_PATH) || !mkdtemp(tmp))
+        return CL_ETMPDIR;
+
+    /* cl_cvdverify() tells a cld from its extension */
+    if (snprintf(copy, MAX_PATH, "%s/pyc-source%s", tmp, strrchr(cvd->file, '.')) >= MAX_PATH)
+        ret = CL_ETMPDIR;
+    else if (!(ret = pyci_copyFile(cvd->file, copy)) && !(ret = cl_cvdverify(copy)))
+        ret = pyci_cvdUnpack(copy, tmp);
+    unlink(copy);
+
+    if (ret)
+    {
+        pyci_rmdir(tmp);
+        return ret;
+    }
+
+    if (rename(tmp, path))
+    {
+        /* someone else was faster, theirs is checked like any other */
+        pyci_rmdir(tmp);
+        if ((ret = pyci_dbcacheVerify(path)))
+            return ret;
+    }
+
+    pyci_dbcachePrune(cachedir, cvd->name, strrchr(path, '/') + 1);
+    return CL_SUCCESS;
+}
+
+/* Loads dbpath through the cache. Local ignore lists come first, then
+   daily that may carry ignore lists for the other databases, the other
+   local files are loaded last from a directory of links to them. Returns
+   PYC_DBCACHE_PLAIN with nothing loaded when the databases don't fit */
+static int pyci_dbcacheLoad(const char *dbpath, const char *cachedir, struct cl_engine *engine,
+                            unsigned int *signo, unsigned int options, unsigned int *main,
+                            unsigned int *daily, unsigned int *bytecode)
+{
+    pyci_cvd_t cvds[PYC_DBCACHE_MAX], swap;
+    char path[MAX_PATH + 1], link[MAX_PATH + 1], staging[MAX_PATH + 1];
+    struct dirent *entry;
+    struct cl_cvd *head;
+    struct stat info;
+    const char *ext;
+    int ncvds = 0, nlocal = 0, ret = CL_SUCCESS, ign, i;
+    char *base;
+    size_t len;
+    DIR *dir;
+
+    /* it may have changed since setDBCacheDir() */
+    if (pyci_dbcachePrivate(cachedir))
+        return CL_EACCES;
+
+    /* the links must not depend on the working directory */
+    if (!(base = realpath(dbpath, NULL)))
+        return CL_EOPEN;
+
+    if (!(dir = opendir(base)))
+    {
+        free(base);
+        return CL_EOPEN;
+    }
+
+    if ((snprintf(staging, MAX_PATH, "%s/local.XXXXXX", cachedir) >= MAX_PATH) || !mkdtemp(staging))
+    {
+        closedir(dir);
+        free(base);
+        return CL_ETMPDIR;
+    }
+
+    /* the databases first, nothing is loaded until they're known to fit */
+    while (!ret && (entry = readdir(dir)))
+    {
+        ext = strrchr(entry->d_name, '.');
+        if ((entry->d_name[0] == '.') || !ext || (strcmp(ext, ".cvd") && strcmp(ext, ".cld")))
+            continue;
+
+        if (snprintf(path, MAX_PATH, "%s/%s", base, entry->d_name) >= MAX_PATH)
         {
-            PyErr_SetString(PyExc_TypeError, "setEngineOption: The option is read-only");
-            return NULL;
+            ret = CL_EOPEN;
+            break;
         }
 
-        switch (engine_options[i].type)
+        if (stat(path, &info) || !S_ISREG(info.st_mode))
+            continue;
+
+        if (!(head = cl_cvdhead(path)))
         {
-            case OPT_NUM:
+            ret = CL_ECVD;
+            break;
+        }
+
+        len = ext - entry->d_name;
+        for (i = 0; i < ncvds; i++)
+            if ((strlen(cvds[i].name) == len) && !strncmp(cvds[i].name, entry->d_name, len))
+                break;
+
+        if (i == ncvds)
+        {
+            if ((len >= sizeof(cvds[0].name)) || (ncvds == PYC_DBCACHE_MAX))
             {
-                uint32_t val = PyInt_AsLong(value);
-                gstate = PyGILState_Ensure();
-                ret = cl_engine_set_num(pyci_engine, engine_options[i].id, val);
-                PyGILState_Release(gstate);
-                if (ret != CL_SUCCESS)
-                {
-                    PyErr_PycFromClamav(setEngineOption::cl_engine_set_num, ret);
-                    return NULL;
-                }
-                Py_RETURN_NONE;
+                pyc_DEBUG(loadDB(internal), "Can't cache %s, loading %s as is\n", path, dbpath);
+                cl_cvdfree(head);
+                ret = PYC_DBCACHE_PLAIN;
+                break;
             }
-            case OPT_STR:
-            {
-                char *val = PyString_AsString(value);
-                gstate = PyGILState_Ensure();
-                ret = cl_engine_set_str(pyci_engine, engine_options[i].id, val);
-                PyGILState_Release(gstate);
-                if (ret != CL_SUCCESS)
-                {
-                    PyErr_PycFromClamav(setEngineOption::cl_engine_set_str, ret);
-                    return NULL;
-                }
-                Py_RETURN_NONE;
+            memcpy(cvds[i].name, entry->d_name, len);
+            cvds[i].name[len] = 0;
+            cvds[i].version = 0;
+            ncvds++;
+        }
+
+        /* both a cvd and a cld, the newer one wins */
+        if (!cvds[i].version || (head->version > cvds[i].version))
+        {
+            strcpy(cvds[i].file, path);
+            cvds[i].version = head->version;
+        }
+        cl_cvdfree(head);
+    }
+
+    rewinddir(dir);
+    while (!ret && (entry = readdir(dir)))
+    {
+        if ((entry->d_name[0] == '.') || !(ext = strrchr(entry->d_name, '.')))
+            continue;
+
+        /* anything else like freshclam's mirrors.dat is not a database */
+        ign = !strcmp(ext, ".ign") || !strcmp(ext, ".ign2");
+        if (!ign && !pyci_isDBFile(ext))
+            continue;
+
+        if (snprintf(path, MAX_PATH, "%s/%s", base, entry->d_name) >= MAX_PATH)
+        {
+            ret = CL_EOPEN;
+            break;
+        }
+
+        if (stat(path, &info) || !S_ISREG(info.st_mode))
+            continue;
+
+        if (ign)
+            ret = cl_load(path, engine, signo, options);
+        else
+        {
+            if ((snprintf(link, MAX_PATH, "%s/%s", staging, entry->d_name) >= MAX_PATH) || symlink(path, link))
+                ret = CL_ETMPDIR;
+            nlocal++;
+        }
+    }
+    closedir(dir);
+    free(base);
+
+    for (i = 1; !ret && (i < ncvds); i++)
+    {
+        if (strcmp(cvds[i].name, "daily")) continue;
+        swap = cvds[0];
+        cvds[0] = cvds[i];
+        cvds[i] = swap;
+    }
+
+    for (i = 0; !ret && (i < ncvds); i++)
+    {
+        if ((ret = pyci_dbcacheGet(cachedir, &cvds[i], path)))
+            break;
+
+        pyc_DEBUG(loadDB(internal), "Loading %s from %s\n", cvds[i].file, path);
+        if ((ret = cl_load(path, engine, signo, options | CL_DB_OFFICIAL | CL_DB_SIGNED)))
+            break;
+
+        if (!strcmp(cvds[i].name, "main"))
+            *main = cvds[i].version;
+        else if (!strcmp(cvds[i].name, "daily"))
+            *daily = cvds[i].version;
+        else if (!strcmp(cvds[i].name, "bytecode"))
+            *bytecode = cvds[i].version;
+    }
+
+    if (!ret && nlocal)
+        ret = cl_load(staging, engine, signo, options);
+    else if (!ret && !ncvds)
+        ret = CL_EOPEN;
+
+    pyci_rmdir(staging);
+    return ret;
+}
+#endif
+
+/* Build a new engine with the settings of the current one and publish it,
+   the current engine keeps serving scans until the new one is ready and
+   it's kept if the load fails. Must be called with reloadLock held
+   and without the GIL */
+static int pyci_loadDB(pyci_engine_t *e)
+{
+    int ret = 0, plain = 1;
+    unsigned int signo = 0, main, daily, bytecode;
+    struct cl_settings *settings = NULL;
+    struct cl_engine *engine = NULL, *old;
+    pyci_report_t *report = NULL;
+    uint32_t dboptions, options;
+    uint64_t start = pyci_now(), elapsed, mark;
+    uint64_t rss = pyci_rss();
+
+    pthread_mutex_lock(&e->engineLock);
+    if (e->engine && !(settings = cl_engine_settings_copy(e->engine)))
+        fprintf(stderr, "Can't make a copy of the current engine settings\n");
+    options = dboptions = e->dboptions;
+    pthread_mutex_unlock(&e->engineLock);
+
+    pyc_DEBUG(loadDB(internal), "Loading db from %s\n", e->dbpath);
+
+    if (!(engine = cl_engine_new()))
+    {
+        ret = CL_EMEM;
+        goto cleanup;
+    }
+
+    if (settings)
+    {
+        if ((ret = cl_engine_settings_apply(engine, settings)) != CL_SUCCESS)
+        {
+            fprintf(stderr, "Can't apply previous engine settings: %s\n", cl_strerror(ret));
+            fprintf(stderr, "Using default engine settings\n");
+        }
+    }
+
+    /* they do nothing until a policy is set */
+    cl_engine_set_clcb_pre_cache(engine, pyci_preCache);
+    cl_engine_set_clcb_pre_scan(engine, pyci_preScan);
+
+    if (dboptions & (CL_DB_PUA_INCLUDE | CL_DB_PUA_EXCLUDE))
+        options |= CL_DB_PUA_MODE;
+
+    main = daily = bytecode = 0;
+    mark = pyci_now();
+#ifndef _WIN32
+    if (e->cachedir[0] &&
+        ((ret = pyci_dbcacheLoad(e->dbpath, e->cachedir, engine, &signo, options, &main, &daily, &bytecode)) !=
+         PYC_DBCACHE_PLAIN))
+        plain = 0;
+#endif
+    if (plain)
+        ret = cl_load(e->dbpath, engine, &signo, options);
+    if (ret)
+    {
+        pyc_DEBUG(loadDB(internal), "cl_load: %s\n", cl_strerror(ret));
+        goto cleanup;
+    }
+    elapsed = pyci_now() - mark;
+
+    mark = pyci_now();
+    if ((ret = cl_engine_compile(engine)))
+    {
+        pyc_DEBUG(loadDB(internal), "cl_engine_compile: %s\n", cl_strerror(ret));
+        goto cleanup;
+    }
+    mark = pyci_now() - mark;
+
+    if ((ret = pyci_dbstatNew(e)))
+        goto cleanup;
+
+    /* counting is not part of the timings */
+    if ((report = pyci_reportNew(e->dbpath)))
+    {
+        report->dboptions = dboptions;
+        report->sigs = signo;
+        report->loadtime = elapsed;
+        report->compiletime = mark;
+        report->rssbefore = rss;
+        report->rssafter = pyci_rss();
+    }
+
+    /* already known when loaded through the cache */
+    if (plain)
+    {
+        main = pyci_getVersion(e, "main");
+        daily = pyci_getVersion(e, "daily");
+        bytecode = pyci_getVersion(e, "bytecode");
+    }
+
+    pthread_mutex_lock(&e->engineLock);
+    old = e->engine;
+    e->engine = engine;
+    e->sigs = signo;
+    e->vmain = main;
+    e->vdaily = daily;
+    e->vbytecode = bytecode;
+    e->lastcheck = time(NULL);
+    e->generation++;
+    if (report)
+    {
+        free(e->report);
+        e->report = report;
+    }
+    pthread_mutex_unlock(&e->engineLock);
+
+    /* in-flight scans still hold their own reference, what they
+       report to the cache is tagged with the old generation */
+    engine = old;
+    pyci_cacheFlush(&e->cache);
+
+ cleanup:
+    if (engine)
+        pyci_enginePut(engine);
+    if (settings)
+        cl_engine_settings_free(settings);
+
+    elapsed = pyci_now() - start;
+    pthread_mutex_lock(&e->engineLock);
+    if (ret)
+        e->loaderrors++;
+    else
+    {
+        e->loads++;
+        e->loadtime += elapsed;
+        e->loadlast = elapsed;
+        if (elapsed > e->loadmax) e->loadmax = elapsed;
+    }
+    pthread_mutex_unlock(&e->engineLock);
+
+    return ret;
+}
+
+static void pyci_dbstatFree(pyci_engine_t *e)
+{
+    assert(e->dbstat);
+    cl_statfree(e->dbstat);
+    free(e->dbstat);
+    e->dbstat = NULL;
+}
+
+static int pyci_dbstatNew(pyci_engine_t *e)
+{
+    int ret;
+    if (e->dbstat) pyci_dbstatFree(e);
+
+    if (!(e->dbstat = malloc(sizeof(struct cl_stat))))
+    {
+        pyc_DEBUG(pyci_dbstatNew, "Out of memory\n");
+        return CL_EMEM;
+    }
+
+    pyc_DEBUG(pyci_dbstatNew, "Calling cl_statinidir() on %s\n", e->dbpath);
+    if ((ret = cl_statinidir(e->dbpath, e->dbstat)))
+    {
+        pyc_DEBUG(pyci_dbstatNew, "cl_statinidir: %s\n", cl_strerror(ret));
+        free(e->dbstat);
+        e->dbstat = NULL;
+        return ret;
+    }
+    return CL_SUCCESS;
+}
+
+/* Returns 1 when the database directory changed, must be called with
+   reloadLock held */
+static int pyci_statDB(pyci_engine_t *e)
+{
+    int ret;
+
+    pyc_DEBUG(checkAndLoadDB, "SelfCheck\n");
+
+    if (!e->dbstat && (ret = pyci_dbstatNew(e)))
+        return ret;
+
+    pthread_mutex_lock(&e->engineLock);
+    e->lastcheck = time(NULL);
+    e->selfchecks++;
+    pthread_mutex_unlock(&e->engineLock);
+
+    switch ((ret = cl_statchkdir(e->dbstat)))
+    {
+        case 1: /* needs to be reloaded */
+            pyc_DEBUG(pyci_checkAndLoadDB, "virus db needs to be reloaded\n");
+            break;
+        case CL_SUCCESS:
+            pyc_DEBUG(pyci_checkAndLoadDB, "virus db is up to date\n");
+            break;
+        default:
+            pyc_DEBUG(pyci_checkAndLoadDB, "cl_statchkdir: %s\n", cl_strerror(ret));
+    }
+
+    return ret;
+}
+
+/* The database is also reloaded when other databases were selected */
+static int pyci_reloadDB(pyci_engine_t *e)
+{
+    int ret, changed;
+
+    pthread_mutex_lock(&e->reloadLock);
+    pthread_mutex_lock(&e->engineLock);
+    changed = e->report && (e->report->dboptions != e->dboptions);
+    pthread_mutex_unlock(&e->engineLock);
+
+    if (((ret = pyci_statDB(e)) == 1) || ((ret == CL_SUCCESS) && changed))
+        ret = pyci_loadDB(e);
+    pthread_mutex_unlock(&e->reloadLock);
+
+    return ret;
+}
+
+static void *pyci_reloadThread(void *arg)
+{
+    pyci_engine_t *e = (pyci_engine_t *) arg;
+    int ret;
+
+    if ((ret = pyci_reloadDB(e)))
+        fprintf(stderr, "Can't reload virus database: %s\n", cl_strerror(ret));
+
+    pthread_mutex_lock(&e->engineLock);
+    e->reloading = 0;
+    pthread_mutex_unlock(&e->engineLock);
+
+    pyci_engineRelease(e);
+    return NULL;
+}
+
+/* Reload in background, scans keep using the current engine meanwhile */
+static int pyci_reloadAsync(pyci_engine_t *e)
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+    int ret = CL_SUCCESS;
+
+    pthread_mutex_lock(&e->engineLock);
+    if (e->reloading)
+    {
+        pthread_mutex_unlock(&e->engineLock);
+        return CL_SUCCESS;
+    }
+    e->reloading = 1;
+    e->refs++;
+    pthread_mutex_unlock(&e->engineLock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, pyci_reloadThread, e))
+    {
+        pthread_mutex_lock(&e->engineLock);
+        e->reloading = 0;
+        pthread_mutex_unlock(&e->engineLock);
+        pyci_engineRelease(e);
+        ret = CL_EMEM;
+    }
+    pthread_attr_destroy(&attr);
+
+    return ret;
+}
+
+#ifndef _WIN32
+#define PYC_WATCH_SETTLE    1000    /* ms without events before reloading */
+#define PYC_WATCH_ROUNDS    10      /* but don't wait more than this many times */
+
+#ifdef __linux__
+#define PYC_WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | \
+                          IN_DELETE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#endif
+
+/* watching is only changed under engineLock, scans peek at it without */
+#define pyci_watchRunning(e)        __atomic_load_n(&(e)->watching, __ATOMIC_ACQUIRE)
+#define pyci_watchSet(e, value)     __atomic_store_n(&(e)->watching, (value), __ATOMIC_RELEASE)
+
+/* Must be called with engineLock held */
+static void pyci_watchWake(pyci_engine_t *e)
+{
+    if (e->watching && (write(e->wakefd[1], "", 1) < 0))
+        pyc_DEBUG(pyci_watchWake, "write: %s\n", strerror(errno));
+}
+
+/* Returns 1 when the directory was moved or deleted, the watch
+   stays on it until renewed */
+static int pyci_watchDrain(int fd, int inotify)
+{
+    union
+    {
+#ifdef __linux__
+        struct inotify_event event;
+#endif
+        char buffer[4096];
+    } u;
+    ssize_t len;
+    int gone = 0;
+
+    while ((len = read(fd, u.buffer, sizeof(u.buffer))) > 0)
+    {
+#ifdef __linux__
+        char *p;
+        struct inotify_event *event;
+
+        if (!inotify) continue;
+
+        for (p = u.buffer; p < (u.buffer + len); p += sizeof(struct inotify_event) + event->len)
+        {
+            event = (struct inotify_event *) p;
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+                gone = 1;
+        }
+#endif
+    }
+
+    return gone;
+}
+
+/* Checks the database in background instead of on the scan path, the new
+   engine is published by pyci_loadDB as usual. Changes are seen at once
+   through inotify where available, the directory is checked anyway every
+   checktimer seconds. A burst of writes, e.g. freshclam replacing the
+   databases, is waited out before reloading. The thread holds a reference
+   on the engine state, it exits when asked to or when the timer is no
+   longer positive */
+static void *pyci_watchThread(void *arg)
+{
+    pyci_engine_t *e = (pyci_engine_t *) arg;
+    char dbpath[MAX_PATH + 1] = "";
+    struct pollfd fds[2];
+    int wd = -1, rewatch, timeout, ret, i;
+
+    fds[0].events = fds[1].events = POLLIN;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&e->engineLock);
+        if (e->watchstop || (e->checktimer <= 0))
+        {
+            close(e->wakefd[0]);
+            close(e->wakefd[1]);
+            if (e->notifyfd >= 0) close(e->notifyfd);
+            e->wakefd[0] = e->wakefd[1] = e->notifyfd = -1;
+            pyci_watchSet(e, 0);
+            e->watchstop = 0;
+            pthread_mutex_unlock(&e->engineLock);
+            break;
+        }
+        timeout = (e->checktimer < (INT_MAX / 1000)) ? (int) e->checktimer * 1000 : INT_MAX;
+        fds[0].fd = e->wakefd[0];
+        fds[1].fd = e->notifyfd;
+        if ((rewatch = strcmp(dbpath, e->dbpath)))
+            strcpy(dbpath, e->dbpath);
+        pthread_mutex_unlock(&e->engineLock);
+
+#ifdef __linux__
+        if ((fds[1].fd >= 0) && (rewatch || (wd < 0)))
+        {
+            if (wd >= 0) inotify_rm_watch(fds[1].fd, wd);
+            pyci_watchDrain(fds[1].fd, 1);
+            if ((wd = inotify_add_watch(fds[1].fd, dbpath, PYC_WATCH_EVENTS)) < 0)
+                pyc_DEBUG(pyci_watchThread, "inotify_add_watch %s: %s\n", dbpath, strerror(errno));
+        }
+#endif
+        if (wd < 0) fds[1].fd = -1;         /* ignored by poll() */
+        fds[0].revents = fds[1].revents = 0;
+
+        if ((ret = poll(fds, 2, timeout)) < 0)
+        {
+            if (errno != EINTR)
+            {
+                pyc_DEBUG(pyci_watchThread, "poll: %s\n", strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+
+        /* settings changed or asked to stop */
+        if (fds[0].revents)
+        {
+            pyci_watchDrain(fds[0].fd, 0);
+            continue;
+        }
+
+#ifdef __linux__
+        if (fds[1].revents)
+        {
+            for (i = 0; i < PYC_WATCH_ROUNDS; i++)
+            {
+                if (pyci_watchDrain(fds[1].fd, 1) && (wd >= 0))
+                {
+                    inotify_rm_watch(fds[1].fd, wd);
+                    wd = -1;
+                }
+                if (poll(&fds[1], 1, PYC_WATCH_SETTLE) <= 0)
+                    break;
             }
-            default:
-                PyErr_SetString(PyExc_TypeError, "setEngineOption: Internal Error");
         }
+#endif
+
+        if ((ret = pyci_reloadDB(e)))
+            fprintf(stderr, "Can't reload virus database: %s\n", cl_strerror(ret));
     }
-    PyErr_SetString(PyExc_TypeError, "setEngineOption: Invalid option");
+
+    pyci_engineRelease(e);
     return NULL;
 }
 
-static PyObject *pyc_getEngineOption(PyObject *self, PyObject *args)
+/* Returns 0 when the watcher is running, the caller checks the database
+   by itself otherwise */
+static int pyci_watchStart(pyci_engine_t *e)
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+    int ret = 0, i;
+
+    pthread_mutex_lock(&e->engineLock);
+    if (e->watching)
+    {
+        pthread_mutex_unlock(&e->engineLock);
+        return 0;
+    }
+
+    if (pipe(e->wakefd) < 0)
+    {
+        pthread_mutex_unlock(&e->engineLock);
+        return -1;
+    }
+    for (i = 0; i < 2; i++)
+    {
+        fcntl(e->wakefd[i], F_SETFL, O_NONBLOCK);
+        fcntl(e->wakefd[i], F_SETFD, FD_CLOEXEC);
+    }
+#ifdef __linux__
+    if ((e->notifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+        pyc_DEBUG(pyci_watchStart, "inotify_init1: %s, polling\n", strerror(errno));
+#endif
+
+    pyci_watchSet(e, 1);
+    e->refs++;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, pyci_watchThread, e))
+    {
+        close(e->wakefd[0]);
+        close(e->wakefd[1]);
+        if (e->notifyfd >= 0) close(e->notifyfd);
+        e->wakefd[0] = e->wakefd[1] = e->notifyfd = -1;
+        pyci_watchSet(e, 0);
+        e->refs--;
+        ret = -1;
+    }
+    pthread_attr_destroy(&attr);
+    pthread_mutex_unlock(&e->engineLock);
+
+    return ret;
+}
+
+static void pyci_watchStop(pyci_engine_t *e)
+{
+    pthread_mutex_lock(&e->engineLock);
+    if (e->watching)
+    {
+        e->watchstop = 1;
+        pyci_watchWake(e);
+    }
+    pthread_mutex_unlock(&e->engineLock);
+}
+#endif
+
+/* Called with the GIL, it's released while the database is checked or loaded */
+static int pyci_checkAndLoadDB(pyci_engine_t *e, int force, int wait)
+{
+    time_t checktimer, lastcheck;
+    int ret;
+
+    if (!pyci_isLoaded(e))
+    {
+        Py_BEGIN_ALLOW_THREADS;
+        pthread_mutex_lock(&e->reloadLock);
+        ret = pyci_isLoaded(e) ? CL_SUCCESS : pyci_loadDB(e);
+        pthread_mutex_unlock(&e->reloadLock);
+        Py_END_ALLOW_THREADS;
+        return ret;
+    }
+
+    if (force)
+    {
+        if (!wait)
+            return pyci_reloadAsync(e);
+
+        Py_BEGIN_ALLOW_THREADS;
+        ret = pyci_reloadDB(e);
+        Py_END_ALLOW_THREADS;
+        return ret;
+    }
+
+#ifndef _WIN32
+    /* checked in background, the watcher exits by itself once the timer
+       is no longer positive */
+    if (pyci_watchRunning(e))
+        return CL_SUCCESS;
+#endif
+
+    /* the watcher and setDBTimer() write them from other threads */
+    pthread_mutex_lock(&e->engineLock);
+    checktimer = e->checktimer;
+    lastcheck = e->lastcheck;
+    pthread_mutex_unlock(&e->engineLock);
+
+    if (checktimer == PYC_SELFCHECK_NEVER) return CL_SUCCESS;
+
+#ifndef _WIN32
+    /* checked in background */
+    if ((checktimer > 0) && !pyci_watchStart(e))
+        return CL_SUCCESS;
+#endif
+
+    if ((checktimer > 0) || !lastcheck)
+    {
+        time_t now = time(NULL);
+        if ((now - lastcheck) < checktimer)
+            return CL_SUCCESS;
+    }
+
+    /* a new engine is being built right now */
+    if (pthread_mutex_trylock(&e->reloadLock))
+        return CL_SUCCESS;
+
+    ret = pyci_statDB(e);
+    pthread_mutex_unlock(&e->reloadLock);
+
+    if (ret == 1)
+        return pyci_reloadAsync(e);
+
+    return ret;
+}
+
+#if PY_MAJOR_VERSION < 3
+static void pyci_cleanup(void)
+{
+    /* the default engine object is never deallocated */
+    pyc_Engine *engine = pyci_state.engine;
+
+    if (engine && engine->e)
+    {
+#ifndef _WIN32
+        pyci_watchStop(engine->e);
+#endif
+        pyci_engineRelease(engine->e);
+        engine->e = NULL;
+    }
+}
+#endif
+
+static PyObject *pyci_scanResult(int ret, const char *virname)
+{
+    switch (ret)
+    {
+        case CL_CLEAN: return Py_BuildValue("(O,s)", Py_False, "CLEAN");
+        case CL_VIRUS: return Py_BuildValue("(O,s)", Py_True,  virname);
+        case PYC_SCAN_TIMEOUT: return Py_BuildValue("(O,s)", Py_None, "TIMEOUT");
+        case PYC_SCAN_LIMIT: return Py_BuildValue("(O,s)", Py_None, "LIMIT");
+        case PYC_SCAN_CANCELLED: return Py_BuildValue("(O,s)", Py_None, "CANCELLED");
+    }
+    return NULL;
+}
+
+/* Size of the object being typed, -1 when unknown. Nested objects only
+   have one when libclamav extracted them to a temporary file, the others
+   come with the descriptor of their parent or none at all */
+static int64_t pyci_objectSize(int fd, const pyci_cbctx_t *cb)
+{
+    struct stat info;
+
+    if (cb->objects > 1)
+    {
+        if ((fd < 0) || (fd == cb->fd))
+            return -1;
+    }
+    else if (fd < 0)
+        return cb->size;
+
+    return fstat(fd, &info) ? -1 : info.st_size;
+}
+
+/* Returns the PYC_SCAN_* code of the first limit hit, 0 if none */
+static int pyci_limitsCheck(int fd, pyci_cbctx_t *cb)
+{
+    const pyci_limits_t *limits = cb->limits;
+    int64_t size;
+
+    if (limits->cancel && *limits->cancel)
+        return PYC_SCAN_CANCELLED;
+    if (limits->deadline && (pyci_now() >= limits->deadline))
+        return PYC_SCAN_TIMEOUT;
+
+    /* objects nested in place are already part of their parent's size */
+    if (limits->maxbytes && ((size = pyci_objectSize(fd, cb)) > 0) &&
+        ((cb->bytes += size) > limits->maxbytes))
+        return PYC_SCAN_LIMIT;
+    return 0;
+}
+
+/* libclamav callbacks, for every object and nested object (archive members
+   and so on) once typed. pre_cache comes before libclamav's own cache and
+   applies the limits and the native table, pre_scan is after it so cached
+   objects don't pay for the hook. CL_BREAK skips the object and whatever
+   is inside it, it counts as clean */
+static int pyci_preCache(int fd, const char *type, void *context)
+{
+    pyci_cbctx_t *cb = (pyci_cbctx_t *) context;
+    pyci_policy_t *policy;
+    int64_t maxsize, size;
+    size_t i;
+
+    if (!cb)
+        return CL_CLEAN;
+    cb->objects++;
+
+    /* stopped scans skip whatever is left */
+    if (cb->limits && (cb->stopped || (cb->stopped = pyci_limitsCheck(fd, cb))))
+        return CL_BREAK;
+
+    if (!(policy = cb->policy))
+        return CL_CLEAN;
+
+    maxsize = policy->fallback;
+    for (i = 0; i < policy->count; i++)
+    {
+        if (!strcmp(policy->rules[i].type, type))
+        {
+            maxsize = policy->rules[i].maxsize;
+            break;
+        }
+    }
+
+    if ((maxsize == PYC_POLICY_SCAN) || ((size = pyci_objectSize(fd, cb)) < 0) || (size <= maxsize))
+        return CL_CLEAN;
+
+    cb->skipped++;
+    cb->skippedbytes += size;
+    return CL_BREAK;
+}
+
+static int pyci_preScan(int fd, const char *type, void *context)
+{
+    pyci_cbctx_t *cb = (pyci_cbctx_t *) context;
+    PyGILState_STATE gil;
+    PyObject *result;
+    int64_t size;
+    int scan = 1;
+
+    if (!cb || !cb->policy || !cb->policy->hook)
+        return CL_CLEAN;
+
+    size = pyci_objectSize(fd, cb);
+
+    /* a failing hook doesn't skip anything */
+    gil = PyGILState_Ensure();
+    if ((result = PyObject_CallFunction(cb->policy->hook, "sL", type, (PY_LONG_LONG) size)))
+    {
+        if ((scan = PyObject_IsTrue(result)) < 0)
+            scan = 1;
+        Py_DECREF(result);
+    }
+    if (PyErr_Occurred())
+        PyErr_WriteUnraisable(cb->policy->hook);
+    PyGILState_Release(gil);
+
+    if (scan) return CL_CLEAN;
+
+    cb->skipped++;
+    if (size > 0) cb->skippedbytes += size;
+    return CL_BREAK;
+}
+
+/* cl_scandesc through the result cache, a regular file is keyed on its
+   identity. Unlinked files are not cached, their inode can be reused by
+   a file of the same size right away. On a hit the virus name is a copy
+   returned in cached too, the caller frees it */
+static int pyci_scanCached(pyci_scanctx_t *ctx, int fd, const char **virname, char **cached)
+{
+    unsigned char key[PYC_CACHE_KEYLEN];
+    unsigned long scanned = 0;
+    uint64_t start = pyci_now();
+    pyci_cbctx_t cb;
+    int ret, state = PYC_CACHE_DISABLED;
+#ifndef _WIN32
+    unsigned char check[PYC_CACHE_KEYLEN];
+    struct stat info;
+
+    /* no inode numbers on windows, only buffers are cached there */
+    if (ctx->cache && !fstat(fd, &info) && S_ISREG(info.st_mode) && info.st_nlink)
+    {
+        pyci_cacheKeyStat(key, ctx->options, &info);
+        state = pyci_cacheBegin(ctx->cache, key, ctx->generation, ctx->limits, &ret, cached);
+    }
+#endif
+
+    memset(&cb, 0, sizeof(cb));
+    cb.policy = ctx->policy;
+    cb.limits = ctx->limits;
+    cb.fd = fd;
+
+    if (state == PYC_CACHE_HIT)
+        *virname = *cached;
+    else if (state == PYC_CACHE_STOPPED)
+        cb.stopped = ret;
+    else if (((ret = cl_scandesc_callback(fd, virname, &scanned, ctx->engine, ctx->options, &cb)) == CL_CLEAN) &&
+             cb.stopped)
+        ret = cb.stopped;
+
+#ifndef _WIN32
+    /* a file changed while scanned is not cached, like errors */
+    if (state == PYC_CACHE_OWNER)
+    {
+        memset(check, 0, sizeof(check));
+        if (!fstat(fd, &info))
+            pyci_cacheKeyStat(check, ctx->options, &info);
+        pyci_cacheEnd(ctx->cache, key, memcmp(key, check, PYC_CACHE_KEYLEN) ? PYC_CACHE_PENDING : ret, *virname);
+    }
+#endif
+
+    pyci_statsScan(ctx->stats, ret, scanned, start, state == PYC_CACHE_HIT, &cb);
+    return ret;
+}
+
+/* Same for a memory buffer, it's mapped in place and never copied. Only
+   immutable ones are cached, on their content */
+static int pyci_scanMemory(pyci_scanctx_t *ctx, const void *buf, size_t len, int immutable, const char **virname,
+                           char **cached)
+{
+    unsigned char key[PYC_CACHE_KEYLEN];
+    unsigned long scanned = 0;
+    uint64_t start = pyci_now();
+    cl_fmap_t *map;
+    pyci_cbctx_t cb;
+    int ret, state = PYC_CACHE_DISABLED;
+
+    *cached = NULL;
+    memset(&cb, 0, sizeof(cb));
+    cb.policy = ctx->policy;
+    cb.limits = ctx->limits;
+    cb.fd = -1;
+    cb.size = len;
+
+    /* Nothing to map, an empty buffer is clean */
+    if (!len)
+    {
+        pyci_statsScan(ctx->stats, CL_CLEAN, 0, start, 0, NULL);
+        return CL_CLEAN;
+    }
+
+    if (ctx->cache && immutable)
+    {
+        pyci_cacheKeyData(key, ctx->options, buf, len);
+        state = pyci_cacheBegin(ctx->cache, key, ctx->generation, ctx->limits, &ret, cached);
+    }
+
+    if (state == PYC_CACHE_HIT)
+        *virname = *cached;
+    else if (state == PYC_CACHE_STOPPED)
+        cb.stopped = ret;
+    else if ((map = cl_fmap_open_memory(buf, len)))
+    {
+        if (((ret = cl_scanmap_callback(map, virname, &scanned, ctx->engine, ctx->options, &cb)) == CL_CLEAN) &&
+            cb.stopped)
+            ret = cb.stopped;
+        cl_fmap_close(map);
+    }
+    else
+        ret = CL_EMAP;
+
+    if (state == PYC_CACHE_OWNER)
+        pyci_cacheEnd(ctx->cache, key, ret, *virname);
+
+    pyci_statsScan(ctx->stats, ret, scanned, start, state == PYC_CACHE_HIT, &cb);
+    return ret;
+}
+
+#ifndef _WIN32
+/* A window of a regular file, libclamav sees it as a whole file starting
+   at 0 and reads it through the descriptor, nothing is copied out. The
+   base offset is added here, fmap offsets must be page aligned */
+typedef struct _pyci_range_t
+{
+    int fd;
+    uint64_t offset;
+    size_t length;
+} pyci_range_t;
+
+static off_t pyci_rangeRead(void *handle, void *buf, size_t count, off_t offset)
+{
+    pyci_range_t *range = (pyci_range_t *) handle;
+    size_t done = 0;
+    ssize_t n;
+
+    if ((offset < 0) || ((uint64_t) offset >= range->length))
+        return 0;
+    if (count > (range->length - offset))
+        count = range->length - offset;
+
+    while (done < count)
+    {
+        if ((n = pread(range->fd, (char *) buf + done, count - done, range->offset + offset + done)) < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (!n) break;
+        done += n;
+    }
+
+    return done;
+}
+
+/* Same for length bytes of fd at offset, the file offset is not moved */
+static int pyci_scanRange(pyci_scanctx_t *ctx, int fd, uint64_t offset, size_t length, const char **virname,
+                          char **cached)
+{
+    unsigned char key[PYC_CACHE_KEYLEN];
+    unsigned long scanned = 0;
+    uint64_t start = pyci_now();
+    pyci_range_t range;
+    struct stat info;
+    cl_fmap_t *map;
+    pyci_cbctx_t cb;
+    int ret, state = PYC_CACHE_DISABLED;
+
+    *cached = NULL;
+    memset(&cb, 0, sizeof(cb));
+    cb.policy = ctx->policy;
+    cb.limits = ctx->limits;
+    cb.fd = -1;
+    cb.size = length;
+
+    /* Nothing to map, an empty range is clean */
+    if (!length)
+    {
+        pyci_statsScan(ctx->stats, CL_CLEAN, 0, start, 0, NULL);
+        return CL_CLEAN;
+    }
+
+    if (ctx->cache && !fstat(fd, &info))
+    {
+        pyci_cacheKeyRange(key, ctx->options, &info, offset, length);
+        state = pyci_cacheBegin(ctx->cache, key, ctx->generation, ctx->limits, &ret, cached);
+    }
+
+    range.fd = fd;
+    range.offset = offset;
+    range.length = length;
+
+    if (state == PYC_CACHE_HIT)
+        *virname = *cached;
+    else if (state == PYC_CACHE_STOPPED)
+        cb.stopped = ret;
+    else if ((map = cl_fmap_open_handle(&range, 0, length, pyci_rangeRead, 1)))
+    {
+        if (((ret = cl_scanmap_callback(map, virname, &scanned, ctx->engine, ctx->options, &cb)) == CL_CLEAN) &&
+            cb.stopped)
+            ret = cb.stopped;
+        cl_fmap_close(map);
+    }
+    else
+        ret = CL_EMAP;
+
+    if (state == PYC_CACHE_OWNER)
+        pyci_cacheEnd(ctx->cache, key, ret, *virname);
+
+    pyci_statsScan(ctx->stats, ret, scanned, start, state == PYC_CACHE_HIT, &cb);
+    return ret;
+}
+#endif
+
+/* Native worker pool, threads are spawned on demand and then kept around
+   waiting for jobs, they never touch python objects */
+#define PYC_POOL_MAXTHREADS 256
+
+typedef struct _pyci_job_t
+{
+    void (*run)(void *arg);
+    void *arg;
+    struct _pyci_job_t *next;
+} pyci_job_t;
+
+static pthread_mutex_t pyci_poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pyci_poolCond = PTHREAD_COND_INITIALIZER;
+static pyci_job_t *pyci_poolHead = NULL, *pyci_poolTail = NULL;
+static unsigned int pyci_poolThreads = 0;
+
+static void *pyci_poolWorker(void *arg)
+{
+    pyci_job_t *job;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pyci_poolLock);
+        while (!pyci_poolHead)
+            pthread_cond_wait(&pyci_poolCond, &pyci_poolLock);
+        job = pyci_poolHead;
+        if (!(pyci_poolHead = job->next))
+            pyci_poolTail = NULL;
+        pthread_mutex_unlock(&pyci_poolLock);
+
+        job->run(job->arg);
+        free(job);
+    }
+    return NULL;
+}
+
+/* Make sure at least count workers are available */
+static int pyci_poolReserve(unsigned int count)
+{
+    pthread_t tid;
+    pthread_attr_t attr;
+    int ret = 0;
+
+    if (count > PYC_POOL_MAXTHREADS) count = PYC_POOL_MAXTHREADS;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_mutex_lock(&pyci_poolLock);
+    while (pyci_poolThreads < count)
+    {
+        if ((ret = pthread_create(&tid, &attr, pyci_poolWorker, NULL)))
+            break;
+        pyci_poolThreads++;
+    }
+    pthread_mutex_unlock(&pyci_poolLock);
+
+    pthread_attr_destroy(&attr);
+
+    /* a smaller pool is still usable */
+    return pyci_poolThreads ? 0 : ret;
+}
+
+static int pyci_poolSubmit(void (*run)(void *arg), void *arg)
+{
+    pyci_job_t *job;
+
+    if (!(job = malloc(sizeof(pyci_job_t))))
+        return CL_EMEM;
+
+    job->run = run;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pyci_poolLock);
+    if (pyci_poolTail)
+        pyci_poolTail->next = job;
+    else
+        pyci_poolHead = job;
+    pyci_poolTail = job;
+    pthread_cond_signal(&pyci_poolCond);
+    pthread_mutex_unlock(&pyci_poolLock);
+
+    return CL_SUCCESS;
+}
+
+static unsigned int pyci_ncpus(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? n : 1;
+#endif
+}
+
+/* Batch scanning, a batch is served by a number of runners on the pool,
+   each one picks the next pending item until the batch is exhausted */
+typedef struct _pyci_item_t
+{
+    const char *path;
+    int fd;
+    int range;                              /* only offset and length of fd are scanned */
+    uint64_t offset;
+    size_t length;
+    int ret;
+    int err;
+    const char *errmsg;
+    const char *virname;
+    char *cached;                           /* virname from the cache */
+} pyci_item_t;
+
+typedef struct _pyci_batch_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    pyci_item_t *items;
+    size_t count;
+    size_t next;
+    unsigned int running;
+    pyci_scanctx_t ctx;
+} pyci_batch_t;
+
+static void pyci_scanItem(pyci_item_t *item, pyci_scanctx_t *ctx)
+{
+    struct stat info;
+    char *filename;
+    int fd = item->fd;
+
+#ifndef _WIN32
+    if (item->range)
+    {
+        if (!item->errmsg)
+            item->ret = pyci_scanRange(ctx, fd, item->offset, item->length, &item->virname, &item->cached);
+        return;
+    }
+#endif
+
+    if (item->path)
+    {
+#ifdef _WIN32
+        if (!(filename = cw_normalizepath(item->path)))
+        {
+            item->errmsg = "Path Normalization failed";
+            return;
+        }
+#else
+        filename = (char *) item->path;
+#endif
+        if (lstat(filename, &info) < 0)
+            item->err = errno;
+        else if (!(S_ISREG(info.st_mode) || S_ISLNK(info.st_mode)))
+            item->errmsg = "Not a regular file";
+        else if ((fd = open(filename, O_RDONLY | O_BINARY)) < 0)
+            item->err = errno;
+#ifdef _WIN32
+        free(filename);
+#endif
+        if (fd < 0) return;
+    }
+
+    item->ret = pyci_scanCached(ctx, fd, &item->virname, &item->cached);
+
+    if (item->path) close(fd);
+}
+
+static void pyci_batchRunner(void *arg)
+{
+    pyci_batch_t *batch = (pyci_batch_t *) arg;
+    size_t i;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+
+        if (i >= batch->count) break;
+        pyci_scanItem(&batch->items[i], &batch->ctx);
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    if (!--batch->running)
+        pthread_cond_signal(&batch->done);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/* Runs the whole batch on the pool, the caller must have released the GIL */
+static void pyci_batchRun(pyci_batch_t *batch, unsigned int threads)
+{
+    unsigned int i, started;
+
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->done, NULL);
+    batch->next = 0;
+    batch->running = 0;
+
+    if (threads > batch->count) threads = batch->count;
+    if (threads && pyci_poolReserve(threads)) threads = 0;
+
+    pthread_mutex_lock(&batch->lock);
+    for (i = 0; i < threads; i++)
+    {
+        if (pyci_poolSubmit(pyci_batchRunner, batch)) break;
+        batch->running++;
+    }
+    /* runners may be already done when the lock is released */
+    started = batch->running;
+    pthread_mutex_unlock(&batch->lock);
+
+    /* No workers at all, scan it here */
+    if (!started)
+    {
+        batch->running = 1;
+        pyci_batchRunner(batch);
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    while (batch->running)
+        pthread_cond_wait(&batch->done, &batch->lock);
+    pthread_mutex_unlock(&batch->lock);
+
+    pthread_cond_destroy(&batch->done);
+    pthread_mutex_destroy(&batch->lock);
+}
+
+static PyObject *pyci_itemResult(const char *func, pyci_item_t *item)
+{
+    PyObject *result;
+
+    if (item->err)
+        return Py_BuildValue("(O,N)", Py_None, PyString_FromFormat("%s: %s", func, strerror(item->err)));
+
+    if (item->errmsg)
+        return Py_BuildValue("(O,N)", Py_None, PyString_FromFormat("%s: %s", func, item->errmsg));
+
+    if ((result = pyci_scanResult(item->ret, item->virname)))
+        return result;
+
+    return Py_BuildValue("(O,N)", Py_None, PyString_FromFormat("%s: %s", func, cl_strerror(item->ret)));
+}
+
+#ifndef _WIN32
+/* Parallel directory walk, each runner owns a deque of pending entries,
+   it works depth first on its own deque and steals the oldest entries
+   from the others when it runs dry. Directories are traversed relative
+   to their parent descriptor, so each entry is looked up only once */
+#define PYC_WALK_BATCH 64
+
+typedef struct _pyci_wdir_t
+{
+    DIR *dp;
+    unsigned int fdrefs;    /* entries still needing the descriptor */
+    unsigned int refs;      /* child directories linked to this one */
+    dev_t dev;
+    ino_t ino;
+    struct _pyci_wdir_t *parent;
+} pyci_wdir_t;
+
+typedef struct _pyci_witem_t
+{
+    pyci_wdir_t *dir;       /* parent directory, NULL for the root */
+    char *path;             /* full path, the entry name starts at path + name */
+    size_t name;
+    int depth;
+    int isdir;
+    int fd;                 /* pre-opened root descriptor */
+} pyci_witem_t;
+
+typedef struct _pyci_wdeque_t
+{
+    pthread_mutex_t lock;
+    pyci_witem_t **ring;
+    size_t size;
+    size_t head;
+    size_t count;
+} pyci_wdeque_t;
+
+typedef struct _pyci_wres_t
+{
+    pyci_item_t item;
+    char *path;
+    struct _pyci_wres_t *next;
+} pyci_wres_t;
+
+typedef struct _pyci_walk_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    /* new work or walk completed */
+    pthread_cond_t ready;   /* new results or a runner exited */
+    pyci_wdeque_t *deques;
+    unsigned int ndeques;
+    unsigned int nextid;
+    unsigned long gen;
+    size_t pending;
+    unsigned int running;
+    int abort;              /* set by the caller, read under the lock */
+    unsigned int lost;      /* results not reported for lack of memory */
+    pyci_wres_t *rhead, *rtail;
+    int follow;
+    int maxdepth;
+    pyci_scanctx_t ctx;
+} pyci_walk_t;
+
+static int pyci_wdequePush(pyci_wdeque_t *dq, pyci_witem_t *it)
+{
+    pyci_witem_t **ring;
+    size_t i, size;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->size)
+    {
+        size = dq->size ? dq->size * 2 : 256;
+        if (!(ring = malloc(sizeof(pyci_witem_t *) * size)))
+        {
+            pthread_mutex_unlock(&dq->lock);
+            return CL_EMEM;
+        }
+        for (i = 0; i < dq->count; i++)
+            ring[i] = dq->ring[(dq->head + i) % dq->size];
+        free(dq->ring);
+        dq->ring = ring;
+        dq->size = size;
+        dq->head = 0;
+    }
+    dq->ring[(dq->head + dq->count++) % dq->size] = it;
+    pthread_mutex_unlock(&dq->lock);
+    return CL_SUCCESS;
+}
+
+/* Owner side, newest first */
+static pyci_witem_t *pyci_wdequePop(pyci_wdeque_t *dq)
+{
+    pyci_witem_t *it = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count)
+        it = dq->ring[(dq->head + --dq->count) % dq->size];
+    pthread_mutex_unlock(&dq->lock);
+    return it;
+}
+
+/* Thief side, oldest first */
+static pyci_witem_t *pyci_wdequeSteal(pyci_wdeque_t *dq)
+{
+    pyci_witem_t *it = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count)
+    {
+        it = dq->ring[dq->head];
+        dq->head = (dq->head + 1) % dq->size;
+        dq->count--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return it;
+}
+
+static pyci_witem_t *pyci_walkSteal(pyci_walk_t *walk, unsigned int id)
+{
+    pyci_witem_t *it;
+    unsigned int i;
+
+    for (i = 1; i < walk->ndeques; i++)
+        if ((it = pyci_wdequeSteal(&walk->deques[(id + i) % walk->ndeques])))
+            return it;
+    return NULL;
+}
+
+/* Drops one descriptor reference, the directory is closed as soon as no
+   entry needs it anymore and freed once no child directory links to it */
+static void pyci_wdirPut(pyci_walk_t *walk, pyci_wdir_t *dir)
+{
+    pyci_wdir_t *parent;
+
+    if (!dir) return;
+
+    pthread_mutex_lock(&walk->lock);
+    if (!--dir->fdrefs)
+    {
+        closedir(dir->dp);
+        dir->dp = NULL;
+    }
+    while (dir && !dir->fdrefs && !dir->refs)
+    {
+        parent = dir->parent;
+        free(dir);
+        if ((dir = parent))
+            dir->refs--;
+    }
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void pyci_walkResult(pyci_walk_t *walk, pyci_witem_t *it, pyci_item_t *item)
+{
+    pyci_wres_t *res;
+
+    if (!(res = malloc(sizeof(pyci_wres_t))))
+    {
+        free(item->cached);
+        pthread_mutex_lock(&walk->lock);
+        walk->lost++;
+        pthread_mutex_unlock(&walk->lock);
+        return;
+    }
+
+    res->item = *item;
+    res->path = it->path;
+    res->next = NULL;
+    it->path = NULL;
+
+    pthread_mutex_lock(&walk->lock);
+    if (walk->rtail)
+        walk->rtail->next = res;
+    else
+        walk->rhead = res;
+    walk->rtail = res;
+    pthread_cond_signal(&walk->ready);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void pyci_walkError(pyci_walk_t *walk, pyci_witem_t *it, int err)
+{
+    pyci_item_t item;
+
+    memset(&item, 0, sizeof(item));
+    item.fd = -1;
+    item.err = err;
+    pyci_walkResult(walk, it, &item);
+}
+
+/* Path of an entry of the directory of it, name is set to where the
+   entry name starts */
+static char *pyci_walkPath(pyci_witem_t *it, const char *entry, size_t *name)
+{
+    size_t plen = strlen(it->path), nlen = strlen(entry);
+    char *path;
+
+    if (!(path = malloc(plen + nlen + 2)))
+        return NULL;
+
+    memcpy(path, it->path, plen);
+    *name = plen;
+    if (plen && (it->path[plen - 1] != '/'))
+        path[(*name)++] = '/';
+    memcpy(path + *name, entry, nlen + 1);
+    return path;
+}
+
+/* Error on an entry of a directory being read, before it has an item */
+static void pyci_walkEntryError(pyci_walk_t *walk, pyci_witem_t *it, const char *entry, int err)
+{
+    pyci_witem_t child;
+
+    memset(&child, 0, sizeof(child));
+    if (!(child.path = pyci_walkPath(it, entry, &child.name)))
+    {
+        pthread_mutex_lock(&walk->lock);
+        walk->lost++;
+        pthread_mutex_unlock(&walk->lock);
+        return;
+    }
+
+    pyci_walkError(walk, &child, err);
+    free(child.path);
+}
+
+/* Returns non zero once the walk was aborted */
+static int pyci_walkPush(pyci_walk_t *walk, unsigned int id, pyci_wdir_t *dir, pyci_witem_t **batch, size_t count)
+{
+    size_t i;
+    int abort;
+
+    if (!count)
+    {
+        pthread_mutex_lock(&walk->lock);
+        abort = walk->abort;
+        pthread_mutex_unlock(&walk->lock);
+        return abort;
+    }
+
+    pthread_mutex_lock(&walk->lock);
+    dir->fdrefs += count;
+    walk->pending += count;
+    pthread_mutex_unlock(&walk->lock);
+
+    for (i = 0; i < count; i++)
+    {
+        if (pyci_wdequePush(&walk->deques[id], batch[i]))
+        {
+            /* out of memory, the entry is reported instead */
+            pyci_walkError(walk, batch[i], ENOMEM);
+            free(batch[i]->path);
+            free(batch[i]);
+            pyci_wdirPut(walk, dir);
+            pthread_mutex_lock(&walk->lock);
+            walk->pending--;
+            pthread_mutex_unlock(&walk->lock);
+        }
+    }
+
+    pthread_mutex_lock(&walk->lock);
+    walk->gen++;
+    pthread_cond_broadcast(&walk->wake);
+    abort = walk->abort;
+    pthread_mutex_unlock(&walk->lock);
+    return abort;
+}
+
+static void pyci_walkDir(pyci_walk_t *walk, unsigned int id, pyci_witem_t *it)
+{
+    pyci_witem_t *batch[PYC_WALK_BATCH], *child;
+    pyci_wdir_t *dir, *up;
+    struct dirent *de;
+    struct stat info;
+    size_t count = 0;
+    int fd, isdir, abort, err = 0, nofollow = walk->follow ? 0 : O_NOFOLLOW;
+
+    if (it->fd >= 0)
+        fd = it->fd;
+    else
+        fd = openat(dirfd(it->dir->dp), it->path + it->name, O_RDONLY | O_DIRECTORY | nofollow);
+
+    if (fd < 0)
+    {
+        pyci_walkError(walk, it, errno);
+        return;
+    }
+
+    if (!(dir = calloc(1, sizeof(pyci_wdir_t))))
+    {
+        pyci_walkError(walk, it, ENOMEM);
+        close(fd);
+        return;
+    }
+
+    /* following symlinks may lead back to an ancestor */
+    if (walk->follow && !fstat(fd, &info))
+    {
+        for (up = it->dir; up; up = up->parent)
+            if ((up->dev == info.st_dev) && (up->ino == info.st_ino))
+                break;
+        if (up)
+        {
+            pyci_walkError(walk, it, ELOOP);
+            close(fd);
+            free(dir);
+            return;
+        }
+        dir->dev = info.st_dev;
+        dir->ino = info.st_ino;
+    }
+
+    if (!(dir->dp = fdopendir(fd)))
+    {
+        pyci_walkError(walk, it, errno);
+        close(fd);
+        free(dir);
+        return;
+    }
+
+    /* our own reference, held while reading the directory */
+    dir->fdrefs = 1;
+    pthread_mutex_lock(&walk->lock);
+    if ((dir->parent = it->dir))
+        dir->parent->refs++;
+    abort = walk->abort;
+    pthread_mutex_unlock(&walk->lock);
+
+    /* an abort is noticed between batches */
+    while (!abort && (de = readdir(dir->dp)))
+    {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+#ifdef DT_UNKNOWN
+        switch (de->d_type)
+        {
+            case DT_DIR: isdir = 1; break;
+            case DT_REG: isdir = 0; break;
+            case DT_LNK:
+                if (!walk->follow) continue;
+                /* fall through */
+            case DT_UNKNOWN:
+#endif
+                if (fstatat(dirfd(dir->dp), de->d_name, &info, nofollow ? AT_SYMLINK_NOFOLLOW : 0) < 0)
+                {
+                    pyci_walkEntryError(walk, it, de->d_name, errno);
+                    continue;
+                }
+                if (S_ISDIR(info.st_mode))
+                    isdir = 1;
+                else if (S_ISREG(info.st_mode))
+                    isdir = 0;
+                else
+                    continue;
+#ifdef DT_UNKNOWN
+                break;
+            default:
+                continue;
+        }
+#endif
+
+        if (isdir && (walk->maxdepth >= 0) && (it->depth >= walk->maxdepth))
+            continue;
+
+        if (!(child = malloc(sizeof(pyci_witem_t))))
+        {
+            err = ENOMEM;
+            break;
+        }
+        if (!(child->path = pyci_walkPath(it, de->d_name, &child->name)))
+        {
+            free(child);
+            err = ENOMEM;
+            break;
+        }
+        child->dir = dir;
+        child->depth = it->depth + 1;
+        child->isdir = isdir;
+        child->fd = -1;
+
+        batch[count++] = child;
+        if (count == PYC_WALK_BATCH)
+        {
+            abort = pyci_walkPush(walk, id, dir, batch, count);
+            count = 0;
+        }
+    }
+
+    pyci_walkPush(walk, id, dir, batch, count);
+    pyci_wdirPut(walk, dir);
+
+    /* the rest of the directory was not read, the paths above are copies */
+    if (err)
+        pyci_walkError(walk, it, err);
+}
+
+static void pyci_walkFile(pyci_walk_t *walk, pyci_witem_t *it)
+{
+    pyci_item_t item;
+
+    memset(&item, 0, sizeof(item));
+
+    if ((item.fd = openat(dirfd(it->dir->dp), it->path + it->name, O_RDONLY | O_NONBLOCK | (walk->follow ? 0 : O_NOFOLLOW))) < 0)
+    {
+        pyci_walkError(walk, it, errno);
+        return;
+    }
+
+    pyci_scanItem(&item, &walk->ctx);
+    close(item.fd);
+    item.fd = -1;
+    pyci_walkResult(walk, it, &item);
+}
+
+static void pyci_walkRunner(void *arg)
+{
+    pyci_walk_t *walk = (pyci_walk_t *) arg;
+    pyci_witem_t *it;
+    unsigned long gen;
+    unsigned int id;
+    int done, abort;
+
+    pthread_mutex_lock(&walk->lock);
+    id = walk->nextid++;
+    pthread_mutex_unlock(&walk->lock);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&walk->lock);
+        gen = walk->gen;
+        abort = walk->abort;
+        pthread_mutex_unlock(&walk->lock);
+
+        if ((it = pyci_wdequePop(&walk->deques[id])) || (it = pyci_walkSteal(walk, id)))
+        {
+            if (!abort)
+            {
+                if (it->isdir)
+                    pyci_walkDir(walk, id, it);
+                else
+                    pyci_walkFile(walk, it);
+            }
+            else if (it->fd >= 0)
+                close(it->fd);
+
+            pyci_wdirPut(walk, it->dir);
+            free(it->path);
+            free(it);
+
+            pthread_mutex_lock(&walk->lock);
+            if (!--walk->pending)
+                pthread_cond_broadcast(&walk->wake);
+            pthread_mutex_unlock(&walk->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        while (walk->pending && (walk->gen == gen))
+            pthread_cond_wait(&walk->wake, &walk->lock);
+        done = !walk->pending;
+        pthread_mutex_unlock(&walk->lock);
+
+        if (done) break;
+    }
+
+    pthread_mutex_lock(&walk->lock);
+    walk->running--;
+    pthread_cond_signal(&walk->ready);
+    pthread_mutex_unlock(&walk->lock);
+}
+#endif
+
+#ifndef _WIN32
+/* Asynchronous scans, jobs run on the native pool and are queued on the
+   completion queue of their event loop. An eventfd (a pipe where missing)
+   registered with loop.add_reader() wakes up the loop, which then resolves
+   the futures of all the completed jobs at once. The fd is only written
+   when the queue goes from empty to non empty. Queues are only touched by
+   the thread running their loop, as asyncio requires, scanAsync() refuses
+   to queue on a loop running in another thread. Nothing here depends on
+   the GIL */
+typedef struct _pyci_ajob_t
+{
+    pyci_item_t item;
+    pyci_scanctx_t ctx;
+    pyc_Engine *owner;
+    Py_buffer view;
+    int isbuffer;
+    int immutable;                          /* view can be cached on its content */
+    PyObject *future;
+    struct _pyci_aqueue_t *queue;
+    struct _pyci_ajob_t *next;
+} pyci_ajob_t;
+
+typedef struct _pyci_aqueue_t
+{
+    pthread_mutex_t lock;
+    int rfd, wfd;
+    pyci_ajob_t *head, *tail;               /* completed jobs */
+    size_t pending;                         /* not yet delivered, under lock too */
+    PyObject *loop;
+    PyObject *aqueues;                      /* the registry it's in */
+} pyci_aqueue_t;
+
+static void pyci_asyncRunner(void *arg)
+{
+    pyci_ajob_t *job = (pyci_ajob_t *) arg;
+    pyci_aqueue_t *q = job->queue;
+    uint64_t one = 1;
+
+    if (job->isbuffer)
+        job->item.ret = pyci_scanMemory(&job->ctx, job->view.buf, job->view.len, job->immutable,
+                                        &job->item.virname, &job->item.cached);
+    else
+        pyci_scanItem(&job->item, &job->ctx);
+
+    /* the loop may free the queue as soon as the lock is released */
+    pthread_mutex_lock(&q->lock);
+    if (q->tail)
+        q->tail->next = job;
+    else
+    {
+        q->head = job;
+        if (write(q->wfd, &one, (q->rfd == q->wfd) ? sizeof(one) : 1) < 0)
+            pyc_DEBUG(pyci_asyncRunner, "write: %s\n", strerror(errno));
+    }
+    q->tail = job;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Called with the GIL */
+static void pyci_ajobFree(pyci_ajob_t *job)
+{
+    if (job->isbuffer) PyBuffer_Release(&job->view);
+    free((char *) job->item.path);
+    free(job->item.cached);
+    pyci_contextPut(&job->ctx);
+    Py_DECREF(job->owner);
+    Py_XDECREF(job->future);
+    free(job);
+}
+
+static void pyci_asyncResolve(pyci_ajob_t *job)
+{
+    PyObject *result, *value;
+    int cancelled;
+
+    if (!(value = PyObject_CallMethod(job->future, "cancelled", NULL)))
+        goto ar_error;
+    cancelled = PyObject_IsTrue(value);
+    Py_DECREF(value);
+    if (cancelled) return;
+
+    if (!(result = pyci_itemResult("scanAsync", &job->item)))
+        goto ar_error;
+
+    if (PyTuple_GET_ITEM(result, 0) == Py_None)
+        value = PyObject_CallMethod(job->future, "set_exception", "(N)",
+                                    PyObject_CallFunctionObjArgs(PycError(job->owner), PyTuple_GET_ITEM(result, 1), NULL));
+    else
+        value = PyObject_CallMethod(job->future, "set_result", "(O)", result);
+
+    Py_DECREF(result);
+    if (value)
+    {
+        Py_DECREF(value);
+        return;
+    }
+
+ ar_error:
+    PyErr_WriteUnraisable(job->future);
+}
+
+/* Nothing in flight, unregisters the queue so the loop does not wait on
+   us. The registry and the reader hold the last references to it, the
+   queue can be gone on return */
+static void pyci_aqueueIdle(pyci_aqueue_t *q)
+{
+    PyObject *capsule, *value;
+    size_t pending;
+
+    pthread_mutex_lock(&q->lock);
+    pending = q->pending;
+    pthread_mutex_unlock(&q->lock);
+
+    if (pending || !(capsule = PyDict_GetItem(q->aqueues, q->loop)))
+        return;
+
+    Py_INCREF(capsule);
+    if ((value = PyObject_CallMethod(q->loop, "remove_reader", "i", q->rfd)))
+        Py_DECREF(value);
+    else
+        PyErr_WriteUnraisable(q->loop);
+    if (PyDict_DelItem(q->aqueues, q->loop) < 0)
+        PyErr_Clear();
+    Py_DECREF(capsule);
+}
+
+/* Reader callback of the loop */
+static PyObject *pyci_asyncDrain(PyObject *capsule, PyObject *args)
+{
+    pyci_aqueue_t *q = (pyci_aqueue_t *) PyCapsule_GetPointer(capsule, "pyc.aqueue");
+    pyci_ajob_t *job, *next;
+    char buffer[64];
+
+    if (!q) return NULL;
+
+    while (read(q->rfd, buffer, sizeof(buffer)) > 0);
+
+    pthread_mutex_lock(&q->lock);
+    job = q->head;
+    q->head = q->tail = NULL;
+    for (next = job; next; next = next->next)
+        q->pending--;
+    pthread_mutex_unlock(&q->lock);
+
+    for (; job; job = next)
+    {
+        next = job->next;
+        pyci_asyncResolve(job);
+        pyci_ajobFree(job);
+    }
+
+    pyci_aqueueIdle(q);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef pyci_asyncDrainDef =
+{
+    "_drain", (PyCFunction) pyci_asyncDrain, METH_NOARGS, "Resolve completed scans"
+};
+
+static void pyci_aqueueFree(PyObject *capsule)
+{
+    pyci_aqueue_t *q = (pyci_aqueue_t *) PyCapsule_GetPointer(capsule, "pyc.aqueue");
+
+    close(q->rfd);
+    if (q->wfd != q->rfd) close(q->wfd);
+    pthread_mutex_destroy(&q->lock);
+    Py_XDECREF(q->loop);
+    Py_XDECREF(q->aqueues);
+    free(q);
+}
+
+/* Returns the queue of the loop, registering a new one with it if needed,
+   the registry maps event loops to capsules with their queue and holds
+   them only while they have pending jobs */
+static pyci_aqueue_t *pyci_aqueueGet(pyc_Engine *self, PyObject *loop)
+{
+    PyObject *aqueues = self->state->aqueues, *capsule, *callback, *value;
+    pyci_aqueue_t *q;
+    int fds[2];
+
+    if ((capsule = PyDict_GetItem(aqueues, loop)))
+        return (pyci_aqueue_t *) PyCapsule_GetPointer(capsule, "pyc.aqueue");
+
+#ifdef __linux__
+    if ((fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+#endif
+    {
+        if (pipe(fds) < 0)
+        {
+            PyErr_PycFromErrno(self, scanAsync);
+            return NULL;
+        }
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (!(q = calloc(1, sizeof(pyci_aqueue_t))))
+    {
+        close(fds[0]);
+        if (fds[1] != fds[0]) close(fds[1]);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    pthread_mutex_init(&q->lock, NULL);
+    q->rfd = fds[0];
+    q->wfd = fds[1];
+    Py_INCREF(loop);
+    q->loop = loop;
+    Py_INCREF(aqueues);
+    q->aqueues = aqueues;
+
+    if (!(capsule = PyCapsule_New(q, "pyc.aqueue", pyci_aqueueFree)))
+    {
+        close(q->rfd);
+        if (q->wfd != q->rfd) close(q->wfd);
+        pthread_mutex_destroy(&q->lock);
+        Py_DECREF(loop);
+        Py_DECREF(aqueues);
+        free(q);
+        return NULL;
+    }
+
+    value = NULL;
+    if ((callback = PyCFunction_New(&pyci_asyncDrainDef, capsule)))
+    {
+        if (!PyDict_SetItem(aqueues, loop, capsule))
+        {
+            if (!(value = PyObject_CallMethod(loop, "add_reader", "iO", q->rfd, callback)))
+                PyDict_DelItem(aqueues, loop);
+        }
+        Py_DECREF(callback);
+    }
+
+    Py_DECREF(capsule);
+    if (!value) return NULL;
+    Py_DECREF(value);
+
+    return q;
+}
+#endif
+
+#ifndef _WIN32
+/* Fork safety, only the forking thread survives in the child. The locks
+   are taken around fork() so the child gets them in a consistent state,
+   reloadLock is only tried since a database load can hold it for long.
+   What belonged to the other threads is dropped in the child: queued
+   pool jobs, pending cache entries, a reload in progress, the database
+   watcher. libclamav's own locks can't be covered, so fork while no
+   scan is running */
+static void pyci_forkPrepare(void)
+{
+    pyci_engine_t *e;
+    int i;
+
+    pthread_mutex_lock(&pyci_enginesLock);
+    for (e = pyci_engines; e; e = e->next)
+    {
+        e->forklocked = !pthread_mutex_trylock(&e->reloadLock);
+        pthread_mutex_lock(&e->engineLock);
+        for (i = 0; i < PYC_CACHE_STRIPES; i++)
+            pthread_mutex_lock(&e->cache.stripes[i].lock);
+        for (i = 0; i < PYC_STATS_SHARDS; i++)
+            pthread_mutex_lock(&e->stats.shards[i].lock);
+    }
+    pthread_mutex_lock(&pyci_poolLock);
+    pthread_mutex_lock(&pyci_shardLock);
+}
+
+static void pyci_forkParent(void)
+{
+    pyci_engine_t *e;
+    int i;
+
+    pthread_mutex_unlock(&pyci_shardLock);
+    pthread_mutex_unlock(&pyci_poolLock);
+    for (e = pyci_engines; e; e = e->next)
+    {
+        for (i = 0; i < PYC_STATS_SHARDS; i++)
+            pthread_mutex_unlock(&e->stats.shards[i].lock);
+        for (i = 0; i < PYC_CACHE_STRIPES; i++)
+            pthread_mutex_unlock(&e->cache.stripes[i].lock);
+        pthread_mutex_unlock(&e->engineLock);
+        if (e->forklocked)
+            pthread_mutex_unlock(&e->reloadLock);
+    }
+    pthread_mutex_unlock(&pyci_enginesLock);
+}
+
+/* Their owners are gone, waiters would never wake up */
+static void pyci_cacheDropPending(pyci_cstripe_t *s)
+{
+    pyci_centry_t **p, *entry;
+    size_t j;
+
+    for (j = 0; j < s->nbuckets; j++)
+    {
+        p = &s->buckets[j];
+        while ((entry = *p))
+        {
+            if (entry->ret != PYC_CACHE_PENDING)
+            {
+                p = &entry->hnext;
+                continue;
+            }
+            *p = entry->hnext;
+            free(entry);
+        }
+    }
+}
+
+static void pyci_forkChild(void)
+{
+    pyci_engine_t *e;
+    pyci_job_t *job;
+    int i;
+
+    pthread_mutex_unlock(&pyci_shardLock);
+
+    while ((job = pyci_poolHead))
+    {
+        pyci_poolHead = job->next;
+        free(job);
+    }
+    pyci_poolTail = NULL;
+    pyci_poolThreads = 0;
+    pthread_cond_init(&pyci_poolCond, NULL);
+    pthread_mutex_unlock(&pyci_poolLock);
+
+    for (e = pyci_engines; e; e = e->next)
+    {
+        for (i = 0; i < PYC_STATS_SHARDS; i++)
+            pthread_mutex_unlock(&e->stats.shards[i].lock);
+        for (i = 0; i < PYC_CACHE_STRIPES; i++)
+        {
+            pyci_cacheDropPending(&e->cache.stripes[i]);
+            pthread_cond_init(&e->cache.stripes[i].done, NULL);
+            pthread_mutex_unlock(&e->cache.stripes[i].lock);
+        }
+
+        /* the reload thread didn't make it, nor its reference */
+        if (e->reloading)
+        {
+            e->reloading = 0;
+            e->refs--;
+        }
+
+        /* a scan may have been taking a reference */
+        if (e->policy)
+            pthread_mutex_init(&e->policy->lock, NULL);
+
+        /* nor the watcher, it's started again by the next scan */
+        if (e->watching)
+        {
+            close(e->wakefd[0]);
+            close(e->wakefd[1]);
+            if (e->notifyfd >= 0) close(e->notifyfd);
+            e->wakefd[0] = e->wakefd[1] = e->notifyfd = -1;
+            pyci_watchSet(e, 0);
+            e->watchstop = 0;
+            e->refs--;
+        }
+        pthread_mutex_unlock(&e->engineLock);
+
+        if (e->forklocked)
+            pthread_mutex_unlock(&e->reloadLock);
+        else
+        {
+            /* dbstat may be half updated, it's rebuilt on the next check */
+            e->dbstat = NULL;
+            pthread_mutex_init(&e->reloadLock, NULL);
+        }
+    }
+    pthread_mutex_unlock(&pyci_enginesLock);
+}
+#endif
+
+/* Public */
+static PyObject *pyc_Engine_checkAndLoadDB(pyc_Engine *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "wait", NULL };
+    PyObject *wait = Py_True;
+    int ret;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &wait))
+    {
+        PyErr_SetString(PycError(self), "checkAndLoadDB: Invalid arguments");
+        return NULL;
+    }
+
+    if ((ret = pyci_checkAndLoadDB(self->e, 1, PyObject_IsTrue(wait))))
+    {
+        PyErr_PycFromClamav(self, pyc_loadDB, ret);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *pyc_Engine_getVersions(pyc_Engine *self, PyObject *args)
+{
+    const char *version;
+    unsigned int main, daily, bytecode, signo;
+
+    pyci_engineCheck(self, getVersions);
+    version = cl_retver();
+
+    pthread_mutex_lock(&self->e->engineLock);
+    main = self->e->vmain;
+    daily = self->e->vdaily;
+    bytecode = self->e->vbytecode;
+    signo = self->e->sigs;
+    pthread_mutex_unlock(&self->e->engineLock);
+
+    return Py_BuildValue("(s,i,i,i,i)", version, main, daily, bytecode, signo);
+}
+
+static PyObject *pyc_Engine_setDBPath(pyc_Engine *self, PyObject *args)
+{
+    char *path = NULL;
+    struct stat dp;
+
+    if (!PyArg_ParseTuple(args, "s", &path))
+    {
+        PyErr_SetString(PycError(self), "setDBPath: Database path must be a String");
+        return NULL;
+    }
+
+    if (lstat(path, &dp) < 0)
+    {
+        PyErr_PycFromErrno(self, pyc_setDBPath);
+        return NULL;
+    }
+
+    pyci_setDBPath(self->e, path);
+    Py_RETURN_NONE;
+}
+
+static PyObject *pyc_Engine_getDBPath(pyc_Engine *self, PyObject *args)
+{
+    PyObject *path;
+
+    pthread_mutex_lock(&self->e->engineLock);
+    path = PyString_FromString(self->e->dbpath);
+    pthread_mutex_unlock(&self->e->engineLock);
+
+    return path;
+}
+
+#ifndef _WIN32
+/* None disables the cache, it's used from the next load. A missing
+   directory is created, an existing one must be private to the user */
+static PyObject *pyc_Engine_setDBCacheDir(pyc_Engine *self, PyObject *args)
+{
+    char *path = NULL;
+    struct stat dp;
+
+    if (!PyArg_ParseTuple(args, "z", &path))
+    {
+        PyErr_SetString(PycError(self), "setDBCacheDir: Cache directory must be a String or None");
+        return NULL;
+    }
+
+    if (path && (stat(path, &dp) < 0) && ((errno != ENOENT) || mkdir(path, 0700) || (stat(path, &dp) < 0)))
+    {
+        PyErr_PycFromErrno(self, pyc_setDBCacheDir);
+        return NULL;
+    }
+
+    if (path && !S_ISDIR(dp.st_mode))
+    {
+        PyErr_SetString(PycError(self), "setDBCacheDir: Not a directory");
+        return NULL;
+    }
+
+    if (path && pyci_dbcachePrivate(path))
+    {
+        PyErr_SetString(PycError(self), "setDBCacheDir: Directory must be owned by the user and private to them");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    pthread_mutex_lock(&self->e->reloadLock);
+    pthread_mutex_lock(&self->e->engineLock);
+    strncpy(self->e->cachedir, path ? path : "", MAX_PATH);
+    self->e->cachedir[MAX_PATH] = 0;
+    pthread_mutex_unlock(&self->e->engineLock);
+    pthread_mutex_unlock(&self->e->reloadLock);
+    Py_END_ALLOW_THREADS;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *pyc_Engine_getDBCacheDir(pyc_Engine *self, PyObject *args)
+{
+    PyObject *path;
+
+    pthread_mutex_lock(&self->e->engineLock);
+    if (self->e->cachedir[0])
+        path = PyString_FromString(self->e->cachedir);
+    else
+    {
+        Py_INCREF(Py_None);
+        path = Py_None;
+    }
+    pthread_mutex_unlock(&self->e->engineLock);
+
+    return path;
+}
+#endif
+
+static PyObject *pyci_dbOptionsList(uint32_t dboptions)
+{
+    int i;
+    PyObject *list = PyList_New(0), *name;
+
+    if (!list)
+        return NULL;
+
+    for (i = 0; db_options[i].name; i++)
+    {
+        if (!(dboptions & db_options[i].id)) continue;
+        if (!(name = PyString_FromString(db_options[i].name)) || PyList_Append(list, name))
+        {
+            Py_XDECREF(name);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(name);
+    }
+
+    return list;
+}
+
+/* The report is copied under engineLock, a reload may replace it */
+static PyObject *pyci_reportDict(pyci_engine_t *e)
+{
+    pyci_report_t *report = NULL;
+    PyObject *files, *value;
+    size_t i, size = 0;
+
+    pthread_mutex_lock(&e->engineLock);
+    if (e->report)
+    {
+        size = sizeof(pyci_report_t) + e->report->nfiles * sizeof(pyci_dbfile_t);
+        if ((report = malloc(size)))
+            memcpy(report, e->report, size);
+    }
+    pthread_mutex_unlock(&e->engineLock);
+
+    if (!size)
+        Py_RETURN_NONE;
+
+    if (!report)
+        return PyErr_NoMemory();
+
+    if (!(files = PyDict_New()))
+    {
+        free(report);
+        return NULL;
+    }
+
+    for (i = 0; i < report->nfiles; i++)
+    {
+        if (!(value = PyInt_FromLong(report->files[i].sigs)) ||
+            PyDict_SetItemString(files, report->files[i].name, value))
+        {
+            Py_XDECREF(value);
+            Py_DECREF(files);
+            free(report);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+
+    value = Py_BuildValue("{s:I,s:N,s:d,s:d,s:K,s:K,s:N}",
+                          "sigs",         report->sigs,
+                          "options",      pyci_dbOptionsList(report->dboptions),
+                          "load_time",    report->loadtime / 1e6,
+                          "compile_time", report->compiletime / 1e6,
+                          "rss_before",   (unsigned PY_LONG_LONG) report->rssbefore,
+                          "rss_after",    (unsigned PY_LONG_LONG) report->rssafter,
+                          "files",        files);
+    free(report);
+    return value;
+}
+
+/* Returns the report of the last load, options replaces the set of
+   databases to load */
+static PyObject *pyc_Engine_loadDB(pyc_Engine *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "path", "options", NULL };
+    PyObject *result = NULL, *options = NULL, *seq, *item;
+    uint32_t dboptions = 0;
+    unsigned int ret = 0;
+    Py_ssize_t i;
+    int j;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO", kwlist, &result, &options))
+    {
+        PyErr_SetString(PycError(self), "loadDB: Invalid arguments");
+        return NULL;
+    }
+
+    if (result && (result != Py_None) && !PyString_Check(result))
+    {
+        PyErr_SetString(PyExc_TypeError, "loadDB: Database path must be a String");
+        return NULL;
+    }
+
+    if (options && (options != Py_None))
+    {
+        if (!(seq = PySequence_Fast(options, "loadDB: A sequence of database options is needed")))
+            return NULL;
+
+        for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++)
+        {
+            item = PySequence_Fast_GET_ITEM(seq, i);
+            for (j = 0; db_options[j].name; j++)
+                if (PyString_Check(item) && !strcmp(PyString_AsString(item), db_options[j].name))
+                    break;
+
+            if (!db_options[j].name)
+            {
+                Py_DECREF(seq);
+                PyErr_SetString(PyExc_TypeError, "loadDB: Invalid database option");
+                return NULL;
+            }
+            dboptions |= db_options[j].id;
+        }
+        Py_DECREF(seq);
+
+        pthread_mutex_lock(&self->e->engineLock);
+        self->e->dboptions = dboptions;
+        pthread_mutex_unlock(&self->e->engineLock);
+    }
+
+    if (result && (result != Py_None))
+        pyci_setDBPath(self->e, PyString_AsString(result));
+
+    if ((ret = pyci_checkAndLoadDB(self->e, 1, 1)))
+    {
+        PyErr_PycFromClamav(self, loadDB, ret);
+        return NULL;
+    }
+
+    return pyci_reportDict(self->e);
+}
+
+/* Seconds between database checks, they're done by a background thread
+   except on windows. SELFCHECK_ALWAYS checks before every scan */
+static PyObject *pyc_Engine_setDBTimer(pyc_Engine *self, PyObject *args)
+{
+    int value = 0;
+    if (!PyArg_ParseTuple(args, "i", &value))
+    {
+        PyErr_SetString(PycError(self), "setDBTimer: Invalid arguments");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&self->e->engineLock);
+    self->e->checktimer = value;
+#ifndef _WIN32
+    pyci_watchWake(self->e);
+#endif
+    pthread_mutex_unlock(&self->e->engineLock);
+    Py_RETURN_NONE;
+}
+
+static PyObject *pyc_Engine_isLoaded(pyc_Engine *self, PyObject *args)
+{
+    if (pyci_isLoaded(self->e))
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+/* Per call limits from the keyword arguments of the scan functions: timeout
+   in seconds, maxbytes and a pyc.CancelToken, each one can be None. The
+   clock starts now. The token stays alive with the arguments of the call */
+static int pyci_limitsParse(pyc_Engine *self, PyObject *timeout, PyObject *maxbytes, PyObject *cancel,
+                            pyci_limits_t *limits)
+{
+    double seconds;
+    PY_LONG_LONG bytes;
+
+    memset(limits, 0, sizeof(pyci_limits_t));
+
+    if (timeout != Py_None)
+    {
+        if (((seconds = PyFloat_AsDouble(timeout)) <= 0) || PyErr_Occurred())
+            goto lp_error;
+        limits->deadline = pyci_now() + (uint64_t) (seconds * 1000000);
+    }
+
+    if (maxbytes != Py_None)
+    {
+        if (!(PyInt_Check(maxbytes) || PyLong_Check(maxbytes)) ||
+            ((bytes = PyLong_AsLongLong(maxbytes)) <= 0) || PyErr_Occurred())
+            goto lp_error;
+        limits->maxbytes = (uint64_t) bytes;
+    }
+
+    if (cancel != Py_None)
+    {
+        if (!PyObject_TypeCheck(cancel, self->state->cancelType))
+            goto lp_error;
+        limits->cancel = &((pyc_CancelToken *) cancel)->cancelled;
+    }
+
+    return 0;
+
+ lp_error:
+    PyErr_Clear();
+    return -1;
+}
+
+/* Warning passing fd on windows works only if the crt used by python is
+   the same used to compile libclamav */
+static PyObject *pyci_scanDesc(pyc_Engine *self, int fd, const pyci_limits_t *limits)
+{
+    pyci_engine_t *e = self->e;
+    unsigned int ret;
+    const char *virname = NULL;
+    char *cached = NULL;
+    PyObject *result = NULL;
+    pyci_scanctx_t ctx;
+
+    if ((ret = pyci_checkAndLoadDB(e, 0, 0)))
+    {
+        PyErr_PycFromClamav(self, scanDesc, ret);
+        return NULL;
+    }
+
+    pyci_engineGet(e, &ctx);
+    ctx.limits = limits;
+
+    Py_BEGIN_ALLOW_THREADS;
+    ret = pyci_scanCached(&ctx, fd, &virname, &cached);
+    Py_END_ALLOW_THREADS;
+
+    /* virname lives in the engine, convert it before dropping our reference */
+    if (!(result = pyci_scanResult(ret, virname)))
+        PyErr_PycFromClamav(self, ScanDesc, ret);
+
+    pyci_contextPut(&ctx);
+    free(cached);
+    return result;
+}
+
+static PyObject *pyc_Engine_scanDesc(pyc_Engine *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "fd", "timeout", "maxbytes", "cancel", NULL };
+    PyObject *timeout = Py_None, *maxbytes = Py_None, *cancel = Py_None;
+    pyci_limits_t limits;
+    int fd = -1;
+
+    pyci_engineCheck(self, scanDesc);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|OOO", kwlist, &fd, &timeout, &maxbytes, &cancel) || (fd < 0) ||
+        pyci_limitsParse(self, timeout, maxbytes, cancel, &limits))
+    {
+        PyErr_SetString(PycError(self), "scanDesc: Invalid arguments");
+        return NULL;
+    }
+
+    return pyci_scanDesc(self, fd, &limits);
+}
+
+/* A bytes object can't change while scanned, a bytearray, an mmap or a view
+   of them can even when the view is read-only */
+static int pyci_immutable(const Py_buffer *view)
+{
+    return view->readonly && view->obj && PyBytes_Check(view->obj);
+}
+
+/* Scan any object exporting the buffer interface (str, bytearray, memoryview, mmap)
+   directly from memory, the buffer is held for the whole scan and never copied */
+static PyObject *pyc_Engine_scanBuffer(pyc_Engine *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "buffer", "timeout", "maxbytes", "cancel", NULL };
+    PyObject *timeout = Py_None, *maxbytes = Py_None, *cancel = Py_None;
+    const char *virname = NULL;
+    char *cached = NULL;
+    PyObject *result = NULL;
+    pyci_limits_t limits;
+    pyci_scanctx_t ctx;
+    Py_buffer view;
+    int ret;
+
+    pyci_engineCheck(self, scanBuffer);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, PYC_BUFFER "|OOO", kwlist, &view, &timeout, &maxbytes, &cancel))
+    {
+        PyErr_SetString(PyExc_TypeError, "scanBuffer: An object supporting the buffer interface is needed");
+        return NULL;
+    }
+
+    if (pyci_limitsParse(self, timeout, maxbytes, cancel, &limits))
+    {
+        PyErr_SetString(PyExc_TypeError, "scanBuffer: Invalid limits");
+        goto sb_cleanup;
+    }
+
+    if ((ret = pyci_checkAndLoadDB(self->e, 0, 0)))
+    {
+        PyErr_PycFromClamav(self, scanBuffer, ret);
+        goto sb_cleanup;
+    }
+
+    pyci_engineGet(self->e, &ctx);
+    ctx.limits = &limits;
+
+    Py_BEGIN_ALLOW_THREADS;
+    ret = pyci_scanMemory(&ctx, view.buf, view.len, pyci_immutable(&view), &virname, &cached);
+    Py_END_ALLOW_THREADS;
+
+    if (!(result = pyci_scanResult(ret, virname)))
+        PyErr_PycFromClamav(self, scanBuffer, ret);
+
+    pyci_contextPut(&ctx);
+    free(cached);
+
+ sb_cleanup:
+    PyBuffer_Release(&view);
+    return result;
+}
+
+static PyObject *pyc_Engine_scanFile(pyc_Engine *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "filename", "timeout", "maxbytes", "cancel", NULL };
+    PyObject *timeout = Py_None, *maxbytes = Py_None, *cancel = Py_None;
+    char *filename = NULL;
+    struct stat info;
+    PyObject *result = NULL;
+    pyci_limits_t limits;
+    int fd = -1;
+
+    pyci_engineCheck(self, scanFile);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|OOO", kwlist, &filename, &timeout, &maxbytes, &cancel))
+    {
+        PyErr_SetString(PyExc_TypeError, "scanFile: A string is needed for the filename");
+        return NULL;
+    }
+
+    if (pyci_limitsParse(self, timeout, maxbytes, cancel, &limits))
+    {
+        PyErr_SetString(PyExc_TypeError, "scanFile: Invalid limits");
+        return NULL;
+    }
+
+#ifdef _WIN32
+    if (!(filename = cw_normalizepath(filename)))
+    {
+        PyErr_SetString(PycError(self), "scanFile: Path Normalization failed");
+        return NULL;
+    }
+#endif
+
+    if (lstat(filename, &info) < 0)
+    {
+        PyErr_PycFromErrno(self, scanFile);
+        goto sf_cleanup;
+    }
+
+    if (!(S_ISREG(info.st_mode) || S_ISLNK(info.st_mode)))
+    {
+        PyErr_SetString(PycError(self), "scanFile: Not a regular file");
+        goto sf_cleanup;
+    }
+
+    if ((fd = open(filename, O_RDONLY | O_BINARY)) < 0)
+    {
+        PyErr_PycFromErrno(self, scanFile);
+        goto sf_cleanup;
+    }
+
+    result = pyci_scanDesc(self, fd, &limits);
+
+ sf_cleanup:
+    if (fd != -1) close(fd);
+#ifdef _WIN32
+    if (filename) free(filename);
+#endif
+    return result;
+}
+
+/* Scan a list of filenames and/or file descriptors on the native pool, the GIL
+   is released once for the whole batch, errors are reported per item as
+   (None, message) so a single failure does not abort the batch */
+static PyObject *pyc_Engine_scanFiles(pyc_Engine *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "files", "threads", NULL };
+    PyObject *files = NULL, *seq = NULL, *list = NULL, *item;
+    pyci_batch_t batch;
+    unsigned int ret;
+    int threads = 0;
+    Py_ssize_t i;
+
+    pyci_engineCheck(self, scanFiles);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist, &files, &threads) || (threads < 0))
+    {
+        PyErr_SetString(PyExc_TypeError, "scanFiles: Invalid arguments");
+        return NULL;
+    }
+
+    /* a private copy, the caller's list may change while the scans run */
+    if (!(seq = PySequence_Tuple(files)))
+    {
+        PyErr_SetString(PyExc_TypeError, "scanFiles: A sequence of filenames or file descriptors is needed");
+        return NULL;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.count = PySequence_Fast_GET_SIZE(seq);
+
+    if (!(batch.items = PyMem_Malloc(sizeof(pyci_item_t) * (batch.count + 1))))
+    {
+        PyErr_NoMemory();
+        goto sfs_cleanup;
+    }
+
+    /* filenames are borrowed from the copy, it stays alive until the end */
+    for (i = 0; i < (Py_ssize_t) batch.count; i++)
+    {
+        memset(&batch.items[i], 0, sizeof(pyci_item_t));
+        batch.items[i].fd = -1;
+        item = PySequence_Fast_GET_ITEM(seq, i);
+
+        if (PyString_Check(item))
+            batch.items[i].path = PyString_AsString(item);
+        else if (PyInt_Check(item) && (PyInt_AsLong(item) >= 0))
+            batch.items[i].fd = PyInt_AsLong(item);
+        else
+        {
+            PyErr_SetString(PyExc_TypeError, "scanFiles: Items must be filenames or file descriptors");
+            goto sfs_cleanup;
+        }
+    }
+
+    if ((ret = pyci_checkAndLoadDB(self->e, 0, 0)))
+    {
+        PyErr_PycFromClamav(self, scanFiles, ret);
+        goto sfs_cleanup;
+    }
+
+    if (!threads) threads = pyci_ncpus();
+    pyci_engineGet(self->e, &batch.ctx);
+
+    Py_BEGIN_ALLOW_THREADS;
+    pyci_batchRun(&batch, threads);
+    Py_END_ALLOW_THREADS;
+
+    if ((list = PyList_New(batch.count)))
+    {
+        for (i = 0; i < (Py_ssize_t) batch.count; i++)
+        {
+            if (!(item = pyci_itemResult("scanFiles", &batch.items[i])))
+            {
+                Py_CLEAR(list);
+                break;
+            }
+            PyList_SET_ITEM(list, i, item);
+        }
+    }
+
+    for (i = 0; i < (Py_ssize_t) batch.count; i++)
+        free(batch.items[i].cached);
+
+    pyci_contextPut(&batch.ctx);
+
+ sfs_cleanup:
+    if (batch.items) PyMem_Free(batch.items);
+    Py_DECREF(seq);
+    return list;
+}
+
+#ifndef _WIN32
+/* Size of the regular file behind fd, sets the exception on failure */
+static int pyci_rangeFile(pyc_Engine *self, const char *func, int fd, uint64_t *size)
+{
+    struct stat info;
+
+    if (fstat(fd, &info) < 0)
+    {
+        PyErr_Format(PycError(self), "%s: %s", func, strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISREG(info.st_mode))
+    {
+        PyErr_Format(PycError(self), "%s: Not a regular file", func);
+        return -1;
+    }
+
+    *size = info.st_size;
+    return 0;
+}
+
+/* Scan length bytes of a regular file starting at offset, in place */
+static PyObject *pyc_Engine_scanRange(pyc_Engine *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "fd", "offset", "length", "timeout", "maxbytes", "cancel", NULL };
+    PyObject *timeout = Py_None, *maxbytes = Py_None, *cancel = Py_None;
+    const char *virname = NULL;
+    char *cached = NULL;
+    PyObject *result = NULL;
+    PY_LONG_LONG offset = -1;
+    Py_ssize_t length = -1;
+    pyci_limits_t limits;
+    pyci_scanctx_t ctx;
+    uint64_t size;
+    int fd = -1, ret;
+
+    pyci_engineCheck(self, scanRange);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iLn|OOO", kwlist, &fd, &offset, &length,
+                                     &timeout, &maxbytes, &cancel) ||
+        (fd < 0) || (offset < 0) || (length < 0) ||
+        pyci_limitsParse(self, timeout, maxbytes, cancel, &limits))
+    {
+        PyErr_SetString(PycError(self), "scanRange: Invalid arguments");
+        return NULL;
+    }
+
+    if (pyci_rangeFile(self, "scanRange", fd, &size))
+        return NULL;
+
+    if ((uint64_t) offset + length > size)
+    {
+        PyErr_SetString(PycError(self), "scanRange: Range beyond the end of the file");
+        return NULL;
+    }
+
+    if ((ret = pyci_checkAndLoadDB(self->e, 0, 0)))
+    {
+        PyErr_PycFromClamav(self, scanRange, ret);
+        return NULL;
+    }
+
+    pyci_engineGet(self->e, &ctx);
+    ctx.limits = &limits;
+
+    Py_BEGIN_ALLOW_THREADS;
+    ret = pyci_scanRange(&ctx, fd, offset, length, &virname, &cached);
+    Py_END_ALLOW_THREADS;
+
+    if (!(result = pyci_scanResult(ret, virname)))
+        PyErr_PycFromClamav(self, scanRange, ret);
+
+    pyci_contextPut(&ctx);
+    free(cached);
+    return result;
+}
+
+/* Scan many (offset, length) ranges of the same file on the native pool,
+   like scanFiles() a range beyond the end of the file is reported in its
+   result, it doesn't fail the batch */
+static PyObject *pyc_Engine_scanRanges(pyc_Engine *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "fd", "ranges", "threads", NULL };
+    PyObject *ranges = NULL, *seq = NULL, *list = NULL, *item;
+    PY_LONG_LONG offset;
+    Py_ssize_t length, i;
+    pyci_batch_t batch;
+    unsigned int ret;
+    int fd = -1, threads = 0;
+    uint64_t size;
+
+    pyci_engineCheck(self, scanRanges);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iO|i", kwlist, &fd, &ranges, &threads) || (fd < 0) || (threads < 0))
+    {
+        PyErr_SetString(PyExc_TypeError, "scanRanges: Invalid arguments");
+        return NULL;
+    }
+
+    if (pyci_rangeFile(self, "scanRanges", fd, &size))
+        return NULL;
+
+    if (!(seq = PySequence_Tuple(ranges)))
+    {
+        PyErr_SetString(PyExc_TypeError, "scanRanges: A sequence of (offset, length) pairs is needed");
+        return NULL;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.count = PySequence_Fast_GET_SIZE(seq);
+
+    if (!(batch.items = PyMem_Malloc(sizeof(pyci_item_t) * (batch.count + 1))))
+    {
+        PyErr_NoMemory();
+        goto srs_cleanup;
+    }
+
+    for (i = 0; i < (Py_ssize_t) batch.count; i++)
+    {
+        memset(&batch.items[i], 0, sizeof(pyci_item_t));
+        item = PySequence_Fast_GET_ITEM(seq, i);
+
+        if (!PyTuple_Check(item) || !PyArg_ParseTuple(item, "Ln", &offset, &length) || (offset < 0) || (length < 0))
+        {
+            PyErr_SetString(PyExc_TypeError, "scanRanges: Items must be (offset, length) pairs");
+            goto srs_cleanup;
+        }
+
+        batch.items[i].fd = fd;
+        batch.items[i].range = 1;
+        batch.items[i].offset = offset;
+        batch.items[i].length = length;
+        if ((uint64_t) offset + length > size)
+            batch.items[i].errmsg = "Range beyond the end of the file";
+    }
+
+    if ((ret = pyci_checkAndLoadDB(self->e, 0, 0)))
+    {
+        PyErr_PycFromClamav(self, scanRanges, ret);
+        goto srs_cleanup;
+    }
+
+    if (!threads) threads = pyci_ncpus();
+    pyci_engineGet(self->e, &batch.ctx);
+
+    Py_BEGIN_ALLOW_THREADS;
+    pyci_batchRun(&batch, threads);
+    Py_END_ALLOW_THREADS;
+
+    if ((list = PyList_New(batch.count)))
+    {
+        for (i = 0; i < (Py_ssize_t) batch.count; i++)
+        {
+            if (!(item = pyci_itemResult("scanRanges", &batch.items[i])))
+            {
+                Py_CLEAR(list);
+                break;
+            }
+            PyList_SET_ITEM(list, i, item);
+        }
+    }
+
+    for (i = 0; i < (Py_ssize_t) batch.count; i++)
+        free(batch.items[i].cached);
+
+    pyci_contextPut(&batch.ctx);
+
+ srs_cleanup:
+    if (batch.items) PyMem_Free(batch.items);
+    Py_DECREF(seq);
+    return list;
+}
+
+/* Recursively scan a directory on the native pool, results are reported
+   as (path, result) pairs in completion order, either through the callback
+   or collected in the returned list */
+static PyObject *pyc_Engine_scanDir(pyc_Engine *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "root", "threads", "follow_symlinks", "max_depth", "callback", NULL };
+    PyObject *callback = Py_None, *follow = Py_False, *list = NULL, *value;
+    pyci_wres_t *res, *next;
+    pyci_witem_t *root = NULL;
+    PyThreadState *ts;
+    pyci_walk_t walk;
+    char *path = NULL;
+    int threads = 0, maxdepth = -1, fd, running, abort = 0;
+    unsigned int i, ret;
+
+    pyci_engineCheck(self, scanDir);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|iOiO", kwlist, &path, &threads, &follow, &maxdepth, &callback) || (threads < 0))
+    {
+        PyErr_SetString(PyExc_TypeError, "scanDir: Invalid arguments");
+        return NULL;
+    }
+
+    if ((callback != Py_None) && !PyCallable_Check(callback))
+    {
+        PyErr_SetString(PyExc_TypeError, "scanDir: The callback must be callable");
+        return NULL;
+    }
+
+    if ((ret = pyci_checkAndLoadDB(self->e, 0, 0)))
+    {
+        PyErr_PycFromClamav(self, scanDir, ret);
+        return NULL;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+        PyErr_PycFromErrno(self, scanDir);
+        return NULL;
+    }
+
+    if ((callback == Py_None) && !(list = PyList_New(0)))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    if (!threads) threads = pyci_ncpus();
+    if (pyci_poolReserve(threads) || !(root = calloc(1, sizeof(pyci_witem_t))) || !(root->path = strdup(path)))
+    {
+        PyErr_SetString(PycError(self), "scanDir: Can't start the directory walk");
+        Py_XDECREF(list);
+        if (root) free(root);
+        close(fd);
+        return NULL;
+    }
+
+    memset(&walk, 0, sizeof(walk));
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.wake, NULL);
+    pthread_cond_init(&walk.ready, NULL);
+    walk.follow = PyObject_IsTrue(follow);
+    walk.maxdepth = maxdepth;
+    pyci_engineGet(self->e, &walk.ctx);
+
+    root->isdir = 1;
+    root->fd = fd;
+    walk.ndeques = threads;
+    walk.deques = calloc(threads, sizeof(pyci_wdeque_t));
+    for (i = 0; walk.deques && (i < walk.ndeques); i++)
+        pthread_mutex_init(&walk.deques[i].lock, NULL);
+
+    if (!walk.deques || pyci_wdequePush(&walk.deques[0], root))
+    {
+        PyErr_NoMemory();
+        Py_CLEAR(list);
+        free(root->path);
+        free(root);
+        close(fd);
+        goto sd_cleanup;
+    }
+    walk.pending = 1;
+
+    pthread_mutex_lock(&walk.lock);
+    for (i = 0; i < walk.ndeques; i++)
+    {
+        if (pyci_poolSubmit(pyci_walkRunner, &walk)) break;
+        walk.running++;
+    }
+    /* unused deques are still visited by thieves, they just stay empty */
+    running = walk.running;
+    pthread_mutex_unlock(&walk.lock);
+
+    if (!running)
+    {
+        walk.running = 1;
+        ts = PyEval_SaveThread();
+        pyci_walkRunner(&walk);
+        PyEval_RestoreThread(ts);
+    }
+
+    /* deliver results in batches, the GIL is only held while dispatching */
+    do
+    {
+        ts = PyEval_SaveThread();
+        pthread_mutex_lock(&walk.lock);
+        /* runners pick up an abort from here */
+        walk.abort = abort;
+        while (!walk.rhead && walk.running)
+            pthread_cond_wait(&walk.ready, &walk.lock);
+        res = walk.rhead;
+        walk.rhead = walk.rtail = NULL;
+        running = walk.running;
+        pthread_mutex_unlock(&walk.lock);
+        PyEval_RestoreThread(ts);
+
+        for (; res; res = next)
+        {
+            next = res->next;
+            if (!abort)
+            {
+                value = pyci_itemResult("scanDir", &res->item);
+                if (value && list)
+                {
+                    if (PyList_Append(list, value = Py_BuildValue("(s,N)", res->path, value)) < 0)
+                        abort = 1;
+                    Py_XDECREF(value);
+                }
+                else if (value)
+                {
+                    value = PyObject_CallFunction(callback, "sN", res->path, value);
+                    if (!value) abort = 1;
+                    Py_XDECREF(value);
+                }
+                else
+                    abort = 1;
+
+                if (!abort && PyErr_CheckSignals())
+                    abort = 1;
+            }
+            free(res->item.cached);
+            free(res->path);
+            free(res);
+        }
+    } while (running);
+
+    if (!abort && walk.lost)
+    {
+        PyErr_Format(PycError(self), "scanDir: Out of memory, %u results were lost", walk.lost);
+        abort = 1;
+    }
+
+    if (abort)
+        Py_CLEAR(list);
+    else if (!list)
+    {
+        Py_INCREF(Py_None);
+        list = Py_None;
+    }
+
+ sd_cleanup:
+    for (i = 0; walk.deques && (i < walk.ndeques); i++)
+    {
+        pthread_mutex_destroy(&walk.deques[i].lock);
+        free(walk.deques[i].ring);
+    }
+    free(walk.deques);
+    pyci_contextPut(&walk.ctx);
+    pthread_cond_destroy(&walk.ready);
+    pthread_cond_destroy(&walk.wake);
+    pthread_mutex_destroy(&walk.lock);
+    return list;
+}
+#endif
+
+#ifndef _WIN32
+/* Returns a new reference to the loop of scanAsync(), the running one by
+   default. The queue of a loop is only touched by the thread running it,
+   a loop running in another thread is refused. Without asyncio (python 2)
+   the loop object given is used as is */
+static PyObject *pyci_asyncLoop(pyc_Engine *self, PyObject *loop)
+{
+#if PY_MAJOR_VERSION >= 3
+    PyObject *asyncio, *running, *value;
+    int other;
+
+    if (!(asyncio = PyImport_ImportModule("asyncio")))
+        return NULL;
+    if (!(running = PyObject_CallMethod(asyncio, "get_running_loop", NULL)))
+        PyErr_Clear();
+    Py_DECREF(asyncio);
+
+    if ((loop == Py_None) || (loop == running))
+    {
+        if (!running)
+            PyErr_SetString(PycError(self), "scanAsync: No running event loop, loop is needed");
+        return running;
+    }
+    Py_XDECREF(running);
+
+    if (!(value = PyObject_CallMethod(loop, "is_running", NULL)))
+        return NULL;
+    other = PyObject_IsTrue(value);
+    Py_DECREF(value);
+    if (other)
+    {
+        if (other > 0)
+            PyErr_SetString(PycError(self), "scanAsync: The event loop runs in another thread");
+        return NULL;
+    }
+#else
+    if (loop == Py_None)
+    {
+        PyErr_SetString(PycError(self), "scanAsync: No running event loop, loop is needed");
+        return NULL;
+    }
+#endif
+    Py_INCREF(loop);
+    return loop;
+}
+
+/* Start a scan of a filename, a file descriptor or an object supporting
+   the buffer interface on the native pool and return a future of the
+   running event loop, or of loop outside of one, resolved with the usual
+   result. The descriptor or buffer must stay valid until then */
+static PyObject *pyc_Engine_scanAsync(pyc_Engine *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "target", "loop", NULL };
+    PyObject *target = NULL, *loop = Py_None, *future = NULL;
+    pyci_ajob_t *job = NULL;
+    pyci_aqueue_t *q;
+    unsigned int ret;
+
+    pyci_engineCheck(self, scanAsync);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &target, &loop))
+    {
+        PyErr_SetString(PyExc_TypeError, "scanAsync: Invalid arguments");
+        return NULL;
+    }
+
+    if ((ret = pyci_checkAndLoadDB(self->e, 0, 0)))
+    {
+        PyErr_PycFromClamav(self, scanAsync, ret);
+        return NULL;
+    }
+
+    if (!(loop = pyci_asyncLoop(self, loop)))
+        return NULL;
+
+    if (!(job = calloc(1, sizeof(pyci_ajob_t))))
+    {
+        PyErr_NoMemory();
+        goto sa_cleanup;
+    }
+    job->item.fd = -1;
+
+    if (PyString_Check(target))
+    {
+        if (!(job->item.path = strdup(PyString_AsString(target))))
+        {
+            PyErr_NoMemory();
+            goto sa_cleanup;
+        }
+    }
+    else if (PyInt_Check(target) && (PyInt_AsLong(target) >= 0))
+        job->item.fd = PyInt_AsLong(target);
+    else if (!PyObject_GetBuffer(target, &job->view, PyBUF_SIMPLE))
+    {
+        job->isbuffer = 1;
+        job->immutable = pyci_immutable(&job->view);
+    }
+    else
+    {
+        PyErr_SetString(PyExc_TypeError, "scanAsync: A filename, a file descriptor or a buffer is needed");
+        goto sa_cleanup;
+    }
+
+    if (pyci_poolReserve(pyci_ncpus()))
+    {
+        PyErr_SetString(PycError(self), "scanAsync: Can't start the worker threads");
+        goto sa_cleanup;
+    }
+
+    if (!(future = PyObject_CallMethod(loop, "create_future", NULL)) || !(q = pyci_aqueueGet(self, loop)))
+    {
+        Py_CLEAR(future);
+        goto sa_cleanup;
+    }
+
+    Py_INCREF(self);
+    job->owner = self;
+
+    pyci_engineGet(self->e, &job->ctx);
+    Py_INCREF(future);
+    job->future = future;
+    job->queue = q;
+
+    if (pyci_poolSubmit(pyci_asyncRunner, job))
+    {
+        /* a queue registered for this job alone goes away with it */
+        pyci_aqueueIdle(q);
+        PyErr_NoMemory();
+        Py_CLEAR(future);
+        goto sa_cleanup;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->pending++;
+    pthread_mutex_unlock(&q->lock);
+    job = NULL;
+
+ sa_cleanup:
+    if (job)
+    {
+        if (job->owner)
+            pyci_ajobFree(job);
+        else
+        {
+            if (job->isbuffer) PyBuffer_Release(&job->view);
+            free((char *) job->item.path);
+            free(job);
+        }
+    }
+    Py_DECREF(loop);
+    return future;
+}
+#endif
+
+static PyObject *pyc_setDebug(PyObject *self, PyObject *args)
+{
+    cl_debug();
+    Py_RETURN_NONE;
+}
+
+static PyObject *pyc_Engine_setEngineOption(pyc_Engine *self, PyObject *args)
+{
+    char *option;
+    PyObject *value;
+    int ret, i;
+
+    if (!PyArg_ParseTuple(args, "sO", &option, &value))
+    {
+        PyErr_SetString(PyExc_TypeError, "setEngineOption: Invalid arguments");
+        return NULL;
+    }
+
+    for (i = 0; engine_options[i].name; i++)
+    {
+        if (strcmp(option, engine_options[i].name)) continue;
+
+        if (engine_options[i].readonly)
+        {
+            PyErr_SetString(PyExc_TypeError, "setEngineOption: The option is read-only");
+            return NULL;
+        }
+
+        switch (engine_options[i].type)
+        {
+            case OPT_NUM:
+            {
+                uint32_t val = PyInt_AsLong(value);
+                pthread_mutex_lock(&self->e->engineLock);
+                if ((ret = cl_engine_set_num(self->e->engine, engine_options[i].id, val)) == CL_SUCCESS)
+                    self->e->generation++;
+                pthread_mutex_unlock(&self->e->engineLock);
+                if (ret != CL_SUCCESS)
+                {
+                    PyErr_PycFromClamav(self, setEngineOption::cl_engine_set_num, ret);
+                    return NULL;
+                }
+                Py_RETURN_NONE;
+            }
+            case OPT_STR:
+            {
+                const char *val = PyString_AsString(value);
+                pthread_mutex_lock(&self->e->engineLock);
+                if ((ret = cl_engine_set_str(self->e->engine, engine_options[i].id, val)) == CL_SUCCESS)
+                    self->e->generation++;
+                pthread_mutex_unlock(&self->e->engineLock);
+                if (ret != CL_SUCCESS)
+                {
+                    PyErr_PycFromClamav(self, setEngineOption::cl_engine_set_str, ret);
+                    return NULL;
+                }
+                Py_RETURN_NONE;
+            }
+            default:
+                PyErr_SetString(PyExc_TypeError, "setEngineOption: Internal Error");
+        }
+    }
+    PyErr_SetString(PyExc_TypeError, "setEngineOption: Invalid option");
+    return NULL;
+}
+
+static PyObject *pyc_Engine_getEngineOption(pyc_Engine *self, PyObject *args)
+{
+    char *option;
+    int ret, i;
+
+    if (!PyArg_ParseTuple(args, "s", &option))
+    {
+        PyErr_SetString(PyExc_TypeError, "setEngineOption: Invalid arguments");
+        return NULL;
+    }
+
+    for (i = 0; engine_options[i].name; i++)
+    {
+        if (strcmp(option, engine_options[i].name)) continue;
+        switch (engine_options[i].type)
+        {
+            case OPT_NUM:
+            {
+                int64_t result;
+                pthread_mutex_lock(&self->e->engineLock);
+                result = cl_engine_get_num(self->e->engine, engine_options[i].id, &ret);
+                pthread_mutex_unlock(&self->e->engineLock);
+                if (ret != CL_SUCCESS)
+                {
+                    PyErr_PycFromClamav(self, getEngineOption::cl_engine_get_num, ret);
+                    return NULL;
+                }
+                return PyLong_FromLongLong(result);
+            }
+            case OPT_STR:
+            {
+                const char *result;
+                PyObject *value;
+                /* the string is owned by the engine */
+                pthread_mutex_lock(&self->e->engineLock);
+                result = cl_engine_get_str(self->e->engine, engine_options[i].id, &ret);
+                value = (ret == CL_SUCCESS) ? PyString_FromString(result ? result : "") : NULL;
+                pthread_mutex_unlock(&self->e->engineLock);
+                if (ret != CL_SUCCESS)
+                {
+                    PyErr_PycFromClamav(self, getEngineOption::cl_engine_get_str, ret);
+                    return NULL;
+                }
+                return value;
+            }
+            default:
+                PyErr_SetString(PyExc_TypeError, "getEngineOption: Internal Error");
+        }
+    }
+    PyErr_SetString(PyExc_TypeError, "getEngineOption: Invalid option");
+    return NULL;
+}
+
+static PyObject *pyc_Engine_setScanOption(pyc_Engine *self, PyObject *args)
+{
+    char *option = NULL;
+    PyObject *value = NULL;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "sO", &option, &value))
+    {
+        PyErr_SetString(PyExc_TypeError, "pyc_setScanOption: Invalid arguments");
+        return NULL;
+    }
+
+    if (!PyBool_Check(value))
+    {
+        PyErr_SetString(PyExc_TypeError, "pyc_setScanOption: A Boolean is needed as option value");
+        return NULL;
+    }
+
+
+    for (i = 0; scan_options[i].name; i++)
+    {
+        if (strcmp(option, scan_options[i].name)) continue;
+
+        pthread_mutex_lock(&self->e->engineLock);
+
+        if (PyObject_IsTrue(value))
+            self->e->options |= scan_options[i].id;
+        else
+            self->e->options &= ~scan_options[i].id;
+
+        pthread_mutex_unlock(&self->e->engineLock);
+        Py_RETURN_NONE;
+    }
+
+    PyErr_SetString(PyExc_TypeError, "setEngineOption: Invalid option");
+    return NULL;
+}
+
+/* Takes effect on the next load */
+static PyObject *pyc_Engine_setDBOption(pyc_Engine *self, PyObject *args)
+{
+    char *option = NULL;
+    PyObject *value = NULL;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "sO", &option, &value))
+    {
+        PyErr_SetString(PyExc_TypeError, "setDBOption: Invalid arguments");
+        return NULL;
+    }
+
+    if (!PyBool_Check(value))
+    {
+        PyErr_SetString(PyExc_TypeError, "setDBOption: A Boolean is needed as option value");
+        return NULL;
+    }
+
+    for (i = 0; db_options[i].name; i++)
+    {
+        if (strcmp(option, db_options[i].name)) continue;
+
+        pthread_mutex_lock(&self->e->engineLock);
+
+        if (PyObject_IsTrue(value))
+            self->e->dboptions |= db_options[i].id;
+        else
+            self->e->dboptions &= ~db_options[i].id;
+
+        pthread_mutex_unlock(&self->e->engineLock);
+        Py_RETURN_NONE;
+    }
+
+    PyErr_SetString(PyExc_TypeError, "setDBOption: Invalid option");
+    return NULL;
+}
+
+static PyObject *pyc_Engine_getDBOptions(pyc_Engine *self, PyObject *args)
+{
+    uint32_t dboptions;
+
+    pthread_mutex_lock(&self->e->engineLock);
+    dboptions = self->e->dboptions;
+    pthread_mutex_unlock(&self->e->engineLock);
+
+    return pyci_dbOptionsList(dboptions);
+}
+
+static PyObject *pyc_Engine_getScanOptions(pyc_Engine *self, PyObject *args)
+{
+    int i;
+    uint32_t options;
+    PyObject *list = PyList_New(0);
+
+    if (!list)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "pyc_getScanOptions: Cannot allocate memory for the List");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&self->e->engineLock);
+    options = self->e->options;
+    pthread_mutex_unlock(&self->e->engineLock);
+
+    for (i = 0; scan_options[i].name; i++)
+        if (options & scan_options[i].id)
+            PyList_Append(list, PyString_FromString(scan_options[i].name));
+
+    return list;
+}
+
+/* True scans, False skips, a number skips what's larger, in bytes */
+static int pyci_policySize(PyObject *value, int64_t *maxsize)
+{
+    if (PyBool_Check(value))
+        *maxsize = (value == Py_True) ? PYC_POLICY_SCAN : 0;
+    else if (PyInt_Check(value) || PyLong_Check(value))
+    {
+        if (((*maxsize = PyLong_AsLongLong(value)) < 0) || PyErr_Occurred())
+        {
+            PyErr_Clear();
+            return -1;
+        }
+    }
+    else
+        return -1;
+
+    return 0;
+}
+
+/* Skip objects by libclamav file type, before they're scanned or unpacked:
+   types maps names like CL_TYPE_ZIP (or just ZIP) to True, False or a size
+   limit, default applies to the others. hook(type, size) is called for the
+   objects the table lets through, size is -1 when unknown, a false result skips them. Without
+   arguments every object is scanned again */
+static PyObject *pyc_Engine_setScanPolicy(pyc_Engine *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "types", "default", "hook", NULL };
+    PyObject *types = Py_None, *fallback = Py_True, *hook = Py_None, *key, *value;
+    pyci_policy_t *policy = NULL;
+    pyci_prule_t *rule;
+    Py_ssize_t pos = 0, count = 0;
+    const char *type;
+    int64_t maxsize;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOO", kwlist, &types, &fallback, &hook) ||
+        ((types != Py_None) && !PyDict_Check(types)) ||
+        ((hook != Py_None) && !PyCallable_Check(hook)) ||
+        pyci_policySize(fallback, &maxsize))
+    {
+        PyErr_SetString(PyExc_TypeError, "setScanPolicy: Invalid arguments");
+        return NULL;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    /* the hook is called through PyGILState from libclamav threads */
+    if ((hook != Py_None) && (PyInterpreterState_Get() != PyInterpreterState_Main()))
+    {
+        PyErr_SetString(PycError(self), "setScanPolicy: A hook can only be set from the main interpreter");
+        return NULL;
+    }
+#endif
+
+    if (types != Py_None)
+        count = PyDict_Size(types);
+
+    /* nothing to apply, the callbacks stay idle */
+    if (!count && (maxsize == PYC_POLICY_SCAN) && (hook == Py_None))
+    {
+        pyci_policySet(self->e, NULL);
+        Py_RETURN_NONE;
+    }
+
+    if (!(policy = calloc(1, sizeof(pyci_policy_t) + (count * sizeof(pyci_prule_t)))))
+        return PyErr_NoMemory();
+
+    pthread_mutex_init(&policy->lock, NULL);
+    policy->refs = 1;
+    policy->fallback = maxsize;
+
+    while ((types != Py_None) && PyDict_Next(types, &pos, &key, &value))
+    {
+        rule = &policy->rules[policy->count];
+
+        if (!PyString_Check(key) || !(type = PyString_AsString(key)) || pyci_policySize(value, &rule->maxsize))
+            goto ssp_error;
+
+        if (strncmp(type, "CL_TYPE_", 8))
+            snprintf(rule->type, PYC_POLICY_TYPELEN, "CL_TYPE_%s", type);
+        else
+            snprintf(rule->type, PYC_POLICY_TYPELEN, "%s", type);
+
+        if (strlen(type) >= (PYC_POLICY_TYPELEN - 8))
+            goto ssp_error;
+
+        policy->count++;
+    }
+
+    if (hook != Py_None)
+    {
+        Py_INCREF(hook);
+        policy->hook = hook;
+    }
+
+    pyci_policySet(self->e, policy);
+    Py_RETURN_NONE;
+
+ ssp_error:
+    PyErr_SetString(PyExc_TypeError, "setScanPolicy: Types must map names to True, False or a size");
+    pyci_policyPut(policy);
+    return NULL;
+}
+
+/* Results are cached per engine, up to size entries, 0 disables the cache */
+static PyObject *pyc_Engine_setCacheSize(pyc_Engine *self, PyObject *args)
+{
+    int size = 0, ret;
+
+    if (!PyArg_ParseTuple(args, "i", &size) || (size < 0))
+    {
+        PyErr_SetString(PycError(self), "setCacheSize: Invalid arguments");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    ret = pyci_cacheResize(&self->e->cache, size);
+    pthread_mutex_lock(&self->e->engineLock);
+    self->e->cachesize = ret ? 0 : size;
+    pthread_mutex_unlock(&self->e->engineLock);
+    if (ret) pyci_cacheResize(&self->e->cache, 0);
+    Py_END_ALLOW_THREADS;
+
+    if (ret) return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
+
+/* Merges the shards, bytes are counted by libclamav in CL_COUNT_PRECISION
+   blocks, latency is a list of (upper bound in microseconds, count), the
+   last bucket has no upper bound */
+static PyObject *pyc_Engine_getStats(pyc_Engine *self, PyObject *args)
+{
+    pyci_engine_t *e = self->e;
+    pyci_shard_t total, *shard;
+    uint64_t loads, loaderrors, loadtime, loadlast, loadmax, selfchecks;
+    PyObject *latency, *value;
+    int i, j;
+
+    memset(&total, 0, sizeof(total));
+
+    for (i = 0; i < PYC_STATS_SHARDS; i++)
+    {
+        shard = &e->stats.shards[i];
+        pthread_mutex_lock(&shard->lock);
+        total.scans += shard->scans;
+        total.bytes += shard->bytes;
+        total.clean += shard->clean;
+        total.virus += shard->virus;
+        total.errors += shard->errors;
+        total.cached += shard->cached;
+        total.stopped += shard->stopped;
+        total.skipped += shard->skipped;
+        total.skippedbytes += shard->skippedbytes;
+        for (j = 0; j < PYC_STATS_BUCKETS; j++)
+            total.latency[j] += shard->latency[j];
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    pthread_mutex_lock(&e->engineLock);
+    loads = e->loads;
+    loaderrors = e->loaderrors;
+    loadtime = e->loadtime;
+    loadlast = e->loadlast;
+    loadmax = e->loadmax;
+    selfchecks = e->selfchecks;
+    pthread_mutex_unlock(&e->engineLock);
+
+    if (!(latency = PyList_New(PYC_STATS_BUCKETS)))
+        return NULL;
+
+    for (j = 0; j < PYC_STATS_BUCKETS; j++)
+    {
+        if (j < (PYC_STATS_BUCKETS - 1))
+            value = Py_BuildValue("(KK)", (unsigned PY_LONG_LONG) 2 << j, (unsigned PY_LONG_LONG) total.latency[j]);
+        else
+            value = Py_BuildValue("(OK)", Py_None, (unsigned PY_LONG_LONG) total.latency[j]);
+        if (!value)
+        {
+            Py_DECREF(latency);
+            return NULL;
+        }
+        PyList_SET_ITEM(latency, j, value);
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:N,s:K,s:K,s:d,s:d,s:d,s:K}",
+                         "scans",         (unsigned PY_LONG_LONG) total.scans,
+                         "bytes",         (unsigned PY_LONG_LONG) total.bytes,
+                         "clean",         (unsigned PY_LONG_LONG) total.clean,
+                         "virus",         (unsigned PY_LONG_LONG) total.virus,
+                         "errors",        (unsigned PY_LONG_LONG) total.errors,
+                         "cached",        (unsigned PY_LONG_LONG) total.cached,
+                         "stopped",       (unsigned PY_LONG_LONG) total.stopped,
+                         "skipped",       (unsigned PY_LONG_LONG) total.skipped,
+                         "skipped_bytes", (unsigned PY_LONG_LONG) total.skippedbytes,
+                         "latency",       latency,
+                         "reloads",       (unsigned PY_LONG_LONG) loads,
+                         "reload_errors", (unsigned PY_LONG_LONG) loaderrors,
+                         "reload_time",   loadtime / 1e6,
+                         "reload_last",   loadlast / 1e6,
+                         "reload_max",    loadmax / 1e6,
+                         "selfchecks",    (unsigned PY_LONG_LONG) selfchecks);
+}
+
+static PyObject *pyc_Engine_resetStats(pyc_Engine *self, PyObject *args)
+{
+    pyci_engine_t *e = self->e;
+    pyci_shard_t *shard;
+    int i;
+
+    for (i = 0; i < PYC_STATS_SHARDS; i++)
+    {
+        shard = &e->stats.shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->scans = shard->bytes = shard->clean = shard->virus = shard->errors = shard->cached = 0;
+        shard->stopped = shard->skipped = shard->skippedbytes = 0;
+        memset(shard->latency, 0, sizeof(shard->latency));
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    pthread_mutex_lock(&e->engineLock);
+    e->loads = e->loaderrors = e->loadtime = e->loadlast = e->loadmax = e->selfchecks = 0;
+    pthread_mutex_unlock(&e->engineLock);
+
+    Py_RETURN_NONE;
+}
+
+#ifdef _WIN32
+static PyObject *pyc_disableFsRedir(PyObject *self, PyObject *args)
+{
+    if (cw_disablefsredir())
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static PyObject *pyc_revertFsRedir(PyObject *self, PyObject *args)
+{
+    if (cw_revertfsredir())
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static PyObject *pyc_isWow64(PyObject *self, PyObject *args)
+{
+    if (cw_iswow64())
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+#endif
+
+/* Module level functions, they work on the default engine */
+#define PYC_DEFAULT(name) \
+    static PyObject *pyc_##name(PyObject *self, PyObject *args) \
+    { \
+        return pyc_Engine_##name(pyci_moduleState(self)->engine, args); \
+    }
+
+#define PYC_DEFAULT_KW(name) \
+    static PyObject *pyc_##name(PyObject *self, PyObject *args, PyObject *kwds) \
+    { \
+        return pyc_Engine_##name(pyci_moduleState(self)->engine, args, kwds); \
+    }
+
+PYC_DEFAULT(getVersions)
+PYC_DEFAULT_KW(checkAndLoadDB)
+PYC_DEFAULT(setDBPath)
+PYC_DEFAULT(getDBPath)
+#ifndef _WIN32
+PYC_DEFAULT(setDBCacheDir)
+PYC_DEFAULT(getDBCacheDir)
+#endif
+PYC_DEFAULT_KW(loadDB)
+PYC_DEFAULT(setDBTimer)
+PYC_DEFAULT(isLoaded)
+PYC_DEFAULT_KW(scanDesc)
+PYC_DEFAULT_KW(scanFile)
+PYC_DEFAULT_KW(scanBuffer)
+PYC_DEFAULT_KW(scanFiles)
+#ifndef _WIN32
+PYC_DEFAULT_KW(scanRange)
+PYC_DEFAULT_KW(scanRanges)
+PYC_DEFAULT_KW(scanDir)
+PYC_DEFAULT_KW(scanAsync)
+#endif
+PYC_DEFAULT(setEngineOption)
+PYC_DEFAULT(getEngineOption)
+PYC_DEFAULT(setScanOption)
+PYC_DEFAULT(getScanOptions)
+PYC_DEFAULT(setDBOption)
+PYC_DEFAULT(getDBOptions)
+PYC_DEFAULT_KW(setScanPolicy)
+PYC_DEFAULT(setCacheSize)
+PYC_DEFAULT(getStats)
+PYC_DEFAULT(resetStats)
+
+/* Finds the module state from the type, subclasses included */
+static pyc_State *pyci_typeState(PyTypeObject *type)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+    PyObject *module = PyType_GetModuleByDef(type, &pycModule);
+    return module ? pyci_moduleState(module) : NULL;
+#elif PY_MAJOR_VERSION >= 3
+    PyObject *module = NULL;
+
+    for (; type && !module; type = type->tp_base)
+    {
+        if (!(PyType_GetFlags(type) & Py_TPFLAGS_HEAPTYPE))
+            continue;
+        if (!(module = PyType_GetModule(type)))
+            PyErr_Clear();
+        else if (PyModule_GetDef(module) != &pycModule)
+            module = NULL;
+    }
+
+    if (!module)
+    {
+        PyErr_SetString(PyExc_TypeError, "Engine: Not a pyc.Engine type");
+        return NULL;
+    }
+    return pyci_moduleState(module);
+#else
+    return &pyci_state;
+#endif
+}
+
+static PyObject *pyc_Engine_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "dbpath", NULL };
+    char *dbpath = NULL;
+    pyc_Engine *self;
+    pyc_State *state;
+
+    if (!(state = pyci_typeState(type)))
+        return NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|s", kwlist, &dbpath))
+    {
+        PyErr_SetString(PyExc_TypeError, "Engine: Database path must be a String");
+        return NULL;
+    }
+
+    if (!(self = (pyc_Engine *) type->tp_alloc(type, 0)))
+        return NULL;
+    self->state = state;
+
+    if (!(self->e = pyci_engineNew(dbpath ? dbpath : cl_retdbdir())))
+    {
+        PyErr_SetString(PycError(self), "Engine: Can't initialize antivirus engine");
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject *) self;
+}
+
+static void pyc_Engine_dealloc(pyc_Engine *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+#if PY_MAJOR_VERSION >= 3
+    PyObject_GC_UnTrack(self);
+#endif
+    if (self->e)
+    {
+#ifndef _WIN32
+        pyci_watchStop(self->e);
+#endif
+        pyci_policySet(self->e, NULL);
+        pyci_engineRelease(self->e);
+    }
+    type->tp_free((PyObject *) self);
+#if PY_MAJOR_VERSION >= 3
+    Py_DECREF(type);                        /* instances of heap types own it */
+#endif
+}
+
+#if PY_MAJOR_VERSION >= 3
+static int pyc_Engine_traverse(pyc_Engine *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    return 0;
+}
+#endif
+
+/* Methods Table */
+static PyMethodDef pycEngineMethods[] =
+{
+    { "getVersions",        (PyCFunction) pyc_Engine_getVersions,     METH_NOARGS,  "Get clamav and database versions"        },
+    { "checkAndLoadDB",     (PyCFunction) pyc_Engine_checkAndLoadDB,  METH_VARARGS|METH_KEYWORDS, "Reload virus database if changed" },
+
+    { "setDBPath",          (PyCFunction) pyc_Engine_setDBPath,       METH_VARARGS, "Set path for virus database"             },
+    { "getDBPath",          (PyCFunction) pyc_Engine_getDBPath,       METH_NOARGS,  "Get path for virus database"             },
+#ifndef _WIN32
+    { "setDBCacheDir",      (PyCFunction) pyc_Engine_setDBCacheDir,   METH_VARARGS, "Set the unpacked database cache directory" },
+    { "getDBCacheDir",      (PyCFunction) pyc_Engine_getDBCacheDir,   METH_NOARGS,  "Get the unpacked database cache directory" },
+#endif
+
+    { "loadDB",             (PyCFunction) pyc_Engine_loadDB,          METH_VARARGS|METH_KEYWORDS, "Load a virus database, returns a load report" },
+    { "setDBTimer",         (PyCFunction) pyc_Engine_setDBTimer,      METH_VARARGS, "Set database check time"                 },
+
+    { "isLoaded",           (PyCFunction) pyc_Engine_isLoaded,        METH_NOARGS,  "Check if db is loaded or not"            },
+
+    { "scanDesc",           (PyCFunction) pyc_Engine_scanDesc,        METH_VARARGS|METH_KEYWORDS, "Scan a file descriptor" },
+    { "scanFile",           (PyCFunction) pyc_Engine_scanFile,        METH_VARARGS|METH_KEYWORDS, "Scan a file"            },
+    { "scanBuffer",         (PyCFunction) pyc_Engine_scanBuffer,      METH_VARARGS|METH_KEYWORDS, "Scan a memory buffer"   },
+    { "scanFiles",          (PyCFunction) pyc_Engine_scanFiles,       METH_VARARGS|METH_KEYWORDS, "Scan a list of files on native threads" },
+#ifndef _WIN32
+    { "scanRange",          (PyCFunction) pyc_Engine_scanRange,       METH_VARARGS|METH_KEYWORDS, "Scan a byte range of a file in place" },
+    { "scanRanges",         (PyCFunction) pyc_Engine_scanRanges,      METH_VARARGS|METH_KEYWORDS, "Scan byte ranges of a file on native threads" },
+    { "scanDir",            (PyCFunction) pyc_Engine_scanDir,         METH_VARARGS|METH_KEYWORDS, "Recursively scan a directory on native threads" },
+    { "scanAsync",          (PyCFunction) pyc_Engine_scanAsync,       METH_VARARGS|METH_KEYWORDS, "Scan on native threads, returns an event loop future" },
+#endif
+
+    { "setEngineOption",    (PyCFunction) pyc_Engine_setEngineOption, METH_VARARGS, "Set an engine option"                    },
+    { "getEngineOption",    (PyCFunction) pyc_Engine_getEngineOption, METH_VARARGS, "Get an engine option"                    },
+
+    { "setScanOption",      (PyCFunction) pyc_Engine_setScanOption,   METH_VARARGS, "Set a scan option"                       },
+    { "getScanOptions",     (PyCFunction) pyc_Engine_getScanOptions,  METH_NOARGS,  "Get the list of scan options"            },
+
+    { "setDBOption",        (PyCFunction) pyc_Engine_setDBOption,     METH_VARARGS, "Set a database option"                   },
+    { "getDBOptions",       (PyCFunction) pyc_Engine_getDBOptions,    METH_NOARGS,  "Get the list of database options"        },
+
+    { "setScanPolicy",      (PyCFunction) pyc_Engine_setScanPolicy,   METH_VARARGS|METH_KEYWORDS, "Skip objects by file type and size" },
+
+    { "setCacheSize",       (PyCFunction) pyc_Engine_setCacheSize,    METH_VARARGS, "Set the size of the scan result cache"   },
+
+    { "getStats",           (PyCFunction) pyc_Engine_getStats,        METH_NOARGS,  "Get scan and reload statistics"          },
+    { "resetStats",         (PyCFunction) pyc_Engine_resetStats,      METH_NOARGS,  "Reset scan and reload statistics"        },
+
+    { NULL, NULL, 0, NULL }
+};
+
+#if PY_MAJOR_VERSION >= 3
+static PyType_Slot pyc_EngineSlots[] =
+{
+    { Py_tp_doc,        (void *) "ClamAV engine with its own database, options and self-check timer" },
+    { Py_tp_new,        (void *) pyc_Engine_new },
+    { Py_tp_dealloc,    (void *) pyc_Engine_dealloc },
+    { Py_tp_traverse,   (void *) pyc_Engine_traverse },
+    { Py_tp_methods,    (void *) pycEngineMethods },
+    { 0, NULL }
+};
+
+static PyType_Spec pyc_EngineSpec =
+{
+    "pyc.Engine",                                   /* name */
+    sizeof(pyc_Engine),                             /* basicsize */
+    0,                                              /* itemsize */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /* flags */
+    pyc_EngineSlots                                 /* slots */
+};
+#else
+static PyTypeObject pyc_EngineType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pyc.Engine",                                   /* tp_name */
+    sizeof(pyc_Engine),                             /* tp_basicsize */
+    0,                                              /* tp_itemsize */
+    (destructor) pyc_Engine_dealloc,                /* tp_dealloc */
+    0,                                              /* tp_print */
+    0,                                              /* tp_getattr */
+    0,                                              /* tp_setattr */
+    0,                                              /* tp_compare */
+    0,                                              /* tp_repr */
+    0,                                              /* tp_as_number */
+    0,                                              /* tp_as_sequence */
+    0,                                              /* tp_as_mapping */
+    0,                                              /* tp_hash */
+    0,                                              /* tp_call */
+    0,                                              /* tp_str */
+    0,                                              /* tp_getattro */
+    0,                                              /* tp_setattro */
+    0,                                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,       /* tp_flags */
+    "ClamAV engine with its own database, options and self-check timer", /* tp_doc */
+    0,                                              /* tp_traverse */
+    0,                                              /* tp_clear */
+    0,                                              /* tp_richcompare */
+    0,                                              /* tp_weaklistoffset */
+    0,                                              /* tp_iter */
+    0,                                              /* tp_iternext */
+    pycEngineMethods,                               /* tp_methods */
+    0,                                              /* tp_members */
+    0,                                              /* tp_getset */
+    0,                                              /* tp_base */
+    0,                                              /* tp_dict */
+    0,                                              /* tp_descr_get */
+    0,                                              /* tp_descr_set */
+    0,                                              /* tp_dictoffset */
+    0,                                              /* tp_init */
+    0,                                              /* tp_alloc */
+    pyc_Engine_new,                                 /* tp_new */
+};
+#endif
+
+/* pyc.CancelToken, passed as cancel to the scan functions, cancel() stops
+   them from any thread */
+static PyObject *pyc_CancelToken_cancel(pyc_CancelToken *self, PyObject *args)
+{
+    self->cancelled = 1;
+    Py_RETURN_NONE;
+}
+
+static PyObject *pyc_CancelToken_isCancelled(pyc_CancelToken *self, PyObject *args)
+{
+    if (self->cancelled)
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static void pyc_CancelToken_dealloc(pyc_CancelToken *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    type->tp_free((PyObject *) self);
+#if PY_MAJOR_VERSION >= 3
+    Py_DECREF(type);
+#endif
+}
+
+static PyMethodDef pycCancelTokenMethods[] =
+{
+    { "cancel",             (PyCFunction) pyc_CancelToken_cancel,      METH_NOARGS,  "Stop the scans using this token"      },
+    { "isCancelled",        (PyCFunction) pyc_CancelToken_isCancelled, METH_NOARGS,  "Check if cancel() was called"         },
+    { NULL, NULL, 0, NULL }
+};
+
+#if PY_MAJOR_VERSION >= 3
+static PyType_Slot pyc_CancelTokenSlots[] =
+{
+    { Py_tp_doc,        (void *) "Cancellation token for scans" },
+    { Py_tp_new,        (void *) PyType_GenericNew },
+    { Py_tp_dealloc,    (void *) pyc_CancelToken_dealloc },
+    { Py_tp_methods,    (void *) pycCancelTokenMethods },
+    { 0, NULL }
+};
+
+static PyType_Spec pyc_CancelTokenSpec =
+{
+    "pyc.CancelToken",                              /* name */
+    sizeof(pyc_CancelToken),                        /* basicsize */
+    0,                                              /* itemsize */
+    Py_TPFLAGS_DEFAULT,                             /* flags */
+    pyc_CancelTokenSlots                            /* slots */
+};
+#else
+static PyTypeObject pyc_CancelTokenType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pyc.CancelToken",                              /* tp_name */
+    sizeof(pyc_CancelToken),                        /* tp_basicsize */
+    0,                                              /* tp_itemsize */
+    (destructor) pyc_CancelToken_dealloc,           /* tp_dealloc */
+    0,                                              /* tp_print */
+    0,                                              /* tp_getattr */
+    0,                                              /* tp_setattr */
+    0,                                              /* tp_compare */
+    0,                                              /* tp_repr */
+    0,                                              /* tp_as_number */
+    0,                                              /* tp_as_sequence */
+    0,                                              /* tp_as_mapping */
+    0,                                              /* tp_hash */
+    0,                                              /* tp_call */
+    0,                                              /* tp_str */
+    0,                                              /* tp_getattro */
+    0,                                              /* tp_setattro */
+    0,                                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                             /* tp_flags */
+    "Cancellation token for scans",                 /* tp_doc */
+    0,                                              /* tp_traverse */
+    0,                                              /* tp_clear */
+    0,                                              /* tp_richcompare */
+    0,                                              /* tp_weaklistoffset */
+    0,                                              /* tp_iter */
+    0,                                              /* tp_iternext */
+    pycCancelTokenMethods,                          /* tp_methods */
+    0,                                              /* tp_members */
+    0,                                              /* tp_getset */
+    0,                                              /* tp_base */
+    0,                                              /* tp_dict */
+    0,                                              /* tp_descr_get */
+    0,                                              /* tp_descr_set */
+    0,                                              /* tp_dictoffset */
+    0,                                              /* tp_init */
+    0,                                              /* tp_alloc */
+    PyType_GenericNew,                              /* tp_new */
+};
+#endif
+
+/* pyc.Stream, collects data arriving in chunks and scans it once in
+   finish(), up to spill bytes in memory and the rest in an anonymous file */
+#ifndef _WIN32
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+
+/* A memfd on linux, elsewhere or on older kernels an unlinked temporary file */
+static int pyci_anonFile(void)
+{
+    char path[MAX_PATH + 1];
+    const char *tmpdir;
+    int fd;
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+    if ((fd = syscall(SYS_memfd_create, "pyc-stream", MFD_CLOEXEC)) >= 0)
+        return fd;
+#endif
+
+    if (!(tmpdir = getenv("TMPDIR")) || !*tmpdir)
+        tmpdir = "/tmp";
+    snprintf(path, MAX_PATH, "%s/pyc-stream.XXXXXX", tmpdir);
+    path[MAX_PATH] = 0;
+
+    if ((fd = mkstemp(path)) < 0)
+        return -1;
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static int pyci_writeAll(int fd, const char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len)
+    {
+        if ((n = write(fd, data, len)) < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+#endif
+
+/* Called with the lock held or by the owner of a busy stream */
+static void pyci_streamDiscard(pyc_Stream *self)
+{
+    free(self->buf);
+    self->buf = NULL;
+    self->len = self->alloc = 0;
+#ifndef _WIN32
+    if (self->fd >= 0)
+    {
+        close(self->fd);
+        self->fd = -1;
+    }
+#endif
+    self->state = PYC_STREAM_CLOSED;
+}
+
+/* Marks the stream busy for the caller, a write() racing with finish()
+   on another thread fails instead of waiting for the scan */
+static int pyci_streamAcquire(pyc_Stream *self, const char *func)
+{
+    int state;
+
+    pthread_mutex_lock(&self->lock);
+    if ((state = self->state) == PYC_STREAM_OPEN)
+        self->state = PYC_STREAM_BUSY;
+    pthread_mutex_unlock(&self->lock);
+
+    if (state == PYC_STREAM_OPEN)
+        return 0;
+
+    PyErr_Format(PycError(self->engine), "%s: %s", func,
+                 (state == PYC_STREAM_BUSY) ? "Stream in use" : "Stream closed");
+    return -1;
+}
+
+static void pyci_streamRelease(pyc_Stream *self, int discard)
 {
-    char *option;
-    int ret, i;
+    pthread_mutex_lock(&self->lock);
+    if (discard)
+        pyci_streamDiscard(self);
+    else
+        self->state = PYC_STREAM_OPEN;
+    pthread_mutex_unlock(&self->lock);
+}
 
-    if (!PyArg_ParseTuple(args, "s", &option))
+/* Appends to the buffer, doubling it up to spill bytes, past that the
+   buffer is flushed to the file and everything else is written there */
+static int pyci_streamAppend(pyc_Stream *self, const char *data, size_t len)
+{
+    size_t alloc;
+    char *buf;
+#ifndef _WIN32
+    int ret, fd;
+
+    if ((self->fd < 0) && (self->len + len > self->spill))
     {
-        PyErr_SetString(PyExc_TypeError, "setEngineOption: Invalid arguments");
-        return NULL;
+        if ((fd = pyci_anonFile()) < 0)
+            return -1;
+        pthread_mutex_lock(&self->lock);
+        self->fd = fd;
+        pthread_mutex_unlock(&self->lock);
+        ret = pyci_writeAll(self->fd, self->buf, self->len);
+        free(self->buf);
+        self->buf = NULL;
+        self->len = self->alloc = 0;
+        if (ret < 0)
+            return -1;
     }
 
-    for (i = 0; engine_options[i].name; i++)
+    if (self->fd >= 0)
     {
-        if (strcmp(option, engine_options[i].name)) continue;
-        switch (engine_options[i].type)
+        Py_BEGIN_ALLOW_THREADS;
+        ret = pyci_writeAll(self->fd, data, len);
+        Py_END_ALLOW_THREADS;
+        return ret;
+    }
+#endif
+
+    if (self->len + len > self->alloc)
+    {
+        for (alloc = self->alloc ? self->alloc : 65536; alloc < self->len + len; alloc *= 2);
+        if (!(buf = realloc(self->buf, alloc)))
         {
-            case OPT_NUM:
-            {
-                int64_t result = cl_engine_get_num(pyci_engine, engine_options[i].id, &ret);
-                if (ret != CL_SUCCESS)
-                {
-                    PyErr_PycFromClamav(getEngineOption::cl_engine_get_num, ret);
-                    return NULL;
-                }
-                return PyLong_FromLongLong(result);
-            }
-            case OPT_STR:
-            {
-                const char *result = cl_engine_get_str(pyci_engine, engine_options[i].id, &ret);
-                if (ret != CL_SUCCESS)
-                {
-                    PyErr_PycFromClamav(getEngineOption::cl_engine_get_str, ret);
-                    return NULL;
-                }
-                return PyString_FromString(result ? result : "");
-            }
-            default:
-                PyErr_SetString(PyExc_TypeError, "getEngineOption: Internal Error");
+            errno = ENOMEM;
+            return -1;
         }
+        self->buf = buf;
+        self->alloc = alloc;
     }
-    PyErr_SetString(PyExc_TypeError, "getEngineOption: Invalid option");
-    return NULL;
+
+    memcpy(self->buf + self->len, data, len);
+    self->len += len;
+    return 0;
 }
 
-static PyObject *pyc_setScanOption(PyObject *self, PyObject *args)
+static PyObject *pyc_Stream_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    char *option = NULL;
-    PyObject *value = NULL;
-    int i;
+    static char *kwlist[] = { "engine", "spill", "maxsize", NULL };
+    PyObject *engine = Py_None, *maxsize = Py_None;
+    PY_LONG_LONG spill = PYC_STREAM_SPILL, bytes = 0;
+    pyc_Stream *self;
+    pyc_State *state;
 
-    if (!PyArg_ParseTuple(args, "sO", &option, &value))
+    if (!(state = pyci_typeState(type)))
+        return NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OLO", kwlist, &engine, &spill, &maxsize) ||
+        (spill < 0) ||
+        ((engine != Py_None) && !PyObject_TypeCheck(engine, state->engineType)) ||
+        ((maxsize != Py_None) && (!(PyInt_Check(maxsize) || PyLong_Check(maxsize)) ||
+                                  ((bytes = PyLong_AsLongLong(maxsize)) <= 0) || PyErr_Occurred())))
     {
-        PyErr_SetString(PyExc_TypeError, "pyc_setScanOption: Invalid arguments");
+        PyErr_Clear();
+        PyErr_SetString(PyExc_TypeError, "Stream: Invalid arguments");
         return NULL;
     }
 
-    if (!PyBool_Check(value))
+    if (!(self = (pyc_Stream *) type->tp_alloc(type, 0)))
+        return NULL;
+
+    self->engine = (engine != Py_None) ? (pyc_Engine *) engine : state->engine;
+    Py_INCREF(self->engine);
+    pthread_mutex_init(&self->lock, NULL);
+    self->state = PYC_STREAM_OPEN;
+    self->fd = -1;
+    self->spill = (uint64_t) spill;
+    self->maxsize = (uint64_t) bytes;
+    return (PyObject *) self;
+}
+
+/* Going past maxsize throws away what was written, the caller can stop
+   receiving right away */
+static PyObject *pyc_Stream_write(pyc_Stream *self, PyObject *args)
+{
+    PyObject *result = NULL;
+    Py_buffer view;
+    uint64_t size;
+
+    if (!PyArg_ParseTuple(args, PYC_BUFFER, &view))
     {
-        PyErr_SetString(PyExc_TypeError, "pyc_setScanOption: A Boolean is needed as option value");
+        PyErr_SetString(PyExc_TypeError, "write: An object supporting the buffer interface is needed");
         return NULL;
     }
 
+    if (pyci_streamAcquire(self, "write"))
+        goto sw_cleanup;
 
-    for (i = 0; scan_options[i].name; i++)
+    if (self->maxsize && (self->size + view.len > self->maxsize))
     {
-        if (strcmp(option, scan_options[i].name)) continue;
+        PyErr_SetString(PycError(self->engine), "write: Stream larger than maxsize");
+        pyci_streamRelease(self, 1);
+        goto sw_cleanup;
+    }
 
-        gstate = PyGILState_Ensure();
+    if (pyci_streamAppend(self, view.buf, view.len) < 0)
+    {
+        PyErr_PycFromErrno(self->engine, write);
+        pyci_streamRelease(self, 1);
+        goto sw_cleanup;
+    }
 
-        if (PyObject_IsTrue(value))
-            pyci_options |= scan_options[i].id;
-        else
-            pyci_options &= ~scan_options[i].id;
+    pthread_mutex_lock(&self->lock);
+    size = self->size += view.len;
+    pthread_mutex_unlock(&self->lock);
+    result = PyLong_FromUnsignedLongLong(size);
+    pyci_streamRelease(self, 0);
 
-        PyGILState_Release(gstate);
-        Py_RETURN_NONE;
+ sw_cleanup:
+    PyBuffer_Release(&view);
+    return result;
+}
+
+/* Scans what was written with the GIL released and closes the stream,
+   limits work as in scanBuffer() */
+static PyObject *pyc_Stream_finish(pyc_Stream *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = { "timeout", "maxbytes", "cancel", NULL };
+    PyObject *timeout = Py_None, *maxbytes = Py_None, *cancel = Py_None;
+    pyc_Engine *engine = self->engine;
+    const char *virname = NULL;
+    char *cached = NULL;
+    PyObject *result = NULL;
+    pyci_limits_t limits;
+    pyci_scanctx_t ctx;
+    int ret;
+
+    pyci_engineCheck(engine, finish);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOO", kwlist, &timeout, &maxbytes, &cancel) ||
+        pyci_limitsParse(engine, timeout, maxbytes, cancel, &limits))
+    {
+        PyErr_SetString(PyExc_TypeError, "finish: Invalid limits");
+        return NULL;
     }
 
-    PyErr_SetString(PyExc_TypeError, "setEngineOption: Invalid option");
-    return NULL;
+    if (pyci_streamAcquire(self, "finish"))
+        return NULL;
+
+    if ((ret = pyci_checkAndLoadDB(engine->e, 0, 0)))
+    {
+        PyErr_PycFromClamav(engine, finish, ret);
+        pyci_streamRelease(self, 0);
+        return NULL;
+    }
+
+    pyci_engineGet(engine->e, &ctx);
+    ctx.limits = &limits;
+
+    Py_BEGIN_ALLOW_THREADS;
+#ifndef _WIN32
+    if (self->fd >= 0)
+        ret = pyci_scanCached(&ctx, self->fd, &virname, &cached);
+    else
+#endif
+        ret = pyci_scanMemory(&ctx, self->buf, self->len, 1, &virname, &cached);
+    Py_END_ALLOW_THREADS;
+
+    if (!(result = pyci_scanResult(ret, virname)))
+        PyErr_PycFromClamav(engine, finish, ret);
+
+    pyci_contextPut(&ctx);
+    free(cached);
+    pyci_streamRelease(self, 1);
+    return result;
 }
 
-static PyObject *pyc_getScanOptions(PyObject *self, PyObject *args)
+/* Closing twice is fine, closing during finish() is not */
+static PyObject *pyc_Stream_close(pyc_Stream *self, PyObject *args)
 {
-    int i;
-    PyObject *list = PyList_New(0);
+    int busy;
 
-    if (!list)
+    pthread_mutex_lock(&self->lock);
+    if (!(busy = (self->state == PYC_STREAM_BUSY)))
+        pyci_streamDiscard(self);
+    pthread_mutex_unlock(&self->lock);
+
+    if (busy)
     {
-        PyErr_SetString(PyExc_RuntimeError, "pyc_getScanOptions: Cannot allocate memory for the List");
+        PyErr_SetString(PycError(self->engine), "close: Stream in use");
         return NULL;
     }
+    Py_RETURN_NONE;
+}
 
-    for (i = 0; scan_options[i].name; i++)
-        if (pyci_options & scan_options[i].id)
-            PyList_Append(list, PyString_FromString(scan_options[i].name));
+/* The owner of a busy stream may be writing on another thread */
+static PyObject *pyc_Stream_getSize(pyc_Stream *self, void *closure)
+{
+    uint64_t size;
 
-    return list;
+    pthread_mutex_lock(&self->lock);
+    size = self->size;
+    pthread_mutex_unlock(&self->lock);
+    return PyLong_FromUnsignedLongLong(size);
 }
 
-#ifdef _WIN32
-static PyObject *pyc_disableFsRedir(PyObject *self, PyObject *args)
+static PyObject *pyc_Stream_getSpilled(pyc_Stream *self, void *closure)
 {
-    if (cw_disablefsredir())
+    int spilled;
+
+    pthread_mutex_lock(&self->lock);
+    spilled = (self->fd >= 0);
+    pthread_mutex_unlock(&self->lock);
+
+    if (spilled)
         Py_RETURN_TRUE;
     else
         Py_RETURN_FALSE;
 }
 
-static PyObject *pyc_revertFsRedir(PyObject *self, PyObject *args)
+static PyObject *pyc_Stream_getClosed(pyc_Stream *self, void *closure)
 {
-    if (cw_revertfsredir())
+    int closed;
+
+    pthread_mutex_lock(&self->lock);
+    closed = (self->state == PYC_STREAM_CLOSED);
+    pthread_mutex_unlock(&self->lock);
+
+    if (closed)
         Py_RETURN_TRUE;
     else
         Py_RETURN_FALSE;
 }
 
-static PyObject *pyc_isWow64(PyObject *self, PyObject *args)
+static void pyc_Stream_dealloc(pyc_Stream *self)
 {
-    if (cw_iswow64())
-        Py_RETURN_TRUE;
-    else
-        Py_RETURN_FALSE;
+    PyTypeObject *type = Py_TYPE(self);
+
+    pyci_streamDiscard(self);
+    pthread_mutex_destroy(&self->lock);
+    Py_XDECREF(self->engine);
+    type->tp_free((PyObject *) self);
+#if PY_MAJOR_VERSION >= 3
+    Py_DECREF(type);
+#endif
+}
+
+static PyMethodDef pycStreamMethods[] =
+{
+    { "write",              (PyCFunction) pyc_Stream_write,           METH_VARARGS, "Append a chunk, returns the size so far" },
+    { "finish",             (PyCFunction) pyc_Stream_finish,          METH_VARARGS|METH_KEYWORDS, "Scan the data and close the stream" },
+    { "close",              (PyCFunction) pyc_Stream_close,           METH_NOARGS,  "Discard the data without scanning"      },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef pycStreamGetSet[] =
+{
+    { "size",               (getter) pyc_Stream_getSize,    NULL, "Bytes written so far",                  NULL },
+    { "spilled",            (getter) pyc_Stream_getSpilled, NULL, "True once the data moved to a file",    NULL },
+    { "closed",             (getter) pyc_Stream_getClosed,  NULL, "True after finish() or close()",        NULL },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+#if PY_MAJOR_VERSION >= 3
+static PyType_Slot pyc_StreamSlots[] =
+{
+    { Py_tp_doc,        (void *) "Incremental scan of data written in chunks" },
+    { Py_tp_new,        (void *) pyc_Stream_new },
+    { Py_tp_dealloc,    (void *) pyc_Stream_dealloc },
+    { Py_tp_methods,    (void *) pycStreamMethods },
+    { Py_tp_getset,     (void *) pycStreamGetSet },
+    { 0, NULL }
+};
+
+static PyType_Spec pyc_StreamSpec =
+{
+    "pyc.Stream",                                   /* name */
+    sizeof(pyc_Stream),                             /* basicsize */
+    0,                                              /* itemsize */
+    Py_TPFLAGS_DEFAULT,                             /* flags */
+    pyc_StreamSlots                                 /* slots */
+};
+#else
+static PyTypeObject pyc_StreamType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "pyc.Stream",                                   /* tp_name */
+    sizeof(pyc_Stream),                             /* tp_basicsize */
+    0,                                              /* tp_itemsize */
+    (destructor) pyc_Stream_dealloc,                /* tp_dealloc */
+    0,                                              /* tp_print */
+    0,                                              /* tp_getattr */
+    0,                                              /* tp_setattr */
+    0,                                              /* tp_compare */
+    0,                                              /* tp_repr */
+    0,                                              /* tp_as_number */
+    0,                                              /* tp_as_sequence */
+    0,                                              /* tp_as_mapping */
+    0,                                              /* tp_hash */
+    0,                                              /* tp_call */
+    0,                                              /* tp_str */
+    0,                                              /* tp_getattro */
+    0,                                              /* tp_setattro */
+    0,                                              /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                             /* tp_flags */
+    "Incremental scan of data written in chunks",   /* tp_doc */
+    0,                                              /* tp_traverse */
+    0,                                              /* tp_clear */
+    0,                                              /* tp_richcompare */
+    0,                                              /* tp_weaklistoffset */
+    0,                                              /* tp_iter */
+    0,                                              /* tp_iternext */
+    pycStreamMethods,                               /* tp_methods */
+    0,                                              /* tp_members */
+    pycStreamGetSet,                                /* tp_getset */
+    0,                                              /* tp_base */
+    0,                                              /* tp_dict */
+    0,                                              /* tp_descr_get */
+    0,                                              /* tp_descr_set */
+    0,                                              /* tp_dictoffset */
+    0,                                              /* tp_init */
+    0,                                              /* tp_alloc */
+    pyc_Stream_new,                                 /* tp_new */
+};
+#endif
+
+/* Known answer tests for the SHA-256 keying the result cache and the
+   CVD unpacker of the database cache */
+static int pyci_selfTestSha256(void)
+{
+    static const struct
+    {
+        const char *data;
+        size_t repeat;
+        const char *digest;
+    } vectors[] =
+    {
+        { "",    1,    "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+        { "abc", 1,    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+                       "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+        { NULL,    1000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" }
+    };
+    unsigned char chunk[1000], digest[32];
+    char hex[65];
+    pyci_sha256_t ctx;
+    size_t i, j;
+
+    /* a million 'a', fed in chunks to cross the block boundaries */
+    memset(chunk, 'a', sizeof(chunk));
+
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++)
+    {
+        pyci_sha256Init(&ctx);
+        for (j = 0; j < vectors[i].repeat; j++)
+        {
+            if (vectors[i].data)
+                pyci_sha256Update(&ctx, vectors[i].data, strlen(vectors[i].data));
+            else
+                pyci_sha256Update(&ctx, chunk, sizeof(chunk));
+        }
+        pyci_sha256Final(&ctx, digest);
+
+        for (j = 0; j < sizeof(digest); j++)
+            sprintf(hex + j * 2, "%02x", digest[j]);
+        if (strcmp(hex, vectors[i].digest))
+            return -1;
+    }
+    return 0;
+}
+
+#ifndef _WIN32
+/* Writes a CVD header and a tar of the given members, compressed or not */
+static int pyci_selfTestCvd(const char *path, const char *const *members, int compress)
+{
+    unsigned char header[PYC_TAR_BLOCK];
+    size_t len, padded;
+    int fd, ret = -1;
+    gzFile gz = NULL;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0600)) < 0)
+        return -1;
+
+    memset(header, 0, sizeof(header));
+    snprintf((char *) header, sizeof(header), "ClamAV-VDB:01 Jan 2000 00-00 +0000:1:%d:0:x:x:pyc:0",
+             compress ? 1 : 2);
+    if (pyci_writeAll(fd, (const char *) header, sizeof(header)))
+        goto cleanup;
+
+    if (compress)
+    {
+        if (!(gz = gzdopen(fd, "wb")))
+            goto cleanup;
+        fd = -1;
+    }
+
+    for (; *members; members += 2)
+    {
+        len = strlen(members[1]);
+        padded = (len + PYC_TAR_BLOCK - 1) & ~((size_t) PYC_TAR_BLOCK - 1);
+
+        memset(header, 0, sizeof(header));
+        strncpy((char *) header, members[0], 100);
+        snprintf((char *) header + 124, 12, "%011o", (unsigned int) len);
+        header[156] = '0';
+
+        if (gz ? (gzwrite(gz, header, sizeof(header)) != sizeof(header)) ||
+                 (len && (gzwrite(gz, members[1], len) != (int) len))
+               : (pyci_writeAll(fd, (const char *) header, sizeof(header)) ||
+                  pyci_writeAll(fd, members[1], len)))
+            goto cleanup;
+
+        memset(header, 0, sizeof(header));
+        if (gz ? (padded > len) && (gzwrite(gz, header, padded - len) != (int) (padded - len))
+               : pyci_writeAll(fd, (const char *) header, padded - len))
+            goto cleanup;
+    }
+
+    /* two zero blocks end the archive */
+    memset(header, 0, sizeof(header));
+    if (gz ? (gzwrite(gz, header, sizeof(header)) != sizeof(header)) ||
+             (gzwrite(gz, header, sizeof(header)) != sizeof(header))
+           : pyci_writeAll(fd, (const char *) header, sizeof(header)) ||
+             pyci_writeAll(fd, (const char *) header, sizeof(header)))
+        goto cleanup;
+    ret = 0;
+
+ cleanup:
+    if (gz && (gzclose(gz) != Z_OK))
+        ret = -1;
+    if ((fd >= 0) && close(fd))
+        ret = -1;
+    return ret;
+}
+
+/* Compares a file with the expected contents */
+static int pyci_selfTestFile(const char *dir, const char *name, const char *data)
+{
+    char path[MAX_PATH + 1], buffer[256];
+    size_t len = strlen(data);
+    ssize_t n;
+    int fd;
+
+    if ((snprintf(path, MAX_PATH, "%s/%s", dir, name) >= MAX_PATH) || ((fd = open(path, O_RDONLY | O_BINARY)) < 0))
+        return -1;
+    n = read(fd, buffer, sizeof(buffer));
+    close(fd);
+    return ((n == (ssize_t) len) && !memcmp(buffer, data, len)) ? 0 : -1;
+}
+
+static int pyci_selfTestUnpack(void)
+{
+    static const char *const good[] =
+    {
+        "test.ndb", "Pyc.Test:0:*:707963\n",
+        "test.info", "ClamAV-VDB:01 Jan 2000 00-00 +0000:1:1:0:x:x:pyc:0\n",
+        NULL
+    };
+    static const char *const evil[] = { "../escaped", "x\n", NULL };
+    char base[MAX_PATH + 1], file[MAX_PATH + 1], dir[MAX_PATH + 1];
+    const char *tmpdir;
+    int compress, failed, ret = -1, fd;
+
+    if (!(tmpdir = getenv("TMPDIR")) || !*tmpdir)
+        tmpdir = "/tmp";
+    if ((snprintf(base, MAX_PATH, "%s/pyc-selftest.XXXXXX", tmpdir) >= MAX_PATH) || !mkdtemp(base))
+        return -1;
+
+    /* a plain CLD and a compressed CVD */
+    for (compress = 0; compress < 2; compress++)
+    {
+        snprintf(file, MAX_PATH, "%s/test%d.cvd", base, compress);
+        snprintf(dir, MAX_PATH, "%s/test%d", base, compress);
+        if (pyci_selfTestCvd(file, good, compress) || mkdir(dir, 0700) ||
+            (pyci_cvdUnpack(file, dir) != CL_SUCCESS) ||
+            pyci_selfTestFile(dir, good[0], good[1]) || pyci_selfTestFile(dir, good[2], good[3]) ||
+            (pyci_dbcacheVerify(dir) != CL_SUCCESS))
+            goto cleanup;
+
+        /* a file changed after unpacking must not verify */
+        snprintf(file, MAX_PATH, "%s/%s", dir, good[0]);
+        if ((fd = open(file, O_WRONLY | O_APPEND | O_BINARY)) < 0)
+            goto cleanup;
+        failed = pyci_writeAll(fd, "x", 1);
+        close(fd);
+        if (failed || (pyci_dbcacheVerify(dir) == CL_SUCCESS))
+            goto cleanup;
+    }
+
+    /* members must not leave the directory */
+    snprintf(file, MAX_PATH, "%s/evil.cvd", base);
+    snprintf(dir, MAX_PATH, "%s/evil", base);
+    if (pyci_selfTestCvd(file, evil, 1) || mkdir(dir, 0700) || (pyci_cvdUnpack(file, dir) == CL_SUCCESS))
+        goto cleanup;
+    snprintf(file, MAX_PATH, "%s/escaped", base);
+    if (!access(file, F_OK))
+        goto cleanup;
+    ret = 0;
+
+ cleanup:
+    for (compress = 0; compress < 2; compress++)
+    {
+        snprintf(dir, MAX_PATH, "%s/test%d", base, compress);
+        pyci_rmdir(dir);
+    }
+    snprintf(dir, MAX_PATH, "%s/evil", base);
+    pyci_rmdir(dir);
+    pyci_rmdir(base);
+    return ret;
 }
 #endif
 
-/* Methods Table */
+static PyObject *pyc__selfTest(PyObject *self, PyObject *args)
+{
+    pyc_State *state = pyci_moduleState(self);
+
+    if (pyci_selfTestSha256())
+    {
+        PyErr_SetString(state->error, "_selfTest: SHA-256 failed");
+        return NULL;
+    }
+
+#ifndef _WIN32
+    if (pyci_selfTestUnpack())
+    {
+        PyErr_SetString(state->error, "_selfTest: CVD unpack failed");
+        return NULL;
+    }
+#endif
+    Py_RETURN_NONE;
+}
+
 static PyMethodDef pycMethods[] =
 {
     { "getVersions",        pyc_getVersions,        METH_NOARGS,  "Get clamav and database versions"        },
-    { "checkAndLoadDB",     pyc_checkAndLoadDB,     METH_NOARGS,  "Reload virus database if changed"        },
+    { "_selfTest",          pyc__selfTest,          METH_NOARGS,  "Run the known answer tests"              },
+    { "checkAndLoadDB",     (PyCFunction) pyc_checkAndLoadDB, METH_VARARGS|METH_KEYWORDS, "Reload virus database if changed" },
 
     { "setDBPath",          pyc_setDBPath,          METH_VARARGS, "Set path for virus database"             },
     { "getDBPath",          pyc_getDBPath,          METH_NOARGS, "Get path for virus database"             },
+#ifndef _WIN32
+    { "setDBCacheDir",      pyc_setDBCacheDir,      METH_VARARGS, "Set the unpacked database cache directory" },
+    { "getDBCacheDir",      pyc_getDBCacheDir,      METH_NOARGS,  "Get the unpacked database cache directory" },
+#endif
 
-    { "loadDB",             pyc_loadDB,             METH_VARARGS|METH_KEYWORDS, "Load a virus database"     },
+    { "loadDB",             (PyCFunction) pyc_loadDB, METH_VARARGS|METH_KEYWORDS, "Load a virus database, returns a load report" },
     { "setDBTimer",         pyc_setDBTimer,         METH_VARARGS, "Set database check time"                 },
 
     { "isLoaded",           pyc_isLoaded,           METH_NOARGS,  "Check if db is loaded or not"            },
 
-    { "scanDesc",           pyc_scanDesc,           METH_VARARGS, "Scan a file descriptor"                  },
-    { "scanFile",           pyc_scanFile,           METH_VARARGS, "Scan a file"                             },
+    { "scanDesc",           (PyCFunction) pyc_scanDesc, METH_VARARGS|METH_KEYWORDS, "Scan a file descriptor" },
+    { "scanFile",           (PyCFunction) pyc_scanFile, METH_VARARGS|METH_KEYWORDS, "Scan a file"            },
+    { "scanBuffer",         (PyCFunction) pyc_scanBuffer, METH_VARARGS|METH_KEYWORDS, "Scan a memory buffer" },
+    { "scanFiles",          (PyCFunction) pyc_scanFiles, METH_VARARGS|METH_KEYWORDS, "Scan a list of files on native threads" },
+#ifndef _WIN32
+    { "scanRange",          (PyCFunction) pyc_scanRange, METH_VARARGS|METH_KEYWORDS, "Scan a byte range of a file in place" },
+    { "scanRanges",         (PyCFunction) pyc_scanRanges, METH_VARARGS|METH_KEYWORDS, "Scan byte ranges of a file on native threads" },
+    { "scanDir",            (PyCFunction) pyc_scanDir, METH_VARARGS|METH_KEYWORDS, "Recursively scan a directory on native threads" },
+    { "scanAsync",          (PyCFunction) pyc_scanAsync, METH_VARARGS|METH_KEYWORDS, "Scan on native threads, returns an event loop future" },
+#endif
 
     { "setDebug",           pyc_setDebug,           METH_NOARGS,  "Enable libclamav debug messages"         },
 
@@ -822,6 +6436,16 @@ static PyMethodDef pycMethods[] =
     { "setScanOption",      pyc_setScanOption,      METH_VARARGS, "Set a scan option"                       },
     { "getScanOptions",     pyc_getScanOptions,     METH_NOARGS,  "Get the list of scan options"            },
 
+    { "setDBOption",        pyc_setDBOption,        METH_VARARGS, "Set a database option"                   },
+    { "getDBOptions",       pyc_getDBOptions,       METH_NOARGS,  "Get the list of database options"        },
+
+    { "setScanPolicy",      (PyCFunction) pyc_setScanPolicy, METH_VARARGS|METH_KEYWORDS, "Skip objects by file type and size" },
+
+    { "setCacheSize",       pyc_setCacheSize,       METH_VARARGS, "Set the size of the scan result cache"   },
+
+    { "getStats",           pyc_getStats,           METH_NOARGS,  "Get scan and reload statistics"          },
+    { "resetStats",         pyc_resetStats,         METH_NOARGS,  "Reset scan and reload statistics"        },
+
 #ifdef _WIN32
     { "disableFsRedir",     pyc_disableFsRedir,     METH_NOARGS,  "Disable Win64 fs redirection"            },
     { "revertFsRedir",      pyc_revertFsRedir,      METH_NOARGS,  "Revert (Enable) Win64 fs redirection"    },
@@ -830,28 +6454,172 @@ static PyMethodDef pycMethods[] =
     { NULL, NULL, 0, NULL }
 };
 
-PyMODINIT_FUNC
-initpyc(void)
+/* Process wide, whatever the number of interpreters importing us */
+static pthread_once_t pyci_once = PTHREAD_ONCE_INIT;
+
+static void pyci_init(void)
 {
     int ret;
-    PyObject *m = Py_InitModule("pyc", pycMethods);
-
-    PycError = PyErr_NewException("pyc.PycError", NULL, NULL);
-    PyModule_AddObject(m, "PycError", PycError);
-
-    PyModule_AddStringConstant(m, "__version__", PYC_VERSION);
-    PyModule_AddIntConstant(m, "SELFCHECK_NEVER", PYC_SELFCHECK_NEVER);
-    PyModule_AddIntConstant(m, "SELFCHECK_ALWAYS", PYC_SELFCHECK_ALWAYS);
 
     /* argh no way to bail out from here? */
     if ((ret = cl_init(CL_INIT_DEFAULT)))
         fprintf(stderr, "Can't initialize libclamav: %s\n", cl_strerror(ret));
 
-    if (!(pyci_engine = cl_engine_new()))
-        fprintf(stderr, "Can't initialize antivirus engine");
+#ifndef _WIN32
+    pthread_atfork(pyci_forkPrepare, pyci_forkParent, pyci_forkChild);
+#endif
+}
+
+/* Runs once per interpreter on python 3, on failure what's already in the
+   state is released with the module */
+static int pyci_exec(PyObject *m)
+{
+    pyc_State *state = pyci_moduleState(m);
+
+    pthread_once(&pyci_once, pyci_init);
+
+    if (!(state->error = PyErr_NewException("pyc.PycError", NULL, NULL)))
+        return -1;
+    Py_INCREF(state->error);
+    if (PyModule_AddObject(m, "PycError", state->error) < 0)
+    {
+        Py_DECREF(state->error);
+        return -1;
+    }
+
+    if ((PyModule_AddStringConstant(m, "__version__", PYC_VERSION) < 0) ||
+        (PyModule_AddIntConstant(m, "SELFCHECK_NEVER", PYC_SELFCHECK_NEVER) < 0) ||
+        (PyModule_AddIntConstant(m, "SELFCHECK_ALWAYS", PYC_SELFCHECK_ALWAYS) < 0))
+        return -1;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!(state->engineType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &pyc_EngineSpec, NULL)))
+        return -1;
+#else
+    if (PyType_Ready(&pyc_EngineType) < 0)
+        return -1;
+    state->engineType = &pyc_EngineType;
+    Py_INCREF(state->engineType);
+#endif
+    Py_INCREF(state->engineType);
+    if (PyModule_AddObject(m, "Engine", (PyObject *) state->engineType) < 0)
+    {
+        Py_DECREF(state->engineType);
+        return -1;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    if (!(state->cancelType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &pyc_CancelTokenSpec, NULL)))
+        return -1;
+#else
+    if (PyType_Ready(&pyc_CancelTokenType) < 0)
+        return -1;
+    state->cancelType = &pyc_CancelTokenType;
+    Py_INCREF(state->cancelType);
+#endif
+    Py_INCREF(state->cancelType);
+    if (PyModule_AddObject(m, "CancelToken", (PyObject *) state->cancelType) < 0)
+    {
+        Py_DECREF(state->cancelType);
+        return -1;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    if (!(state->streamType = (PyTypeObject *) PyType_FromModuleAndSpec(m, &pyc_StreamSpec, NULL)))
+        return -1;
+#else
+    if (PyType_Ready(&pyc_StreamType) < 0)
+        return -1;
+    state->streamType = &pyc_StreamType;
+    Py_INCREF(state->streamType);
+#endif
+    Py_INCREF(state->streamType);
+    if (PyModule_AddObject(m, "Stream", (PyObject *) state->streamType) < 0)
+    {
+        Py_DECREF(state->streamType);
+        return -1;
+    }
+
+    if (!(state->aqueues = PyDict_New()))
+        return -1;
+
+    if (!(state->engine = (pyc_Engine *) PyObject_CallObject((PyObject *) state->engineType, NULL)))
+        return -1;
+
+    return 0;
+}
+
+#if PY_MAJOR_VERSION >= 3
+static int pyci_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    pyc_State *state = pyci_moduleState(m);
+
+    Py_VISIT(state->error);
+    Py_VISIT(state->engineType);
+    Py_VISIT(state->cancelType);
+    Py_VISIT(state->streamType);
+    Py_VISIT(state->engine);
+    Py_VISIT(state->aqueues);
+    return 0;
+}
+
+static int pyci_clear(PyObject *m)
+{
+    pyc_State *state = pyci_moduleState(m);
+
+    Py_CLEAR(state->error);
+    Py_CLEAR(state->engineType);
+    Py_CLEAR(state->cancelType);
+    Py_CLEAR(state->streamType);
+    Py_CLEAR(state->engine);
+    Py_CLEAR(state->aqueues);
+    return 0;
+}
+
+static void pyci_free(void *m)
+{
+    pyci_clear((PyObject *) m);
+}
+
+/* Nothing in the module relies on the GIL: engine state is guarded by its
+   own locks and the Python objects are per interpreter */
+static PyModuleDef_Slot pycSlots[] =
+{
+    { Py_mod_exec,      (void *) pyci_exec },
+#ifdef Py_mod_multiple_interpreters
+    { Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+#ifdef Py_mod_gil
+    { Py_mod_gil,       Py_MOD_GIL_NOT_USED },
+#endif
+    { 0, NULL }
+};
 
-    strncat(pyci_dbpath, cl_retdbdir(), MAX_PATH);
-    pyci_dbpath[MAX_PATH] = 0;
+static struct PyModuleDef pycModule =
+{
+    PyModuleDef_HEAD_INIT,
+    "pyc",                                          /* m_name */
+    PYC_VERSION,                                    /* m_doc */
+    sizeof(pyc_State),                              /* m_size */
+    pycMethods,                                     /* m_methods */
+    pycSlots,                                       /* m_slots */
+    pyci_traverse,                                  /* m_traverse */
+    pyci_clear,                                     /* m_clear */
+    pyci_free                                       /* m_free */
+};
+
+PyMODINIT_FUNC
+PyInit_pyc(void)
+{
+    return PyModuleDef_Init(&pycModule);
+}
+#else
+PyMODINIT_FUNC
+initpyc(void)
+{
+    PyObject *m = Py_InitModule("pyc", pycMethods);
 
-    Py_AtExit(pyci_cleanup);
+    if (m && !pyci_exec(m))
+        Py_AtExit(pyci_cleanup);
 }
+#endif
@@ -0,0 +1,12 @@
+#!/usr/bin/env python
+# Known answer tests for the SHA-256 and the database cache unpacker,
+# exits with 1 on failure
+import sys
+import pyc
+
+try:
+    pyc._selfTest()
+except pyc.PycError as e:
+    print(e)
+    sys.exit(1)
+print('ok')
@@ -5,7 +5,7 @@ from os import environ
 
 CFLAGS = [ '-Wall', '-O2', '-fno-strict-aliasing' ]
 LDFLAGS = [ '-L.' ]
-LIBS = [ 'clamav' ]
+LIBS = [ 'clamav', 'pthread' ]
 CLINCLUDE = [ '.' ]
 CLLIB = []
 
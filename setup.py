@@ -1,5 +1,8 @@
 #!/usr/bin/env python
-from distutils.core import setup, Extension
+try:
+    from setuptools import setup, Extension
+except ImportError:
+    from distutils.core import setup, Extension
 from sys import platform
 from os import environ
 
@@ -17,12 +20,14 @@ if platform == 'win32':
     else:
         LIBFILE = 'contrib/msvc/Release/Win32/libclamav.lib'
         CFLAGS.append('-MD')
-    CLINCLUDE = ['/'.join([CLAMAVDEVROOT, 'libclamav'])]
-    CLLIB = ['/'.join([CLAMAVDEVROOT, '', LIBFILE])]
+    CLINCLUDE = ['/'.join([CLAMAVDEVROOT, 'libclamav']),
+                 '/'.join([CLAMAVDEVROOT, 'win32/3rdparty/pthreads'])]
+    CLLIB = ['/'.join([CLAMAVDEVROOT, '', LIBFILE]),
+             '/'.join([CLAMAVDEVROOT, '', LIBFILE.replace('libclamav', 'pthreads')])]
 else:
     CFLAGS = [ '-Wall', '-O0', '-g3' ]
     LDFLAGS = [ '-L/usr/local/lib' ]
-    LIBS = [ 'clamav' ]
+    LIBS = [ 'clamav', 'pthread', 'z' ]
     CLINCLUDE = [ '/usr/local/include' ]
     CLLIB = []
 